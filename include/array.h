@@ -5,18 +5,105 @@
 #include "value.h"
 #include "gc.h"
 
+/*
+ * Arrays are ring buffers: element i lives at slot (start + i) & (alloc - 1),
+ * and alloc is always a power of two. This lets shift and insertion at
+ * the front move `start' instead of the whole buffer.
+ *
+ * As long as every element is an integer (or every element is a
+ * float) the elements are stored unboxed. The first store of anything
+ * else widens the array to ordinary values.
+ *
+ * Integer ranges aren't stored at all until somebody writes to them;
+ * element i of an ARRAY_RANGE is just first + i * step.
+ *
+ * Slices are views: element i of an ARRAY_VIEW is element
+ * first + i * step of its parent. The parent keeps a list of its views
+ * and makes them copy their elements out before it changes any of the
+ * elements they can see. A view that is written to copies its own
+ * elements first.
+ */
 struct array {
-	struct value *v;
+	enum array_kind {
+		ARRAY_VALUES,
+		ARRAY_INTS,
+		ARRAY_REALS,
+		ARRAY_RANGE,
+		ARRAY_VIEW
+	} kind;
+
+	union {
+		struct value *v;
+		int64_t *ints;
+		double *reals;
+	};
+
 	unsigned len;
 	size_t alloc;
+	size_t start;
+
+	int64_t first, step;
+
+	struct array *parent;
+	struct array **views;
+	size_t num_views;
 };
 
 struct array *new_array();
+struct array *new_array_of(enum array_kind kind);
 struct value array_pop(struct array *a);
 struct value array_shift(struct array *a);
 void free_array(struct array *a);
 void grow_array(struct array *a, size_t size);
 void array_push(struct array *a, struct value r);
 void array_insert(struct array *a, size_t idx, struct value r);
+void array_extend(struct array *a, size_t len);
+void array_store(struct array *a, size_t idx, struct value r);
+void array_widen(struct array *a);
+void array_materialize(struct array *a);
+struct array *copy_array(struct array *a);
+struct array *new_view(struct array *a, int64_t first, int64_t step, size_t len);
+
+#define ARRAY_SLOT(a, i) (((a)->start + (i)) & ((a)->alloc - 1))
+
+static inline struct value
+array_get(struct array *a, size_t idx)
+{
+	switch (a->kind) {
+	case ARRAY_INTS:  return INT(a->ints[ARRAY_SLOT(a, idx)]);
+	case ARRAY_REALS: return FLOAT(a->reals[ARRAY_SLOT(a, idx)]);
+	case ARRAY_RANGE: return INT(a->first + (int64_t)idx * a->step);
+	case ARRAY_VIEW:  return array_get(a->parent, a->first + (int64_t)idx * a->step);
+	default:          return a->v[ARRAY_SLOT(a, idx)];
+	}
+}
+
+/* Stores r at idx, growing the array with nils if it's too short. */
+static inline void
+array_set(struct array *a, size_t idx, struct value r)
+{
+	if (idx < a->len && !a->num_views) {
+		if (a->kind == ARRAY_VALUES) {
+			a->v[ARRAY_SLOT(a, idx)] = r;
+			return;
+		} else if (a->kind == ARRAY_INTS && r.type == VAL_INT) {
+			a->ints[ARRAY_SLOT(a, idx)] = r.integer;
+			return;
+		} else if (a->kind == ARRAY_REALS && r.type == VAL_FLOAT) {
+			a->reals[ARRAY_SLOT(a, idx)] = r.real;
+			return;
+		}
+	}
+
+	array_store(a, idx, r);
+}
+
+/* Whether the array holds nothing but unboxed numbers. */
+static inline bool
+array_packed(struct array *a)
+{
+	if (a->kind == ARRAY_VIEW) a = a->parent;
+	return a->kind != ARRAY_VALUES;
+}
 
 #endif
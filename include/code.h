@@ -9,6 +9,9 @@
 
 #define NUM_REG (1 << 10)
 
+/* The most places control can go after a single instruction. */
+#define MAX_SUCC 256
+
 enum instruction_type {
 	INSTR_NOP,
 
@@ -20,22 +23,31 @@ enum instruction_type {
 	INSTR_JMP,
 	INSTR_ESCAPE,
 	INSTR_PUSH,
+	INSTR_PUSHF,
 	INSTR_POP,
+	INSTR_ARG,
 	INSTR_POPALL,
 	INSTR_CALL,
+	INSTR_TCALL,
 	INSTR_RET,
 	INSTR_PUSHIMP,
 	INSTR_POPIMP,
 	INSTR_GETIMP,
 	INSTR_CHKSTCK,
+	INSTR_FRAME,
 
 	INSTR_PUSHBACK,
 	INSTR_ASET,
 	INSTR_DEREF,
 	INSTR_SUBSCR,
+	INSTR_SUBSCRU,
 	INSTR_SLICE,
 
 	INSTR_MATCH,
+	INSTR_NEXTM,
+	INSTR_WHICH,
+	INSTR_JTAB,
+	INSTR_HTAB,
 	INSTR_RESETR,
 	INSTR_SUBST,
 	INSTR_GROUP,
@@ -52,6 +64,8 @@ enum instruction_type {
 	INSTR_INS,
 	INSTR_REV,
 	INSTR_SORT,
+	INSTR_IREV,
+	INSTR_ISORT,
 	INSTR_ABS,
 	INSTR_COUNT,
 
@@ -109,6 +123,46 @@ enum instruction_type {
 	INSTR_NEG,
 	INSTR_FLIP,
 
+	INSTR_ADD_II,
+	INSTR_SUB_II,
+	INSTR_MUL_II,
+	INSTR_CMP_II,
+	INSTR_LESS_II,
+	INSTR_LEQ_II,
+	INSTR_GEQ_II,
+	INSTR_MORE_II,
+	INSTR_INC_I,
+	INSTR_DEC_I,
+	INSTR_MOV_U,
+	INSTR_COPY_U,
+	INSTR_ARG_U,
+	INSTR_PUSH_U,
+	INSTR_PUSHF_U,
+	INSTR_COND_U,
+	INSTR_NCOND_U,
+	INSTR_ADD_U,
+	INSTR_SUB_U,
+	INSTR_MUL_U,
+	INSTR_POW_U,
+	INSTR_DIV_U,
+	INSTR_MOD_U,
+	INSTR_CMP_U,
+	INSTR_LESS_U,
+	INSTR_LEQ_U,
+	INSTR_GEQ_U,
+	INSTR_MORE_U,
+	INSTR_BAND_U,
+	INSTR_XOR_U,
+	INSTR_BOR_U,
+	INSTR_SLEFT_U,
+	INSTR_SRIGHT_U,
+	INSTR_NEG_U,
+	INSTR_FLIP_U,
+	INSTR_LEN_U,
+	INSTR_INC_U,
+	INSTR_DEC_U,
+	INSTR_SUBSCR_U,
+
 	INSTR_PRINT,
 	INSTR_LINE,
 
@@ -143,8 +197,21 @@ struct instruction_data {
 	char *name;
 };
 
+/* The fields of an instruction, as bits. */
+enum {
+	FIELD_A = 1,
+	FIELD_B = 2,
+	FIELD_C = 4,
+	FIELD_D = 8,
+	FIELD_E = 16
+};
+
 extern struct instruction_data instruction_data[];
 void print_instruction(FILE *f, struct instruction c);
 void print_code(FILE *f, struct instruction *code, size_t num_instr);
 
+void instruction_operands(struct instruction c, int *use, int *def);
+uint16_t *instruction_field(struct instruction *c, int f);
+int instruction_successors(struct instruction c, size_t ip, size_t *succ);
+
 #endif
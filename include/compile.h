@@ -31,9 +31,17 @@ struct compiler {
 
 	int *stack_base;
 	int *stack_top;
+	size_t *segment;
+	int *temps;
 	int *var;
 	int sp;
 
+	/* how many calls deep the current expression has been inlined */
+	int inlining;
+
+	/* set while compiling a call whose result is returned */
+	bool tail;
+
 	bool eval;
 	bool debug;
 	bool in_expr;
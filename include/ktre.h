@@ -72,12 +72,20 @@ enum {
 	KTRE_CONTINUE    = 1 << 5
 };
 
+/* matching engines */
+enum ktre_engine {
+	KTRE_ENGINE_BACKTRACK,
+	KTRE_ENGINE_NFA
+};
+
 /* settings and limits */
 #define KTRE_MAX_ERROR_LEN 100
 #define KTRE_MAX_GROUPS 100
 #define KTRE_MAX_THREAD 200
 #define KTRE_MAX_CALL_DEPTH 100
 #define KTRE_MEM_CAP 100000000
+#define KTRE_MAX_MEMO (1 << 22) /* bits of (ip, sp) states */
+#define KTRE_MAX_AC (1 << 20)   /* ints of automaton transitions */
 
 struct ktre_info {
 	int ba;  /* bytes allocated */
@@ -90,6 +98,12 @@ struct ktre_info {
 
 	int parser_alloc;
 	int runtime_alloc;
+
+	/* states the backtracker didn't explore again */
+	int pruned;
+
+	/* the engine ktre_compile picked to run the pattern */
+	enum ktre_engine engine;
 };
 
 struct ktre_minfo {
@@ -99,6 +113,26 @@ struct ktre_minfo {
 	struct ktre_minfo *prev, *next;
 };
 
+/*
+ * An Aho-Corasick automaton for a pattern that's just an alternation
+ * of literals. Bytes that appear in none of the literals all share
+ * column 0 of the transition table.
+ */
+struct ktre_ac {
+	char **alt;   /* the literals, in order */
+	int *alt_len;
+	int num_alt;
+	int max_len;
+
+	unsigned char class[256];
+	int num_class;
+
+	int *next;    /* num_class transitions for every state */
+	int *longest; /* the longest literal a state ends in, or 0 */
+	int *lowest;  /* the first literal a state ends in, or -1 */
+	int num_states;
+};
+
 struct ktre {
 	/* ===== public fields ===== */
 	int num_matches;
@@ -149,16 +183,78 @@ struct ktre {
 	struct thread {
 		int ip, sp, fp, la, ep, opt;
 		int *frame, *vec, *prog, *las, *exception;
+		int frame_alloc, las_alloc, exception_alloc;
 		_Bool die, rev;
 	} *t;
 
 	int tp, max_tp;
 	int **vec;
 
+	/*
+	 * Runtime storage that's kept between runs: the vec and
+	 * prog arrays of every thread, back to back, and the
+	 * vectors of the matches found by the last run.
+	 */
+	int *thread_store;
+	int *match_store;
+	int match_alloc;
+
+	/*
+	 * The automaton engine runs its own copy of the program in
+	 * which every instruction consumes at most one character.
+	 */
+	struct instr *nfa;
+	int nfa_len;
+
+	struct nfa_list {
+		struct nfa_thread {
+			int ip, opt;
+			int *vec;
+		} *t;
+		int n;
+	} list[2];
+
+	int *mark; /* the generation an instruction was last added in */
+	int gen;
+	int *caps; /* capture vectors for both lists and the match */
+
+	/* prefilter */
+	_Bool has_first;
+	_Bool first[256]; /* the characters a match can begin with */
+	int first_char;   /* the only character in first, or -1 */
+	char *lit;        /* a literal that every match contains */
+	char *delim;      /* the whole pattern, if it's just a literal */
+	struct ktre_ac *ac;
+
+	int *spans; /* the pieces found by the last split */
+	int span_alloc;
+
+	/*
+	 * Backtracker memoization: memo[ip] is set when nothing but
+	 * the position decides whether a thread at ip will match.
+	 * `seen' has a bit for every such (ip, sp) state that's been
+	 * explored without finding a match in the current run, and
+	 * `trail' holds the states the live threads have been through
+	 * along with the slot of the thread, until it dies.
+	 */
+	_Bool *memo;
+	int *seen;
+	int seen_alloc;
+	int seen_len; /* ints of seen that may be dirty */
+	int *trail;
+	int trail_alloc;
+
 	struct ktre_info info;
 	struct ktre_minfo *minfo;
 
-	_Bool copied;
+	/*
+	 * A copy made by ktre_copy runs the program of the regex
+	 * it was copied from, `prog', with runtime storage of its
+	 * own. The program is freed once the original and every copy
+	 * of it have been; `refs' counts them.
+	 */
+	struct ktre *prog;
+	int refs;
 };
 
 typedef struct ktre ktre;
@@ -167,11 +263,16 @@ typedef struct ktre ktre;
 ktre *ktre_compile(const char *pat, int opt);
 ktre *ktre_copy(ktre *re);
 _Bool ktre_exec(ktre *re, const char *subject, int ***vec);
+_Bool ktre_next(ktre *re, const char *subject, int len, int ***vec);
+void ktre_rewind(ktre *re);
 _Bool ktre_match(const char *subject, const char *pat, int opt, int ***vec);
 char *ktre_filter(ktre *re, const char *subject, const char *replacement, const char *indicator);
 char *ktre_replace(const char *subject, const char *pat, const char *replacement, const char *indicator, int opt);
 char **ktre_split(ktre *re, const char *subject, int *len);
+int const *ktre_split_spans(ktre *re, const char *subject, int *len);
 int **ktre_getvec(const ktre *re);
+int const *const *ktre_borrowvec(const ktre *re);
+int ktre_which(ktre *re, const char *subject, int len);
 struct ktre_info ktre_free(ktre *re);
 
 #ifdef __cplusplus
@@ -229,6 +330,10 @@ static void error(struct ktre *re, enum ktre_error err, int loc, char *fmt, ...)
 #define KTRE_FREE    free
 #endif
 
+#ifndef KTRE_REALLOC
+#define KTRE_REALLOC realloc
+#endif
+
 static void *_ktre_malloc (struct ktre *re,            size_t n, const char *file, int line);
 static void *_ktre_realloc(struct ktre *re, void *ptr, size_t n, const char *file, int line);
 static void  _ktre_free   (struct ktre *re, void *ptr);
@@ -282,19 +387,29 @@ _ktre_realloc(struct ktre *re, void *ptr, size_t n, const char *file, int line)
 	if (diff <= 0) return ptr;
 
 	if (re->info.ba + diff > KTRE_MEM_CAP) {
-		KTRE_FREE(ptr);
 		error(re, KTRE_ERROR_OUT_OF_MEMORY, 0, NULL);
 		return NULL;
 	}
 
-	void *p = _ktre_malloc(re, n, file, line);
+	/* grow the block in place and fix up the list around it */
+	mi = KTRE_REALLOC(mi, n + sizeof (struct ktre_minfo));
+
+	if (!mi) {
+		error(re, KTRE_ERROR_OUT_OF_MEMORY, 0, NULL);
+		return NULL;
+	}
 
-	if (p)
-		memcpy(p, ptr, (int)n > mi->size ? mi->size : (int)n);
+	if (mi->prev) mi->prev->next = mi;
+	else re->minfo = mi;
+	if (mi->next) mi->next->prev = mi;
 
-	_ktre_free(re, ptr);
+	mi->file = file;
+	mi->line = line;
+	mi->size = (int)n;
+	re->info.ba += diff;
+	re->info.mba += diff;
 
-	return p;
+	return mi + 1;
 }
 
 static void
@@ -383,7 +498,13 @@ struct instr {
 		INSTR_DIGIT,
 		INSTR_SPACE,
 		INSTR_WORD,
-		INSTR_RET
+		INSTR_RET,
+
+		/*
+		 * A possessive run of the single character
+		 * instruction at a, continuing at b.
+		 */
+		INSTR_RUN
 	} op;
 
 	union {
@@ -394,6 +515,12 @@ struct instr {
 		char *class;
 	};
 
+	/*
+	 * CLASS and NOT: the class as a bitmap, followed by the
+	 * bitmap to use when matching case-insensitively.
+	 */
+	unsigned char *map;
+
 	int loc;
 };
 
@@ -446,6 +573,8 @@ emit_c(struct ktre *re, int instr, int c, int loc)
 	re->ip++;
 }
 
+static unsigned char *class_map(struct ktre *re, int instr, const char *class);
+
 static void
 emit_class(struct ktre *re, int instr, char *class, int loc)
 {
@@ -454,8 +583,12 @@ emit_class(struct ktre *re, int instr, char *class, int loc)
 
 	re->c[re->ip].op = instr;
 	re->c[re->ip].class = class;
+	re->c[re->ip].map = NULL;
 	re->c[re->ip].loc = loc;
 
+	if (instr == INSTR_CLASS || instr == INSTR_NOT)
+		re->c[re->ip].map = class_map(re, instr, class);
+
 	re->ip++;
 }
 
@@ -595,6 +728,50 @@ uc(char c)
 	return c >= 'a' && c <= 'z' ? (c - 'a') + 'A' : c;
 }
 
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+static inline bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+static inline bool
+is_word(char c)
+{
+	return c == '_' || is_digit(c)
+		|| (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/* 256-bit character sets */
+#define MAP_SET(m,c)  ((m)[(unsigned char)(c) >> 3] |= 1 << ((unsigned char)(c) & 7))
+#define MAP_TEST(m,c) ((m)[(unsigned char)(c) >> 3] &  1 << ((unsigned char)(c) & 7))
+
+/*
+ * Builds the bitmaps for a CLASS or NOT instruction. Case folding
+ * only applies to CLASS, the same as it always has.
+ */
+static unsigned char *
+class_map(struct ktre *re, int instr, const char *class)
+{
+	unsigned char *map = _malloc(64);
+	if (!map) return NULL;
+	memset(map, 0, 64);
+
+	for (int c = 1; c < 256; c++) {
+		bool in = !!strchr(class, c);
+
+		if (instr == INSTR_NOT) {
+			if (!in) {
+				MAP_SET(map, c);
+				MAP_SET(map + 32, c);
+			}
+
+			continue;
+		}
+
+		if (in) MAP_SET(map, c);
+		if (in || strchr(class, lc(c))) MAP_SET(map + 32, c);
+	}
+
+	return map;
+}
+
 static inline void
 lc_str(char *s)
 {
@@ -2290,178 +2467,880 @@ compile(struct ktre *re, struct node *n, bool rev)
 	}
 }
 
-#ifdef KTRE_DEBUG
-static void
-print_compile_error(struct ktre *re)
+/* Whether n can match without consuming anything. */
+static bool
+nullable(struct node *n)
 {
-	DBG("\nfailed to compile with error code %d: %s\n",
-		        re->err, re->err_str ? re->err_str : "no error message");
-	DBG("\t%s\n\t", re->pat);
-	for (int i = 0; i < re->loc; i++)
-		if (re->pat[i] == '\t') DBG("\t");
-		else DBG(" ");
-	DBG("^");
+	if (!n) return true;
+
+	switch (n->type) {
+	case NODE_SEQUENCE: return nullable(n->a) && nullable(n->b);
+	case NODE_OR:       return nullable(n->a) || nullable(n->b);
+	case NODE_ASTERISK: case NODE_QUESTION: return true;
+	case NODE_PLUS: case NODE_GROUP: case NODE_ATOM: return nullable(n->a);
+	case NODE_REP:      return n->c == 0 || nullable(n->a);
+	case NODE_CHAR: case NODE_ANY: case NODE_MANY: case NODE_CLASS:
+	case NODE_NOT: case NODE_STR: case NODE_DIGIT: case NODE_SPACE:
+	case NODE_WORD:
+		return false;
+	default: return true;
+	}
 }
 
-static void
-print_finish(struct ktre *re, const char *subject, const char *regex, bool ret, int **vec, const char *replaced)
+/*
+ * Whether a group sits inside a loop whose body can match empty. The
+ * backtracker stops such a loop on its first empty iteration and
+ * keeps the captures that iteration made; the automaton settles on a
+ * different iteration, so these patterns go to the backtracker.
+ */
+static bool
+empty_loop_group(struct node *n, bool in_loop)
 {
-	if (ret) {
-		for (int i = 0; i < re->num_matches; i++) {
-			DBG("\nmatch %d: `%.*s`", i + 1, vec[i][1], subject + vec[i][0]);
+	if (!n) return false;
 
-			for (int j = 1; j < re->num_groups; j++) {
-				if (vec[i][j * 2 + 1] && vec[i][j * 2] != (int)strlen(subject))
-					DBG("\ngroup %d: `%.*s`", j, vec[i][j * 2 + 1], subject + vec[i][j * 2]);
-			}
-		}
-
-		if (replaced) {
-			DBG("\nreplace: `%s`", replaced);
-		}
-	} else if (re->err) {
-		DBG("\nfailed at runtime with error code %d: %s\n",
-		        re->err, re->err_str ? re->err_str : "no error message");
-		DBG("\t%s\n\t", regex);
-		for (int i = 0; i < re->loc; i++) DBG(" ");
-		DBG("^");
-	} else {
-		DBG("\nno matches.");
+	switch (n->type) {
+	case NODE_ASTERISK: case NODE_PLUS: case NODE_REP:
+		return empty_loop_group(n->a, in_loop || nullable(n->a));
+	case NODE_GROUP:
+		return in_loop || empty_loop_group(n->a, in_loop);
+	case NODE_SEQUENCE: case NODE_OR:
+		return empty_loop_group(n->a, in_loop)
+			|| empty_loop_group(n->b, in_loop);
+	case NODE_QUESTION: case NODE_ATOM:
+	case NODE_PLA: case NODE_PLB: case NODE_NLA: case NODE_NLB:
+		return empty_loop_group(n->a, in_loop);
+	default: return false;
 	}
 }
-#else
-#define print_compile_error(x)
-#define print_finish(a,b,c,d,e,f) do {} while (0)
-#endif
 
-struct ktre *
-ktre_compile(const char *pat, int opt)
+/*
+ * Tests whether the character at sp is accepted by `c', which must
+ * be an instruction that consumes a single character.
+ */
+static bool
+accepts(const struct instr *c, int opt, const char *subject, int sp, int len)
 {
-	if (!pat) return NULL;
+	if (sp < 0 || sp >= len) return false;
+	char ch = subject[sp];
+
+	switch (c->op) {
+	case INSTR_CHAR:
+		if (opt & KTRE_INSENSITIVE) return lc(ch) == lc(c->c);
+		return ch == c->c;
+
+	case INSTR_CLASS: case INSTR_NOT:
+		return MAP_TEST(c->map + (opt & KTRE_INSENSITIVE ? 32 : 0), ch);
+
+	case INSTR_ANY:   return (opt & KTRE_MULTILINE) || ch != '\n';
+	case INSTR_MANY:  return true;
+	case INSTR_DIGIT: return is_digit(ch);
+	case INSTR_WORD:  return is_word(ch);
+	case INSTR_SPACE: return is_space(ch);
+	default: return false;
+	}
+}
 
-	struct ktre *re = KTRE_MALLOC(sizeof *re);
-	memset(re, 0, sizeof *re);
+static bool
+is_single(int op)
+{
+	switch (op) {
+	case INSTR_CHAR: case INSTR_CLASS: case INSTR_NOT: case INSTR_ANY:
+	case INSTR_MANY: case INSTR_DIGIT: case INSTR_WORD: case INSTR_SPACE:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	if (opt & KTRE_GLOBAL) opt |= KTRE_UNANCHORED;
+/* Adds every character `c' can consume first to `set'. */
+static void
+consumes(struct ktre *re, const struct instr *c, unsigned char *set)
+{
+	if (c->op == INSTR_STR || c->op == INSTR_TSTR) {
+		MAP_SET(set, c->class[0]);
+		if (re->opt & KTRE_INSENSITIVE) MAP_SET(set, uc(c->class[0]));
+		return;
+	}
 
-#ifdef KTRE_DEBUG
-	DBG("regexpr: %s", pat);
-	if (opt) DBG("\noptions:");
-	for (size_t i = 0; i < sizeof opt; i++) {
-		switch (opt & 1 << i) {
-		case KTRE_INSENSITIVE: DBG("\n\tINSENSITIVE"); break;
-		case KTRE_UNANCHORED:  DBG("\n\tUNANCHORED");  break;
-		case KTRE_EXTENDED:    DBG("\n\tEXTENDED");    break;
-		case KTRE_GLOBAL:      DBG("\n\tGLOBAL");      break;
-		case KTRE_CONTINUE:    DBG("\n\tCONTINUE");    break;
-		default: continue;
-		}
+	for (int ch = 1; ch < 256; ch++) {
+		char s[2] = { ch, 0 };
+		if (accepts(c, re->opt, s, 0, 1)) MAP_SET(set, ch);
 	}
-#endif
+}
 
-	re->pat     = pat;
-	re->opt     = opt;
-	re->sp      = pat;
-	re->popt    = opt;
-	re->max_tp  = -1;
-	re->err_str = "no error";
-	re->n       = new_node(re);
+/*
+ * Adds the characters the program can consume first from ip onwards
+ * to `set'. Returns false if a path runs into anything that depends
+ * on more than the next character, like an assertion.
+ */
+static bool
+follow_set(struct ktre *re, int ip, unsigned char *set, bool *seen)
+{
+	while (!seen[ip]) {
+		struct instr *c = re->c + ip;
+		seen[ip] = true;
 
-	if ((opt & KTRE_CONTINUE) && (opt & KTRE_GLOBAL)) {
-		error(re, KTRE_ERROR_INVALID_OPTIONS, 0,
-		      "invalid option configuration: /c and /g may not be used together");
+		switch (c->op) {
+		case INSTR_MATCH:
+			return true;
 
-		re->n = NULL;
-		print_compile_error(re);
-		return re;
-	}
+		case INSTR_JMP:
+			ip = c->c;
+			break;
 
-	if (!re->n) {
-		re->n = NULL;
-		print_compile_error(re);
-		return re;
-	}
+		case INSTR_BRANCH:
+			if (!follow_set(re, c->a, set, seen)) return false;
+			ip = c->b;
+			break;
 
-	re->n->loc  = 0;
-	re->n->type = NODE_GROUP;
-	re->n->gi   = add_group(re);
+		case INSTR_SAVE: case INSTR_PROG: case INSTR_SET_START:
+			ip++;
+			break;
 
-	if (re->n->gi < 0) {
-		re->n = NULL;
-		print_compile_error(re);
-		return re;
-	}
+		case INSTR_RUN:
+			consumes(re, re->c + c->a, set);
+			return true;
 
-	re->group[0].is_compiled = false;
-	re->group[0].is_called   = false;
-	re->n->a                 = NULL;
-	struct node *n           = parse(re);
-	re->n->a                 = n;
+		case INSTR_STR: case INSTR_TSTR:
+			consumes(re, c, set);
+			return true;
 
-	if (re->err) {
-		free_node(re, re->n);
-		re->n = NULL;
-		print_compile_error(re);
-		return re;
+		default:
+			if (!is_single(c->op)) return false;
+			consumes(re, c, set);
+			return true;
+		}
 	}
 
-	if (*re->sp) {
-		error(re, KTRE_ERROR_SYNTAX_ERROR,
-		      re->sp - re->pat,
-		      "unmatched righthand delimiter");
+	return true;
+}
 
-		print_compile_error(re);
-		return re;
+/*
+ * A one-or-more loop over a single character instruction X compiles
+ * to PROG, X, BRANCH; a zero-or-more loop is a BRANCH around the same
+ * thing. When nothing that can follow the loop begins with a
+ * character X accepts, backtracking into the loop can never lead to
+ * a match, so it's replaced with a RUN that consumes as much as it
+ * can in one go instead of leaving a thread behind per character.
+ * Programs that change their options midway or match backwards are
+ * left alone.
+ */
+static void
+possessify(struct ktre *re)
+{
+	for (int i = 0; i < re->ip; i++) {
+		switch (re->c[i].op) {
+		case INSTR_SETOPT: case INSTR_PLB: case INSTR_NLB:
+			return;
+		default: break;
+		}
 	}
 
-	print_node(re, re->n);
+	bool *seen = _malloc(re->ip * sizeof *seen);
+	if (!seen) return;
 
-	if (re->opt & KTRE_UNANCHORED) {
-		/*
-		 * To implement unanchored matching (the default for
-		 * most engines) we could have the VM just try to
-		 * match the regex at every position in the string,
-		 * but that's inefficient. Instead, we'll just bake
-		 * the unanchored matching right into the bytecode by
-		 * manually emitting the instructions for `.*?`.
-		 */
-		emit_ab(re, INSTR_BRANCH, 3, 1, 0);
-		emit(re, INSTR_MANY, 0);
-		emit_ab(re, INSTR_BRANCH, 3, 1, 0);
-	}
+	for (int i = 0; i + 2 < re->ip; i++) {
+		struct instr *c = re->c + i;
 
-	compile(re, re->n, false);
-	re->num_groups = re->gp;
+		if (c[0].op != INSTR_PROG || !is_single(c[1].op)
+		    || c[2].op != INSTR_BRANCH || c[2].a != i || c[2].b != i + 3)
+			continue;
 
-	if (re->err) {
-		print_compile_error(re);
-		return re;
+		unsigned char x[32] = { 0 }, follow[32] = { 0 };
+		memset(seen, 0, re->ip * sizeof *seen);
+		consumes(re, c + 1, x);
+
+		if (!follow_set(re, i + 3, follow, seen)) continue;
+
+		bool disjoint = true;
+
+		for (int j = 0; j < 32; j++)
+			if (x[j] & follow[j]) disjoint = false;
+
+		if (!disjoint) continue;
+
+		c->op = INSTR_RUN;
+		c->a = i + 1;
+		c->b = i + 3;
 	}
 
-	emit(re, INSTR_MATCH, re->sp - re->pat);
+	_free(seen);
+}
+
+/*
+ * The automaton engine keeps a set of threads and advances all of
+ * them one character at a time, so it can't do anything that needs
+ * to know a thread's history: backreferences, subroutine calls
+ * (including counted repetition of groups), atomic groups,
+ * lookaround and groups inside loops that can match empty are left
+ * to the backtracker.
+ */
+static bool
+nfa_compatible(struct ktre *re)
+{
+	if (empty_loop_group(re->n, false)) return false;
 
-#ifdef KTRE_DEBUG
 	for (int i = 0; i < re->ip; i++) {
-		for (int j = 0; j < re->num_groups; j++) {
-			if (re->group[j].address == i)
-				DBG("\ngroup %d:", j);
+		switch (re->c[i].op) {
+		case INSTR_BACKREF: case INSTR_CALL: case INSTR_RET:
+		case INSTR_TRY: case INSTR_CATCH:
+		case INSTR_PLA: case INSTR_PLA_WIN:
+		case INSTR_NLA: case INSTR_NLA_FAIL:
+		case INSTR_PLB: case INSTR_PLB_WIN:
+		case INSTR_NLB: case INSTR_NLB_FAIL:
+			return false;
+		default: break;
 		}
+	}
 
-		DBG("\n%3d: [%3d] ", i, re->c[i].loc);
+	return true;
+}
 
-		switch (re->c[i].op) {
-		case INSTR_CLASS: DBG("CLASS   '"); dbgf(re->c[i].class); DBG("'");    break;
-		case INSTR_STR:   DBG("STR     '"); dbgf(re->c[i].class); DBG("'");    break;
-		case INSTR_NOT:   DBG("NOT     '"); dbgf(re->c[i].class); DBG("'");    break;
-		case INSTR_TSTR:  DBG("TSTR    '"); dbgf(re->c[i].class); DBG("'");    break;
-		case INSTR_BRANCH:    DBG("BRANCH   %d, %d", re->c[i].a, re->c[i].b); break;
-		case INSTR_CHAR:      DBG("CHAR    '%c'", re->c[i].a);                 break;
-		case INSTR_SAVE:      DBG("SAVE     %d",  re->c[i].a);                 break;
-		case INSTR_JMP:       DBG("JMP      %d",  re->c[i].a);                 break;
-		case INSTR_SETOPT:    DBG("SETOPT   %d",  re->c[i].a);                 break;
-		case INSTR_BACKREF:   DBG("BACKREF  %d",  re->c[i].a);                 break;
-		case INSTR_CALL:      DBG("CALL     %d",  re->c[i].a);                 break;
-		case INSTR_PROG:      DBG("PROG     %d",  re->c[i].a);                 break;
+static void
+compile_nfa(struct ktre *re)
+{
+	int *addr = _malloc((re->ip + 1) * sizeof *addr);
+	if (!addr) return;
+
+	int len = 0;
+
+	for (int i = 0; i < re->ip; i++) {
+		addr[i] = len;
+
+		if (re->c[i].op == INSTR_STR || re->c[i].op == INSTR_TSTR)
+			len += strlen(re->c[i].class);
+		else
+			len++;
+	}
+
+	addr[re->ip] = len;
+	re->nfa = _malloc(len * sizeof *re->nfa);
+
+	if (!re->nfa) {
+		_free(addr);
+		return;
+	}
+
+	for (int i = 0; i < re->ip; i++) {
+		struct instr *c = re->nfa + addr[i];
+
+		switch (re->c[i].op) {
+		case INSTR_STR: case INSTR_TSTR:
+			for (int j = 0; re->c[i].class[j]; j++) {
+				c[j].op = INSTR_CHAR;
+				c[j].c = re->c[i].class[j];
+				c[j].loc = re->c[i].loc;
+			}
+			break;
+
+		case INSTR_BRANCH:
+			*c = re->c[i];
+			c->a = addr[re->c[i].a];
+			c->b = addr[re->c[i].b];
+			break;
+
+		case INSTR_JMP:
+			*c = re->c[i];
+			c->c = addr[re->c[i].c];
+			break;
+
+		case INSTR_RUN:
+			/* run it as the loop it came from */
+			*c = re->c[i];
+			c->op = INSTR_JMP;
+			c->c = addr[i + 1];
+			break;
+
+		default:
+			*c = re->c[i];
+		}
+	}
+
+	re->nfa_len = len;
+	re->info.engine = KTRE_ENGINE_NFA;
+	_free(addr);
+}
+
+/*
+ * A thread that can't reach anything which depends on its history
+ * will do the same thing from a given position no matter how it got
+ * there. Once such a state has been explored without finding a match
+ * it will never find one, so the backtracker can skip it the next
+ * time around; this keeps patterns like (a|aa)*c from taking
+ * exponential time when a backreference elsewhere keeps them off the
+ * automaton engine.
+ *
+ * PROG only stops a loop from going around again at the position it
+ * began at, which is a state that's still being explored and so
+ * never pruned; it doesn't get in the way.
+ */
+static void
+find_memo(struct ktre *re)
+{
+	re->memo = _malloc(re->ip * sizeof *re->memo);
+	if (!re->memo) return;
+
+	for (int i = 0; i < re->ip; i++) {
+		switch (re->c[i].op) {
+		case INSTR_BACKREF: case INSTR_CALL: case INSTR_RET:
+		case INSTR_TRY: case INSTR_CATCH: case INSTR_SETOPT:
+		case INSTR_PLA: case INSTR_PLA_WIN:
+		case INSTR_NLA: case INSTR_NLA_FAIL:
+		case INSTR_PLB: case INSTR_PLB_WIN:
+		case INSTR_NLB: case INSTR_NLB_FAIL:
+			re->memo[i] = false;
+			break;
+		default:
+			re->memo[i] = true;
+		}
+	}
+
+	bool changed = true;
+
+	while (changed) {
+		changed = false;
+
+		for (int i = re->ip - 1; i >= 0; i--) {
+			struct instr *c = re->c + i;
+			bool ok = re->memo[i];
+
+			if (!ok) continue;
+
+			switch (c->op) {
+			case INSTR_MATCH: break;
+			case INSTR_JMP: ok = re->memo[c->c]; break;
+			case INSTR_BRANCH: ok = re->memo[c->a] && re->memo[c->b]; break;
+			case INSTR_RUN: ok = re->memo[c->a] && re->memo[c->b]; break;
+			default: ok = i + 1 < re->ip && re->memo[i + 1];
+			}
+
+			if (!ok) {
+				re->memo[i] = false;
+				changed = true;
+			}
+		}
+	}
+}
+
+/* The bit of `seen' for (ip, sp), with sp counted from the start. */
+#define SEEN_BIT(re,ip,sp) ((sp) * (re)->ip + (ip))
+
+static bool
+seen(struct ktre *re, int k)
+{
+	return (unsigned)re->seen[k / 32] & (1u << (k % 32));
+}
+
+static void
+mark_seen(struct ktre *re, int k)
+{
+	re->seen[k / 32] |= 1u << (k % 32);
+	if (k / 32 >= re->seen_len) re->seen_len = k / 32 + 1;
+}
+
+/*
+ * Appends the text n matches to *s if n is nothing but a literal,
+ * returning false if it's anything else.
+ */
+static bool
+literal_text(struct ktre *re, struct node *n, char **s)
+{
+	switch (n->type) {
+	case NODE_CHAR:
+		append_char(re, s, n->c);
+		return !!*s;
+
+	case NODE_STR:
+		append_str(re, s, n->class);
+		return !!*s;
+
+	case NODE_CLASS:
+		if (strlen(n->class) != 1) return false;
+		append_str(re, s, n->class);
+		return !!*s;
+
+	case NODE_SEQUENCE:
+		return literal_text(re, n->a, s) && literal_text(re, n->b, s);
+
+	default: return false;
+	}
+}
+
+/* Collects the literals of an alternation, in order. */
+static bool
+collect_alts(struct ktre *re, struct node *n, struct ktre_ac *ac)
+{
+	if (n->type == NODE_OR)
+		return collect_alts(re, n->a, ac) && collect_alts(re, n->b, ac);
+
+	char *s = NULL;
+
+	if (!literal_text(re, n, &s) || !s) {
+		_free(s);
+		return false;
+	}
+
+	ac->alt = _realloc(ac->alt, (ac->num_alt + 1) * sizeof *ac->alt);
+	ac->alt_len = _realloc(ac->alt_len, (ac->num_alt + 1) * sizeof *ac->alt_len);
+
+	if (!ac->alt || !ac->alt_len) {
+		_free(s);
+		return false;
+	}
+
+	int len = strlen(s);
+	ac->alt[ac->num_alt] = s;
+	ac->alt_len[ac->num_alt++] = len;
+	if (len > ac->max_len) ac->max_len = len;
+
+	return true;
+}
+
+static void
+free_ac(struct ktre *re, struct ktre_ac *ac)
+{
+	for (int i = 0; i < ac->num_alt; i++)
+		_free(ac->alt[i]);
+
+	_free(ac->alt);
+	_free(ac->alt_len);
+	_free(ac->next);
+	_free(ac->longest);
+	_free(ac->lowest);
+	_free(ac);
+}
+
+/*
+ * Builds the automaton for a pattern that's an alternation of
+ * literals. The trie is turned into a DFA by filling in every missing
+ * transition from the state's failure link, so running it is one
+ * table lookup per byte of the subject.
+ */
+static void
+build_ac(struct ktre *re)
+{
+	struct ktre_ac *ac = _malloc(sizeof *ac);
+	if (!ac) return;
+	memset(ac, 0, sizeof *ac);
+
+	if (!collect_alts(re, re->n->a, ac)) {
+		free_ac(re, ac);
+		return;
+	}
+
+	int total = 1;
+	ac->num_class = 1;
+
+	for (int i = 0; i < ac->num_alt; i++) {
+		total += ac->alt_len[i];
+
+		for (int j = 0; j < ac->alt_len[i]; j++) {
+			unsigned char c = ac->alt[i][j];
+			if (!ac->class[c]) ac->class[c] = ac->num_class++;
+		}
+	}
+
+	if ((long long)total * ac->num_class > KTRE_MAX_AC) {
+		free_ac(re, ac);
+		return;
+	}
+
+	int nc = ac->num_class;
+	int *fail = _malloc(total * sizeof *fail);
+	ac->next = _malloc(total * nc * sizeof *ac->next);
+	ac->longest = _malloc(total * sizeof *ac->longest);
+	ac->lowest = _malloc(total * sizeof *ac->lowest);
+
+	if (!fail || !ac->next || !ac->longest || !ac->lowest) {
+		_free(fail);
+		free_ac(re, ac);
+		return;
+	}
+
+	memset(ac->next, -1, total * nc * sizeof *ac->next);
+	memset(ac->longest, 0, total * sizeof *ac->longest);
+	memset(ac->lowest, -1, total * sizeof *ac->lowest);
+	ac->num_states = 1;
+
+	for (int i = 0; i < ac->num_alt; i++) {
+		int s = 0;
+
+		for (int j = 0; j < ac->alt_len[i]; j++) {
+			int *t = ac->next + s * nc + ac->class[(unsigned char)ac->alt[i][j]];
+			if (*t < 0) *t = ac->num_states++;
+			s = *t;
+		}
+
+		ac->longest[s] = ac->alt_len[i];
+		if (ac->lowest[s] < 0) ac->lowest[s] = i;
+	}
+
+	/* the failure links are found breadth first */
+	int *order = _malloc(total * sizeof *order);
+	int head = 0, tail = 0;
+
+	if (!order) {
+		_free(fail);
+		free_ac(re, ac);
+		return;
+	}
+
+	for (int c = 0; c < nc; c++) {
+		int *t = ac->next + c;
+
+		if (*t <= 0) {
+			*t = 0;
+		} else {
+			fail[*t] = 0;
+			order[tail++] = *t;
+		}
+	}
+
+	while (head < tail) {
+		int s = order[head++];
+		int f = fail[s];
+
+		if (ac->longest[f] > ac->longest[s])
+			ac->longest[s] = ac->longest[f];
+		if (ac->lowest[f] >= 0 && (ac->lowest[s] < 0 || ac->lowest[f] < ac->lowest[s]))
+			ac->lowest[s] = ac->lowest[f];
+
+		for (int c = 0; c < nc; c++) {
+			int *t = ac->next + s * nc + c;
+
+			if (*t < 0) {
+				*t = ac->next[f * nc + c];
+			} else {
+				fail[*t] = ac->next[f * nc + c];
+				order[tail++] = *t;
+			}
+		}
+	}
+
+	_free(order);
+	_free(fail);
+	re->ac = ac;
+}
+
+/*
+ * Adds the characters a match of n can begin with to re->first.
+ * Returns true if n can match without consuming anything, in which
+ * case whatever follows it may begin the match as well. `any' is set
+ * if n can begin with characters we can't enumerate.
+ */
+static bool
+first_chars(struct ktre *re, struct node *n, bool *any)
+{
+	if (!n) return true;
+
+	switch (n->type) {
+	case NODE_CHAR:  re->first[(unsigned char)n->c] = true;        return false;
+	case NODE_STR:   re->first[(unsigned char)n->class[0]] = true; return false;
+	case NODE_DIGIT: for (const char *c = DIGIT; *c; c++)      re->first[(unsigned char)*c] = true; return false;
+	case NODE_WORD:  for (const char *c = WORD; *c; c++)       re->first[(unsigned char)*c] = true; return false;
+	case NODE_SPACE: for (const char *c = WHITESPACE; *c; c++) re->first[(unsigned char)*c] = true; return false;
+
+	case NODE_CLASS:
+		for (const char *c = n->class; *c; c++)
+			re->first[(unsigned char)*c] = true;
+		return false;
+
+	case NODE_NOT: case NODE_ANY: case NODE_MANY:
+		*any = true;
+		return false;
+
+	case NODE_SEQUENCE:
+		if (!first_chars(re, n->a, any)) return false;
+		return first_chars(re, n->b, any);
+
+	case NODE_OR: {
+		bool a = first_chars(re, n->a, any);
+		bool b = first_chars(re, n->b, any);
+		return a || b;
+	}
+
+	case NODE_GROUP: case NODE_ATOM: case NODE_PLUS:
+		return first_chars(re, n->a, any);
+
+	case NODE_ASTERISK: case NODE_QUESTION:
+		first_chars(re, n->a, any);
+		return true;
+
+	case NODE_REP:
+		return first_chars(re, n->a, any) || n->c == 0;
+
+	case NODE_BACKREF: case NODE_CALL: case NODE_RECURSE: case NODE_SETOPT:
+		*any = true;
+		return true;
+
+	default:
+		/* zero-width assertions */
+		return true;
+	}
+}
+
+/* Finds the longest literal string that every match of n contains. */
+static void
+required_literal(struct node *n, const char **lit)
+{
+	if (!n) return;
+
+	switch (n->type) {
+	case NODE_STR:
+		if (!*lit || strlen(n->class) > strlen(*lit))
+			*lit = n->class;
+		break;
+
+	case NODE_SEQUENCE:
+		required_literal(n->a, lit);
+		required_literal(n->b, lit);
+		break;
+
+	case NODE_GROUP: case NODE_ATOM: case NODE_PLUS:
+		required_literal(n->a, lit);
+		break;
+
+	case NODE_REP:
+		if (n->c > 0) required_literal(n->a, lit);
+		break;
+
+	default: break;
+	}
+}
+
+/*
+ * Works out what run() can use to skip over parts of the subject
+ * that can't contain a match. Patterns that change their options
+ * midway are left alone since their literals may or may not be
+ * case-insensitive.
+ */
+static void
+prefilter(struct ktre *re)
+{
+	re->first_char = -1;
+
+	for (int i = 0; i < re->ip; i++)
+		if (re->c[i].op == INSTR_SETOPT) return;
+
+	bool any = false;
+
+	if (!first_chars(re, re->n, &any) && !any) {
+		re->has_first = true;
+
+		if (re->opt & KTRE_INSENSITIVE) {
+			for (int c = 'a'; c <= 'z'; c++) {
+				unsigned char u = uc(c);
+				re->first[c] = re->first[u] = re->first[c] || re->first[u];
+			}
+		}
+
+		for (int c = 0; c < 256; c++) {
+			if (!re->first[c]) continue;
+
+			if (re->first_char >= 0) {
+				re->first_char = -1;
+				break;
+			}
+
+			re->first_char = c;
+		}
+	}
+
+	const char *lit = NULL;
+	required_literal(re->n, &lit);
+	if (lit && !(re->opt & KTRE_INSENSITIVE)) re->lit = strclone(re, lit);
+
+	if (re->opt & KTRE_INSENSITIVE || !re->n->a) return;
+
+	char *delim = NULL;
+
+	if (literal_text(re, re->n->a, &delim) && delim)
+		re->delim = delim;
+	else
+		_free(delim);
+
+	if (re->n->a->type == NODE_OR) build_ac(re);
+}
+
+#ifdef KTRE_DEBUG
+static void
+print_compile_error(struct ktre *re)
+{
+	DBG("\nfailed to compile with error code %d: %s\n",
+		        re->err, re->err_str ? re->err_str : "no error message");
+	DBG("\t%s\n\t", re->pat);
+	for (int i = 0; i < re->loc; i++)
+		if (re->pat[i] == '\t') DBG("\t");
+		else DBG(" ");
+	DBG("^");
+}
+
+static void
+print_finish(struct ktre *re, const char *subject, const char *regex, bool ret, int **vec, const char *replaced)
+{
+	if (ret) {
+		for (int i = 0; i < re->num_matches; i++) {
+			DBG("\nmatch %d: `%.*s`", i + 1, vec[i][1], subject + vec[i][0]);
+
+			for (int j = 1; j < re->num_groups; j++) {
+				if (vec[i][j * 2 + 1] && vec[i][j * 2] != (int)strlen(subject))
+					DBG("\ngroup %d: `%.*s`", j, vec[i][j * 2 + 1], subject + vec[i][j * 2]);
+			}
+		}
+
+		if (replaced) {
+			DBG("\nreplace: `%s`", replaced);
+		}
+	} else if (re->err) {
+		DBG("\nfailed at runtime with error code %d: %s\n",
+		        re->err, re->err_str ? re->err_str : "no error message");
+		DBG("\t%s\n\t", regex);
+		for (int i = 0; i < re->loc; i++) DBG(" ");
+		DBG("^");
+	} else {
+		DBG("\nno matches.");
+	}
+}
+#else
+#define print_compile_error(x)
+#define print_finish(a,b,c,d,e,f) do {} while (0)
+#endif
+
+struct ktre *
+ktre_compile(const char *pat, int opt)
+{
+	if (!pat) return NULL;
+
+	struct ktre *re = KTRE_MALLOC(sizeof *re);
+	memset(re, 0, sizeof *re);
+
+	if (opt & KTRE_GLOBAL) opt |= KTRE_UNANCHORED;
+
+#ifdef KTRE_DEBUG
+	DBG("regexpr: %s", pat);
+	if (opt) DBG("\noptions:");
+	for (size_t i = 0; i < sizeof opt; i++) {
+		switch (opt & 1 << i) {
+		case KTRE_INSENSITIVE: DBG("\n\tINSENSITIVE"); break;
+		case KTRE_UNANCHORED:  DBG("\n\tUNANCHORED");  break;
+		case KTRE_EXTENDED:    DBG("\n\tEXTENDED");    break;
+		case KTRE_GLOBAL:      DBG("\n\tGLOBAL");      break;
+		case KTRE_CONTINUE:    DBG("\n\tCONTINUE");    break;
+		default: continue;
+		}
+	}
+#endif
+
+	re->pat     = strclone(re, pat);
+	re->opt     = opt;
+	re->sp      = re->pat;
+	re->popt    = opt;
+	re->max_tp  = -1;
+	re->refs    = 1;
+	re->err_str = "no error";
+	re->n       = new_node(re);
+
+	if ((opt & KTRE_CONTINUE) && (opt & KTRE_GLOBAL)) {
+		error(re, KTRE_ERROR_INVALID_OPTIONS, 0,
+		      "invalid option configuration: /c and /g may not be used together");
+
+		re->n = NULL;
+		print_compile_error(re);
+		return re;
+	}
+
+	if (!re->n) {
+		re->n = NULL;
+		print_compile_error(re);
+		return re;
+	}
+
+	re->n->loc  = 0;
+	re->n->type = NODE_GROUP;
+	re->n->gi   = add_group(re);
+
+	if (re->n->gi < 0) {
+		re->n = NULL;
+		print_compile_error(re);
+		return re;
+	}
+
+	re->group[0].is_compiled = false;
+	re->group[0].is_called   = false;
+	re->n->a                 = NULL;
+	struct node *n           = parse(re);
+	re->n->a                 = n;
+
+	if (re->err) {
+		free_node(re, re->n);
+		re->n = NULL;
+		print_compile_error(re);
+		return re;
+	}
+
+	if (*re->sp) {
+		error(re, KTRE_ERROR_SYNTAX_ERROR,
+		      re->sp - re->pat,
+		      "unmatched righthand delimiter");
+
+		print_compile_error(re);
+		return re;
+	}
+
+	print_node(re, re->n);
+
+	if (re->opt & KTRE_UNANCHORED) {
+		/*
+		 * To implement unanchored matching (the default for
+		 * most engines) we could have the VM just try to
+		 * match the regex at every position in the string,
+		 * but that's inefficient. Instead, we'll just bake
+		 * the unanchored matching right into the bytecode by
+		 * manually emitting the instructions for `.*?`.
+		 */
+		emit_ab(re, INSTR_BRANCH, 3, 1, 0);
+		emit(re, INSTR_MANY, 0);
+		emit_ab(re, INSTR_BRANCH, 3, 1, 0);
+	}
+
+	compile(re, re->n, false);
+	re->num_groups = re->gp;
+
+	if (re->err) {
+		print_compile_error(re);
+		return re;
+	}
+
+	emit(re, INSTR_MATCH, re->sp - re->pat);
+	if (!re->err) possessify(re);
+	if (!re->err && nfa_compatible(re)) compile_nfa(re);
+	if (!re->err && !re->nfa) find_memo(re);
+	if (!re->err) prefilter(re);
+
+#ifdef KTRE_DEBUG
+	DBG("\nengine: %s", re->nfa ? "nfa" : "backtrack");
+
+	for (int i = 0; i < re->ip; i++) {
+		for (int j = 0; j < re->num_groups; j++) {
+			if (re->group[j].address == i)
+				DBG("\ngroup %d:", j);
+		}
+
+		DBG("\n%3d: [%3d] ", i, re->c[i].loc);
+
+		switch (re->c[i].op) {
+		case INSTR_CLASS: DBG("CLASS   '"); dbgf(re->c[i].class); DBG("'");    break;
+		case INSTR_STR:   DBG("STR     '"); dbgf(re->c[i].class); DBG("'");    break;
+		case INSTR_NOT:   DBG("NOT     '"); dbgf(re->c[i].class); DBG("'");    break;
+		case INSTR_TSTR:  DBG("TSTR    '"); dbgf(re->c[i].class); DBG("'");    break;
+		case INSTR_BRANCH:    DBG("BRANCH   %d, %d", re->c[i].a, re->c[i].b); break;
+		case INSTR_CHAR:      DBG("CHAR    '%c'", re->c[i].a);                 break;
+		case INSTR_SAVE:      DBG("SAVE     %d",  re->c[i].a);                 break;
+		case INSTR_JMP:       DBG("JMP      %d",  re->c[i].a);                 break;
+		case INSTR_SETOPT:    DBG("SETOPT   %d",  re->c[i].a);                 break;
+		case INSTR_BACKREF:   DBG("BACKREF  %d",  re->c[i].a);                 break;
+		case INSTR_CALL:      DBG("CALL     %d",  re->c[i].a);                 break;
+		case INSTR_PROG:      DBG("PROG     %d",  re->c[i].a);                 break;
 		case INSTR_SET_START: DBG("SET_START");                                break;
 		case INSTR_TRY:       DBG("TRY");                                      break;
 		case INSTR_CATCH:     DBG("CATCH");                                    break;
@@ -2486,125 +3365,558 @@ ktre_compile(const char *pat, int opt)
 		case INSTR_PLB_WIN:   DBG("PLB_WIN");                                  break;
 		case INSTR_NLB:       DBG("NLB      %d",  re->c[i].a);                 break;
 		case INSTR_NLB_FAIL:  DBG("NLB_FAIL");                                 break;
+		case INSTR_RUN:       DBG("RUN      %d, %d", re->c[i].a, re->c[i].b); break;
+
+		default:
+ 			DBG("\nunimplemented instruction printer %d\n", re->c[i].op);
+			assert(false);
+		}
+	}
+#endif
+
+	return re;
+}
+
+struct ktre *ktre_copy(struct ktre *re)
+{
+	if (re->prog) re = re->prog;
+
+	struct ktre *ret = KTRE_MALLOC(sizeof *ret);
+	if (!ret) return NULL;
+	memset(ret, 0, sizeof *ret);
+
+	/*
+	 * Everything the compiler produced is shared; the runtime
+	 * storage is allocated by the copy the first time it runs.
+	 */
+	ret->num_groups = re->num_groups;
+	ret->opt        = re->opt;
+	ret->err_str    = "no error";
+	ret->c          = re->c;
+	ret->ip         = re->ip;
+	ret->num_prog   = re->num_prog;
+	ret->pat        = re->pat;
+	ret->popt       = re->popt;
+	ret->gp         = re->gp;
+	ret->n          = re->n;
+	ret->group      = re->group;
+	ret->max_tp     = -1;
+	ret->nfa        = re->nfa;
+	ret->nfa_len    = re->nfa_len;
+	ret->has_first  = re->has_first;
+	ret->first_char = re->first_char;
+	ret->lit        = re->lit;
+	ret->delim      = re->delim;
+	ret->ac         = re->ac;
+	ret->memo       = re->memo;
+	memcpy(ret->first, re->first, sizeof re->first);
+
+	ret->info.engine = re->info.engine;
+	ret->prog = re;
+	re->refs++;
+
+	return ret;
+}
+
+#define TP (re->tp)
+#define THREAD (re->t)
+
+/*
+ * Makes room for n ints in *p, which currently has room for *alloc.
+ * Arrays only ever grow, so a thread slot that's been used once
+ * doesn't need to allocate again.
+ */
+static bool
+reserve(struct ktre *re, int **p, int *alloc, int n)
+{
+	if (n <= *alloc) return true;
+
+	int a = *alloc ? *alloc : 8;
+	while (a < n) a *= 2;
+
+	*p = _realloc(*p, a * sizeof **p);
+	if (!*p) return false;
+
+	re->info.runtime_alloc += (a - *alloc) * sizeof **p;
+	*alloc = a;
+
+	return true;
+}
+
+/*
+ * reserve() for storage a run can do without, like the memo bitmap:
+ * returns false instead of running into the memory cap, so the caller
+ * can carry on without it.
+ */
+static bool
+spare(struct ktre *re, int **p, int *alloc, int n)
+{
+	if (n <= *alloc) return true;
+
+	size_t a = *alloc ? *alloc : 8;
+	while (a < (size_t)n) a *= 2;
+
+	if (re->info.ba + (a - *alloc) * sizeof **p + sizeof (struct ktre) > KTRE_MEM_CAP)
+		return false;
+
+	return reserve(re, p, alloc, n);
+}
+
+/*
+ * Resizes the thread stack to n threads. Every thread's vec and prog
+ * arrays live next to each other in thread_store so that spawning a
+ * thread copies them with one memcpy.
+ */
+static bool
+grow_threads(struct ktre *re, int n)
+{
+	int stride = re->num_groups * 2 + re->num_prog;
+	int old = re->t ? re->info.thread_alloc : 0;
+
+	re->t = _realloc(re->t, n * sizeof THREAD[0]);
+	re->thread_store = _realloc(re->thread_store, n * stride * sizeof *re->thread_store);
+	if (!re->t || !re->thread_store) return false;
+
+	if (n > old) memset(THREAD + old, 0, (n - old) * sizeof THREAD[0]);
+	re->info.runtime_alloc += (n - old) * stride * sizeof *re->thread_store;
+	re->info.thread_alloc = n;
+
+	for (int i = 0; i < n; i++) {
+		THREAD[i].vec = re->thread_store + i * stride;
+		THREAD[i].prog = THREAD[i].vec + re->num_groups * 2;
+	}
+
+	return true;
+}
+
+/* Copies the first n ints of the previous thread's array `f'. */
+#define INHERIT(f,n)                                                   \
+	do {                                                           \
+		if (TP > 0)                                            \
+			memcpy(THREAD[TP].f, THREAD[TP - 1].f,         \
+			       (n) * sizeof THREAD[0].f[0]);           \
+	} while (0)
+
+static void
+new_thread(struct ktre *re, int ip, int sp, int opt, int fp, int la, int ep)
+{
+	int stride = re->num_groups * 2 + re->num_prog;
+	++TP;
+
+	if (TP >= re->info.thread_alloc) {
+		int n;
+
+		if (re->info.thread_alloc * 2 >= KTRE_MAX_THREAD) {
+			n = KTRE_MAX_THREAD;
+
+			/*
+			 * Account for the case where we're just about
+			 * to bump up against the thread limit.
+			 */
+			TP = (TP >= KTRE_MAX_THREAD) ? KTRE_MAX_THREAD - 1 : TP;
+		} else
+			n = re->info.thread_alloc * 2;
+
+		if (n > re->info.thread_alloc && !grow_threads(re, n))
+			return;
+	}
+
+	if (TP > 0)
+		memcpy(THREAD[TP].vec, THREAD[TP - 1].vec, stride * sizeof *re->thread_store);
+	else
+		memset(THREAD[TP].vec, -1, stride * sizeof *re->thread_store);
+
+	if (!reserve(re, &THREAD[TP].frame, &THREAD[TP].frame_alloc, fp + 1)
+	    || !reserve(re, &THREAD[TP].las, &THREAD[TP].las_alloc, la + 1)
+	    || !reserve(re, &THREAD[TP].exception, &THREAD[TP].exception_alloc, ep + 1))
+		return;
+
+	INHERIT(frame, THREAD[TP - 1].fp > fp ? fp : THREAD[TP - 1].fp);
+	INHERIT(las, THREAD[TP - 1].la > la ? la : THREAD[TP - 1].la);
+	INHERIT(exception, THREAD[TP - 1].ep > ep ? ep : THREAD[TP - 1].ep);
+
+	THREAD[TP].ip  = ip;
+	THREAD[TP].sp  = sp;
+	THREAD[TP].fp  = fp;
+	THREAD[TP].la  = la;
+	THREAD[TP].ep  = ep;
+	THREAD[TP].opt = opt;
+
+	/* the slot may hold whatever a discarded thread left in it */
+	THREAD[TP].die = false;
+	THREAD[TP].rev = TP > 0 && THREAD[TP - 1].rev;
+
+	re->max_tp = (TP > re->max_tp) ? TP : re->max_tp;
+}
+
+#define VEC (re->vec)
+
+/* Tests the zero-width assertion `op' at sp. */
+static bool
+assertion(int op, const char *subject, int sp, int len)
+{
+	switch (op) {
+	case INSTR_BOL: return (sp > 0 && subject[sp - 1] == '\n') || sp == 0;
+	case INSTR_EOL: return (sp >= 0 && subject[sp] == '\n') || sp == len;
+	case INSTR_BOS: return sp == 0;
+	case INSTR_EOS: return sp >= 0 && sp == len;
+
+	case INSTR_WB:
+		if (sp < 0 || sp >= len) return false;
+		if (sp == 0 && is_word(subject[sp])) return true;
+
+		if (sp > 0) {
+			if (is_word(subject[sp]) && !is_word(subject[sp - 1]))
+				return true;
+			if (!is_word(subject[sp]) && is_word(subject[sp - 1]))
+				return true;
+		}
+
+		return false;
+
+	case INSTR_NWB:
+		if (sp < 0 || sp >= len) return false;
+		if (sp == 0 && !is_word(subject[sp])) return true;
+
+		if (sp > 0) {
+			if (!(is_word(subject[sp]) && !is_word(subject[sp - 1])))
+				return true;
+			if (!(!is_word(subject[sp]) && is_word(subject[sp - 1])))
+				return true;
+		}
+
+		return false;
+	}
+
+	return false;
+}
+
+/*
+ * Follows every path from ip that doesn't consume a character and
+ * adds the threads it ends up with to `l', in order of priority.
+ * Instructions that have already been reached from a higher priority
+ * thread at this position are skipped, which is what bounds the
+ * work done per character by the size of the program.
+ */
+static void
+nfa_add(struct ktre *re, struct nfa_list *l, int ip, int opt,
+        int *vec, const char *subject, int sp, int len)
+{
+	if (re->mark[ip] == re->gen) return;
+	re->mark[ip] = re->gen;
+
+	struct instr *c = re->nfa + ip;
+	int old;
+
+	switch (c->op) {
+	case INSTR_JMP:
+		nfa_add(re, l, c->c, opt, vec, subject, sp, len);
+		break;
+
+	case INSTR_BRANCH:
+		nfa_add(re, l, c->a, opt, vec, subject, sp, len);
+		nfa_add(re, l, c->b, opt, vec, subject, sp, len);
+		break;
+
+	case INSTR_PROG:
+		nfa_add(re, l, ip + 1, opt, vec, subject, sp, len);
+		break;
+
+	case INSTR_SETOPT:
+		nfa_add(re, l, ip + 1, c->c, vec, subject, sp, len);
+		break;
+
+	case INSTR_SAVE:
+		old = vec[c->c];
+
+		if (c->c % 2 == 0) vec[c->c] = sp;
+		else vec[c->c] = sp - vec[c->c - 1];
+
+		nfa_add(re, l, ip + 1, opt, vec, subject, sp, len);
+		vec[c->c] = old;
+		break;
+
+	case INSTR_SET_START:
+		old = vec[0];
+		vec[0] = sp;
+		nfa_add(re, l, ip + 1, opt, vec, subject, sp, len);
+		vec[0] = old;
+		break;
+
+	case INSTR_BOL: case INSTR_EOL: case INSTR_BOS:
+	case INSTR_EOS: case INSTR_WB: case INSTR_NWB:
+		if (assertion(c->op, subject, sp, len))
+			nfa_add(re, l, ip + 1, opt, vec, subject, sp, len);
+		break;
+
+	default:
+		l->t[l->n].ip = ip;
+		l->t[l->n].opt = opt;
+		memcpy(l->t[l->n].vec, vec, re->num_groups * 2 * sizeof *vec);
+		l->n++;
+	}
+}
+
+/*
+ * Returns the first position at or after sp where a match could
+ * begin, or -1 if there isn't one.
+ */
+static int
+next_start(struct ktre *re, const char *subject, int sp, int len)
+{
+	if (re->first_char >= 0) {
+		const char *p = memchr(subject + sp, re->first_char, len - sp);
+		return p ? p - subject : -1;
+	}
+
+	while (sp < len && !re->first[(unsigned char)subject[sp]])
+		sp++;
+
+	return sp < len ? sp : -1;
+}
+
+/*
+ * Pushes a copy of `v' onto the list of matches. The vectors are
+ * carved out of match_store, which is reused by every run, so a
+ * regex that keeps finding a similar number of matches stops
+ * allocating after its first few runs. Returns false if there's no
+ * memory for it.
+ */
+static bool
+add_match(struct ktre *re, const int *v, int loc)
+{
+	int ncap = re->num_groups * 2;
+
+	if (re->num_matches >= re->match_alloc) {
+		int n = re->match_alloc ? re->match_alloc * 2 : 4;
+
+		VEC = _realloc(VEC, n * sizeof *VEC);
+		re->match_store = _realloc(re->match_store, n * ncap * sizeof *re->match_store);
+
+		if (!VEC || !re->match_store) {
+			error(re, KTRE_ERROR_OUT_OF_MEMORY, loc, "out of memory");
+			return false;
+		}
+
+		re->info.runtime_alloc += (n - re->match_alloc) * (sizeof *VEC + ncap * sizeof *v);
+		re->match_alloc = n;
+
+		for (int i = 0; i < re->num_matches; i++)
+			VEC[i] = re->match_store + i * ncap;
+	}
+
+	VEC[re->num_matches] = re->match_store + re->num_matches * ncap;
+	memcpy(VEC[re->num_matches++], v, ncap * sizeof *v);
+
+	return true;
+}
+
+/*
+ * A Pike VM: the threads for each position in the subject are
+ * stepped in lockstep, highest priority first, so the result is the
+ * same match the backtracker would have found first but the time
+ * taken is bounded by the length of the subject times the length of
+ * the program.
+ */
+static bool
+run_nfa(struct ktre *re, const char *subject, int len, int start, int opt, int ***vec)
+{
+	int ncap = re->num_groups * 2;
+
+	*vec = NULL;
+	re->num_matches = 0;
+
+	if (!re->mark) {
+		re->mark = _malloc(re->nfa_len * sizeof *re->mark);
+		re->caps = _malloc((2 * re->nfa_len + 2) * ncap * sizeof *re->caps);
+		re->list[0].t = _malloc(re->nfa_len * sizeof *re->list[0].t);
+		re->list[1].t = _malloc(re->nfa_len * sizeof *re->list[1].t);
+		if (re->err) return false;
+
+		re->info.runtime_alloc += re->nfa_len * sizeof *re->mark
+			+ (2 * re->nfa_len + 2) * ncap * sizeof *re->caps
+			+ 2 * re->nfa_len * sizeof *re->list[0].t;
+
+		for (int i = 0; i < re->nfa_len; i++) {
+			re->list[0].t[i].vec = re->caps + i * ncap;
+			re->list[1].t[i].vec = re->caps + (re->nfa_len + i) * ncap;
+		}
+	}
+
+	int *init = re->caps + 2 * re->nfa_len * ncap;
+	int *best = init + ncap;
+
+	memset(re->mark, -1, re->nfa_len * sizeof *re->mark);
+	re->gen = 0;
+
+	if (re->lit && !strstr(subject + start, re->lit)) return false;
+
+	bool skip = re->has_first && (opt & KTRE_UNANCHORED);
+
+	while (true) {
+		struct nfa_list *clist = re->list, *nlist = re->list + 1;
+		int end = -1;
+
+		if (skip && (start = next_start(re, subject, start, len)) < 0)
+			break;
+
+		memset(init, -1, ncap * sizeof *init);
+		clist->n = 0;
+		re->gen++;
+		nfa_add(re, clist, 0, opt, init, subject, start, len);
+
+		for (int sp = start; clist->n; sp++) {
+			/*
+			 * When the only thread left is the one looking
+			 * for the start of a match we can jump straight
+			 * to the next place where one could begin.
+			 */
+			if (skip && end < 0 && clist->n == 1 && clist->t[0].ip == 1) {
+				if ((sp = next_start(re, subject, sp + 1, len)) < 0)
+					break;
+
+				clist->n = 0;
+				re->gen++;
+				nfa_add(re, clist, 0, opt, init, subject, sp, len);
+			}
 
-		default:
- 			DBG("\nunimplemented instruction printer %d\n", re->c[i].op);
-			assert(false);
+			nlist->n = 0;
+			re->gen++;
+
+			for (int i = 0; i < clist->n; i++) {
+				struct nfa_thread *t = clist->t + i;
+				struct instr *c = re->nfa + t->ip;
+
+				if (c->op != INSTR_MATCH) {
+					if (accepts(c, t->opt, subject, sp, len))
+						nfa_add(re, nlist, t->ip + 1, t->opt,
+						        t->vec, subject, sp + 1, len);
+					continue;
+				}
+
+				/*
+				 * Same rules as the backtracker: a match
+				 * may not end where an earlier one began,
+				 * and an anchored match must reach the
+				 * end of the subject.
+				 */
+				bool dup = re->num_matches
+					&& VEC[re->num_matches - 1][0] == sp;
+
+				if (dup || (!(t->opt & KTRE_UNANCHORED) && sp != len))
+					continue;
+
+				/* lower priority threads are cut off */
+				memcpy(best, t->vec, ncap * sizeof *best);
+				end = sp;
+				break;
+			}
+
+			struct nfa_list *tmp = clist;
+			clist = nlist;
+			nlist = tmp;
 		}
+
+		if (end < 0) break;
+		if (!add_match(re, best, re->c[re->ip - 1].loc)) return false;
+
+		re->cont = end;
+		*vec = VEC;
+
+		if (!(opt & KTRE_GLOBAL)) break;
+		start = end;
 	}
-#endif
 
-	return re;
+	return !!re->num_matches;
 }
 
-struct ktre *ktre_copy(struct ktre *re)
+/*
+ * Looks for matches of `re' in the first `len' characters of
+ * `subject', starting at `start'. `opt' stands in for the options the
+ * pattern was compiled with, so that callers can ask for a single
+ * match from a global pattern.
+ */
+/*
+ * Runs a literal alternation on its automaton. The match that begins
+ * first wins, and of the literals that match there the one written
+ * first, just as the other engines would have it; once no literal can
+ * begin any earlier than the best match so far there's no need to look
+ * any further.
+ */
+static bool
+run_ac(struct ktre *re, const char *subject, int len, int start, int opt, int ***vec)
 {
-	struct ktre *ret = KTRE_MALLOC(sizeof *ret);
-	memset(ret, 0, sizeof *ret);
-	ret->c = re->c;
-	re->copied = true;
-	return ret;
-}
-
-#define TP (re->tp)
-#define THREAD (re->t)
+	struct ktre_ac *ac = re->ac;
+	*vec = NULL;
+	re->num_matches = 0;
 
-#define MAKE_THREAD_VARIABLE(f,p)                                                  \
-	do {                                                                       \
-		if (!THREAD[TP].f) {                                               \
-			THREAD[TP].f = _malloc(   (p + 1) * sizeof *THREAD[TP].f); \
-			memset(THREAD[TP].f, -1,  (p + 1) * sizeof *THREAD[TP].f); \
-			re->info.runtime_alloc += (p + 1) * sizeof *THREAD[TP].f;  \
-		} else if (THREAD[TP].p < p) {                                     \
-			THREAD[TP].f = _realloc(THREAD[TP].f,                      \
-			                        (p + 1) * sizeof *THREAD[TP].f);   \
-		}                                                                  \
-                                                                                   \
-		THREAD[TP].p = p;                                                  \
-                                                                                   \
-		if (TP > 0) {                                                      \
-			memcpy(THREAD[TP].f,                                       \
-			       THREAD[TP - 1].f,                                   \
-			       THREAD[TP - 1].p > p                                \
-			       ? p * sizeof THREAD[0].f[0]                         \
-			       : THREAD[TP - 1].p * sizeof *THREAD[0].f);          \
-		}                                                                  \
-	} while (0)
+	while (start < len) {
+		int best = -1, s = 0;
 
+		for (int i = start; i < len; i++) {
+			if (best >= 0 && i + 1 - ac->max_len >= best) break;
 
-#define MAKE_STATIC_THREAD_VARIABLE(f,s)                                       \
-	do {                                                                   \
-		if (!THREAD[TP].f) {                                           \
-			THREAD[TP].f = _malloc(   (s) * sizeof *THREAD[TP].f); \
-			memset(THREAD[TP].f, -1,  (s) * sizeof *THREAD[TP].f); \
-			re->info.runtime_alloc += (s) * sizeof *THREAD[TP].f;  \
-		}                                                              \
-                                                                               \
-		if (TP > 0) {                                                  \
-			memcpy(THREAD[TP].f,                                   \
-			       THREAD[TP - 1].f,                               \
-			       (s) * sizeof *THREAD[0].f);                     \
-		}                                                              \
-	} while (0)
+			s = ac->next[s * ac->num_class + ac->class[(unsigned char)subject[i]]];
 
-static void
-new_thread(struct ktre *re, int ip, int sp, int opt, int fp, int la, int ep)
-{
-	++TP;
+			if (ac->longest[s] && (best < 0 || i + 1 - ac->longest[s] < best))
+				best = i + 1 - ac->longest[s];
+		}
 
-	if (TP >= re->info.thread_alloc) {
-		if (re->info.thread_alloc * 2 >= KTRE_MAX_THREAD) {
-			re->info.thread_alloc = KTRE_MAX_THREAD;
+		if (best < 0) break;
 
-			/*
-			 * Account for the case where we're just about
-			 * to bump up against the thread limit.
-			 */
-			TP = (TP >= KTRE_MAX_THREAD) ? KTRE_MAX_THREAD - 1 : TP;
-		} else
-			re->info.thread_alloc *= 2;
+		int k = 0;
+		while (ac->alt_len[k] > len - best
+		       || memcmp(subject + best, ac->alt[k], ac->alt_len[k]))
+			k++;
 
-		re->t = _realloc(re->t, re->info.thread_alloc * sizeof THREAD[0]);
-		memset(&THREAD[TP], 0, (re->info.thread_alloc - TP) * sizeof THREAD[0]);
-	}
+		int v[2] = { best, ac->alt_len[k] };
+		if (!add_match(re, v, 0)) return false;
 
-	MAKE_STATIC_THREAD_VARIABLE(vec, re->num_groups * 2);
-	MAKE_STATIC_THREAD_VARIABLE(prog, re->num_prog);
-	MAKE_THREAD_VARIABLE(frame, fp);
-	MAKE_THREAD_VARIABLE(las, la);
-	MAKE_THREAD_VARIABLE(exception, ep);
+		re->cont = start = best + ac->alt_len[k];
+		*vec = VEC;
 
-	THREAD[TP].ip  = ip;
-	THREAD[TP].sp  = sp;
-	THREAD[TP].opt = opt;
+		if (!(opt & KTRE_GLOBAL)) break;
+	}
 
-	re->max_tp = (TP > re->max_tp) ? TP : re->max_tp;
+	return !!re->num_matches;
 }
 
-#define VEC (re->vec)
-
 static bool
-run(struct ktre *re, const char *subject, int ***vec)
+run(struct ktre *re, const char *subject, int len, int start, int opt, int ***vec)
 {
+	if (re->ac && (opt & KTRE_UNANCHORED))
+		return run_ac(re, subject, len, start, opt, vec);
+	if (re->nfa) return run_nfa(re, subject, len, start, opt, vec);
+
 	*vec = NULL;
 	re->num_matches = 0;
 	TP = -1;
 
-	if (!re->info.thread_alloc) {
-		re->info.thread_alloc = 25;
-		re->t = _malloc(re->info.thread_alloc * sizeof THREAD[0]);
-		if (re->err) return false;
-		memset(re->t, 0, re->info.thread_alloc * sizeof THREAD[0]);
-	}
+	if (!re->info.thread_alloc && !grow_threads(re, 25))
+		return false;
 
-	if (re->opt & KTRE_CONTINUE && re->cont >= (int)strlen(subject))
+	if (re->lit && !strstr(subject + start, re->lit))
 		return false;
 
+	/*
+	 * Only the part of the bitmap the last run touched needs to be
+	 * cleared, so runs that stop early stay cheap.
+	 */
+	bool memo = re->memo && (long long)(len - start + 1) * re->ip <= KTRE_MAX_MEMO;
+	int trail = 0;
+
+	if (memo) {
+		memset(re->seen, 0, re->seen_len * sizeof *re->seen);
+		re->seen_len = 0;
+
+		int old = re->seen_alloc;
+
+		memo = spare(re, &re->seen, &re->seen_alloc, ((len - start + 1) * re->ip + 31) / 32);
+		if (memo) memset(re->seen + old, 0, (re->seen_alloc - old) * sizeof *re->seen);
+	}
+
 	/* push the initial thread */
-	if (re->opt & KTRE_CONTINUE)
-		new_thread(re, 0, re->cont, re->opt, 0, 0, 0);
-	else
-		new_thread(re, 0, 0, re->opt, 0, 0, 0);
+	new_thread(re, 0, start, opt, 0, 0, 0);
 
 #ifdef KTRE_DEBUG
 	int num_steps = 0;
@@ -2612,6 +3924,12 @@ run(struct ktre *re, const char *subject, int ***vec)
 #endif
 
 	while (TP >= 0) {
+		/* the states of threads that have died led nowhere */
+		while (memo && trail && re->trail[trail - 1] > TP) {
+			mark_seen(re, re->trail[trail - 2]);
+			trail -= 2;
+		}
+
 		int ip   = THREAD[TP].ip;
 		int sp   = THREAD[TP].sp;
 		int fp   = THREAD[TP].fp;
@@ -2633,39 +3951,68 @@ run(struct ktre *re, const char *subject, int ***vec)
 			--TP; continue;
 		}
 
+		if (memo && re->memo[ip]) {
+			int k = SEEN_BIT(re, ip, sp - start);
+
+			if (seen(re, k)) {
+				re->info.pruned++;
+				--TP; continue;
+			}
+
+			/*
+			 * Without room for the trail the run carries on
+			 * unmemoized; the bits already set stay true.
+			 */
+			if (spare(re, &re->trail, &re->trail_alloc, trail + 2)) {
+				re->trail[trail++] = k;
+				re->trail[trail++] = TP;
+			} else memo = false;
+		}
+
 		switch (re->c[ip].op) {
 		case INSTR_BACKREF:
 			THREAD[TP].ip++;
 
+			/*
+			 * A group that hasn't matched has a length of -1,
+			 * which would walk the thread backwards; there's
+			 * nothing to refer to, so the reference fails.
+			 */
+			if (THREAD[TP].vec[re->c[ip].c * 2 + 1] < 0) {
+				--TP;
+				break;
+			}
+
 			if (rev) {
 				if (opt & KTRE_INSENSITIVE) {
-					for (int i = 0; i < THREAD[TP].vec[re->c[ip].c * 2 + 1]; i++) {
-						if (lc(subject[sp - i])
-						    != lc(subject[THREAD[TP].vec[re->c[ip].c * 2] + sp - i])) {
-							--TP;
-							continue;
-						}
-					}
+					int n = THREAD[TP].vec[re->c[ip].c * 2 + 1];
+					const char *ref = subject + THREAD[TP].vec[re->c[ip].c * 2];
+					bool ok = true;
+
+					for (int i = 0; i < n && ok; i++)
+						ok = lc(subject[sp + 1 - n + i]) == lc(ref[i]);
 
-					THREAD[TP].sp -= THREAD[TP].vec[re->c[ip].c * 2 + 1];
+					if (ok) THREAD[TP].sp -= n;
+					else --TP;
 				} else {
 					if (!strncmp(subject + sp + 1 - THREAD[TP].vec[re->c[ip].c * 2 + 1],
 					             &subject[THREAD[TP].vec[re->c[ip].c * 2]],
 					             THREAD[TP].vec[re->c[ip].c * 2 + 1]))
-						THREAD[TP].sp += THREAD[TP].vec[re->c[ip].c * 2 + 1];
+						THREAD[TP].sp -= THREAD[TP].vec[re->c[ip].c * 2 + 1];
 					else
 						--TP;
 				}
 			} else {
 				if (opt & KTRE_INSENSITIVE) {
-					for (int i = 0; i < THREAD[TP].vec[re->c[ip].c * 2 + 1]; i++) {
-						if (lc(subject[sp + i]) != lc(subject[THREAD[TP].vec[re->c[ip].c * 2] + i])) {
-							--TP;
-							continue;
-						}
-					}
+					int n = THREAD[TP].vec[re->c[ip].c * 2 + 1];
+					const char *ref = subject + THREAD[TP].vec[re->c[ip].c * 2];
+					bool ok = true;
 
-					THREAD[TP].sp += THREAD[TP].vec[re->c[ip].c * 2 + 1];
+					for (int i = 0; i < n && ok; i++)
+						ok = lc(subject[sp + i]) == lc(ref[i]);
+
+					if (ok) THREAD[TP].sp += n;
+					else --TP;
 				} else {
 					if (!strncmp(subject + sp,
 					             &subject[THREAD[TP].vec[re->c[ip].c * 2]],
@@ -2685,9 +4032,7 @@ run(struct ktre *re, const char *subject, int ***vec)
 				continue;
 			}
 
-			if (strchr(re->c[ip].class, subject[sp]))
-				THREAD[TP].sp++;
-			else if (opt & KTRE_INSENSITIVE && strchr(re->c[ip].class, lc(subject[sp])))
+			if (accepts(re->c + ip, opt, subject, sp, len))
 				THREAD[TP].sp++;
 			else
 				--TP;
@@ -2698,14 +4043,14 @@ run(struct ktre *re, const char *subject, int ***vec)
 
 			if (rev) {
 				if (opt & KTRE_INSENSITIVE) {
-					for (int i = 0; i < (int)strlen(re->c[ip].class); i++) {
-						if (lc(subject[sp + 1 - strlen(re->c[ip].class) + i]) != re->c[ip].class[i]) {
-							--TP;
-							break;
-						}
-					}
+					int n = strlen(re->c[ip].class);
+					bool ok = true;
+
+					for (int i = 0; i < n && ok; i++)
+						ok = lc(subject[sp + 1 - n + i]) == re->c[ip].class[i];
 
-					THREAD[TP].sp -= strlen(re->c[ip].class);
+					if (ok) THREAD[TP].sp -= n;
+					else --TP;
 				} else {
 					if (!strncmp(subject + sp + 1 - strlen(re->c[ip].class), re->c[ip].class, strlen(re->c[ip].class)))
 						THREAD[TP].sp -= strlen(re->c[ip].class);
@@ -2714,14 +4059,14 @@ run(struct ktre *re, const char *subject, int ***vec)
 				}
 			} else {
 				if (opt & KTRE_INSENSITIVE) {
-					for (int i = 0; i < (int)strlen(re->c[ip].class); i++) {
-						if (lc(subject[sp + i]) != re->c[ip].class[i]) {
-							--TP;
-							break;
-						}
-					}
+					int n = strlen(re->c[ip].class);
+					bool ok = true;
+
+					for (int i = 0; i < n && ok; i++)
+						ok = lc(subject[sp + i]) == re->c[ip].class[i];
 
-					THREAD[TP].sp -= strlen(re->c[ip].class);
+					if (ok) THREAD[TP].sp += n;
+					else --TP;
 				} else {
 					if (!strncmp(subject + sp, re->c[ip].class, strlen(re->c[ip].class)))
 						THREAD[TP].sp += strlen(re->c[ip].class);
@@ -2734,83 +4079,22 @@ run(struct ktre *re, const char *subject, int ***vec)
 		case INSTR_NOT:
 			THREAD[TP].ip++;
 
-			if (!strchr(re->c[ip].class, subject[sp])
-			    && subject[sp] && sp >= 0)
+			if (accepts(re->c + ip, opt, subject, sp, len))
 				THREAD[TP].sp++;
 			else --TP;
 			break;
 
-		case INSTR_BOL:
-			if ((sp > 0 && subject[sp - 1] == '\n') || sp == 0)
-				THREAD[TP].ip++;
-			else --TP;
-			break;
-
-		case INSTR_EOL:
-			if ((sp >= 0 && subject[sp] == '\n')
-			    || sp == (int)strlen(subject))
-				THREAD[TP].ip++;
-			else --TP;
-			break;
-
-		case INSTR_BOS:
-			if (sp == 0)
-				THREAD[TP].ip++;
-			else --TP;
-			break;
-
-		case INSTR_EOS:
-			if (sp >= 0 && sp == (int)strlen(subject))
+		case INSTR_BOL: case INSTR_EOL: case INSTR_BOS:
+		case INSTR_EOS: case INSTR_WB: case INSTR_NWB:
+			if (assertion(re->c[ip].op, subject, sp, len))
 				THREAD[TP].ip++;
 			else --TP;
 			break;
 
-		case INSTR_WB:
-			THREAD[TP].ip++;
-
-			if (sp < 0 || sp >= (int)strlen(subject)) {
-				--TP;
-				continue;
-			}
-
-			if (sp == 0 && strchr(WORD, subject[sp]))
-				continue;
-
-			if (sp > 0) {
-				if (strchr(WORD, subject[sp]) && !strchr(WORD, subject[sp - 1]))
-					continue;
-				if (!strchr(WORD, subject[sp]) && strchr(WORD, subject[sp - 1]))
-					continue;
-			}
-
-			--TP;
-			break;
-
-		case INSTR_NWB:
-			THREAD[TP].ip++;
-
-			if (sp < 0 || sp >= (int)strlen(subject)) {
-				--TP;
-				continue;
-			}
-
-			if (sp == 0 && !strchr(WORD, subject[sp]))
-				continue;
-
-			if (sp > 0) {
-				if (!(strchr(WORD, subject[sp]) && !strchr(WORD, subject[sp - 1])))
-					continue;
-				if (!(!strchr(WORD, subject[sp]) && strchr(WORD, subject[sp - 1])))
-					continue;
-			}
-
-			--TP;
-			break;
-
 		case INSTR_CHAR:
 			THREAD[TP].ip++;
 
-			if (sp < 0 || sp >= (int)strlen(subject)) {
+			if (sp < 0 || sp >= len) {
 				--TP;
 				continue;
 			}
@@ -2851,6 +4135,19 @@ run(struct ktre *re, const char *subject, int ***vec)
 		case INSTR_MANY:
 			THREAD[TP].ip++;
 
+			/*
+			 * This is the loop looking for the start of a
+			 * match, so skip anywhere one can't begin.
+			 */
+			if (ip == 1 && re->has_first && (opt & KTRE_UNANCHORED) && !rev) {
+				if (sp >= 0 && subject[sp]
+				    && (THREAD[TP].sp = next_start(re, subject, sp + 1, len)) >= 0)
+					break;
+
+				--TP;
+				break;
+			}
+
 			if (sp >= 0 && subject[sp])
 				if (rev) THREAD[TP].sp--;
 				else THREAD[TP].sp++;
@@ -2864,35 +4161,18 @@ run(struct ktre *re, const char *subject, int ***vec)
 			break;
 
 		case INSTR_MATCH: {
-			int n = 0;
-			for (int i = 0; i < re->num_matches; i++) {
-				if (VEC[i][0] == sp) n++;
-			}
-
-			if (n) {
+			/*
+			 * Matches are found in order, so if this one ends
+			 * where an earlier one began then so did the last.
+			 */
+			if (re->num_matches && VEC[re->num_matches - 1][0] == sp) {
 				--TP;
 				continue;
 			}
 
 			if ((opt & KTRE_UNANCHORED) || (sp >= 0 && !subject[sp])) {
-				VEC = _realloc(VEC, (re->num_matches + 1) * sizeof *VEC);
 				re->cont = sp;
-
-				if (!VEC) {
-					error(re, KTRE_ERROR_OUT_OF_MEMORY, loc, "out of memory");
-					return false;
-				}
-
-				VEC[re->num_matches] = _malloc(re->num_groups * 2 * sizeof VEC[0]);
-				if (!VEC[re->num_matches]) {
-					error(re, KTRE_ERROR_OUT_OF_MEMORY, loc, "out of memory");
-					return false;
-				}
-
-				memcpy(VEC[re->num_matches++],
-				       THREAD[TP].vec,
-				       re->num_groups * 2 * sizeof VEC[0][0]);
-
+				if (!add_match(re, THREAD[TP].vec, loc)) return false;
 				if (vec) *vec = VEC;
 
 				if (!(opt & KTRE_GLOBAL)) {
@@ -2902,10 +4182,13 @@ run(struct ktre *re, const char *subject, int ***vec)
 					THREAD[TP].ip = 0;
 					THREAD[TP].sp = sp;
 
-					if (THREAD[TP].sp > (int)strlen(subject)) {
+					if (THREAD[TP].sp > len) {
 						return true;
 					}
 
+					/* they led here, not nowhere */
+					trail = 0;
+
 					continue;
 				}
 			}
@@ -2938,7 +4221,8 @@ run(struct ktre *re, const char *subject, int ***vec)
 
 		case INSTR_CALL:
 			THREAD[TP].ip = re->c[ip].c;
-			THREAD[TP].frame = _realloc(THREAD[TP].frame, (fp + 1) * sizeof THREAD[TP].frame[0]);
+			if (!reserve(re, &THREAD[TP].frame, &THREAD[TP].frame_alloc, fp + 1))
+				return false;
 			THREAD[TP].frame[THREAD[TP].fp++] = ip + 1;
 			break;
 
@@ -2959,7 +4243,7 @@ run(struct ktre *re, const char *subject, int ***vec)
 		case INSTR_DIGIT:
 			THREAD[TP].ip++;
 
-			if (strchr(DIGIT, subject[sp]) && subject[sp]) {
+			if (accepts(re->c + ip, opt, subject, sp, len)) {
 				if (rev) THREAD[TP].sp--; else THREAD[TP].sp++;
 			} else --TP;
 			break;
@@ -2967,7 +4251,7 @@ run(struct ktre *re, const char *subject, int ***vec)
 		case INSTR_WORD:
 			THREAD[TP].ip++;
 
-			if (strchr(WORD, subject[sp]) && subject[sp]) {
+			if (accepts(re->c + ip, opt, subject, sp, len)) {
 				if (rev) THREAD[TP].sp--; else THREAD[TP].sp++;
 			} else --TP;
 			break;
@@ -2975,16 +4259,31 @@ run(struct ktre *re, const char *subject, int ***vec)
 		case INSTR_SPACE:
 			THREAD[TP].ip++;
 
-			if (strchr(WHITESPACE, subject[sp]) && subject[sp]) {
+			if (accepts(re->c + ip, opt, subject, sp, len)) {
 				if (rev) THREAD[TP].sp--; else THREAD[TP].sp++;
 			} else
 				--TP;
 			break;
 
+		case INSTR_RUN: {
+			int end = sp;
+
+			while (accepts(re->c + re->c[ip].a, opt, subject, end, len))
+				end++;
+
+			if (end == sp) {
+				--TP;
+				continue;
+			}
+
+			THREAD[TP].ip = re->c[ip].b;
+			THREAD[TP].sp = end;
+		} break;
+
 		case INSTR_TRY:
 			THREAD[TP].ip++;
-			THREAD[TP].exception = _realloc(THREAD[TP].exception,
-			                                (ep + 1) * sizeof THREAD[TP].exception[0]);
+			if (!reserve(re, &THREAD[TP].exception, &THREAD[TP].exception_alloc, ep + 1))
+				return false;
 			THREAD[TP].exception[THREAD[TP].ep++] = TP;
 			break;
 
@@ -3066,10 +4365,31 @@ run(struct ktre *re, const char *subject, int ***vec)
 struct ktre_info
 ktre_free(struct ktre *re)
 {
-	if (re->copied)
+	/*
+	 * A copy only owns what it allocated itself, all of which is
+	 * on its minfo list.
+	 */
+	if (re->prog) {
+		struct ktre *prog = re->prog;
+		struct ktre_info info = re->info;
+		struct ktre_minfo *mi = re->minfo;
+
+		while (mi) {
+			struct ktre_minfo *mi2 = mi;
+			mi = mi->next;
+			KTRE_FREE(mi2);
+		}
+
+		KTRE_FREE(re);
+		ktre_free(prog);
+		return info;
+	}
+
+	if (--re->refs > 0)
 		return re->info;
 
 	free_node(re, re->n);
+	_free((char *)re->pat);
 	if (re->err)
 		_free(re->err_str);
 
@@ -3077,26 +4397,22 @@ ktre_free(struct ktre *re)
 		for (int i = 0; i < re->ip; i++) {
 			if (re->c[i].op == INSTR_TSTR)
 				_free(re->c[i].class);
+			if (re->c[i].op == INSTR_CLASS || re->c[i].op == INSTR_NOT)
+				_free(re->c[i].map);
 		}
 
 		_free(re->c);
 	}
 
-	for (int i = 0; i <= re->max_tp; i++) {
-		_free(THREAD[i].vec);
-		_free(THREAD[i].prog);
+	for (int i = 0; i < re->info.thread_alloc; i++) {
 		_free(THREAD[i].frame);
 		_free(THREAD[i].las);
 		_free(THREAD[i].exception);
 	}
 
-	if (re->vec) {
-		for (int i = 0; i < re->num_matches; i++) {
-			_free((re->vec)[i]);
-		}
-
-		_free(re->vec);
-	}
+	_free(re->thread_store);
+	_free(re->match_store);
+	_free(re->vec);
 
 	for (int i = 0; i < re->gp; i++)
 		if (re->group[i].name)
@@ -3104,6 +4420,19 @@ ktre_free(struct ktre *re)
 
 	_free(re->group);
 	_free(re->t);
+
+	_free(re->nfa);
+	_free(re->mark);
+	_free(re->caps);
+	_free(re->list[0].t);
+	_free(re->list[1].t);
+	_free(re->lit);
+	_free(re->delim);
+	_free(re->spans);
+	if (re->ac) free_ac(re, re->ac);
+	_free(re->memo);
+	_free(re->seen);
+	_free(re->trail);
 	struct ktre_info info = re->info;
 
 #if defined(_MSC_VER) && defined(KTRE_DEBUG)
@@ -3155,6 +4484,21 @@ ktre_free(struct ktre *re)
 	return info;
 }
 
+/* Runs `re' over the whole of `subject' the way its options ask for. */
+static bool
+run_subject(struct ktre *re, const char *subject, int ***vec)
+{
+	int len = strlen(subject);
+
+	if (re->opt & KTRE_CONTINUE && re->cont >= len) {
+		*vec = NULL;
+		re->num_matches = 0;
+		return false;
+	}
+
+	return run(re, subject, len, (re->opt & KTRE_CONTINUE) ? re->cont : 0, re->opt, vec);
+}
+
 _Bool
 ktre_exec(struct ktre *re, const char *subject, int ***vec)
 {
@@ -3169,8 +4513,8 @@ ktre_exec(struct ktre *re, const char *subject, int ***vec)
 	int **v = NULL;
 	_Bool ret = false;
 
-	if (vec) ret = run(re, subject, vec);
-	else     ret = run(re, subject, &v);
+	if (vec) ret = run_subject(re, subject, vec);
+	else     ret = run_subject(re, subject, &v);
 
 	if (vec) print_finish(re, subject, re->pat, ret, *vec, NULL);
 	else     print_finish(re, subject, re->pat, ret, v, NULL);
@@ -3178,6 +4522,46 @@ ktre_exec(struct ktre *re, const char *subject, int ***vec)
 	return ret;
 }
 
+/*
+ * Hands out the matches of `re' in the first `len' characters of
+ * `subject' one at a time, whatever its options, each call resuming
+ * where the last match ended. ktre_rewind starts over.
+ */
+_Bool
+ktre_next(struct ktre *re, const char *subject, int len, int ***vec)
+{
+	DBG("\nsubject: %s", subject);
+
+	if (re->err) {
+		if (re->err_str)
+			_free(re->err_str);
+		re->err = KTRE_ERROR_NO_ERROR;
+	}
+
+	int **v = NULL;
+	if (!vec) vec = &v;
+
+	if (re->cont >= len) {
+		*vec = NULL;
+		re->num_matches = 0;
+		return false;
+	}
+
+	_Bool ret = run(re, subject, len, re->cont, re->opt & ~KTRE_GLOBAL, vec);
+
+	/* step over empty matches so that the next one makes progress */
+	if (ret && !VEC[0][1]) re->cont++;
+
+	print_finish(re, subject, re->pat, ret, *vec, NULL);
+	return ret;
+}
+
+void
+ktre_rewind(struct ktre *re)
+{
+	re->cont = 0;
+}
+
 _Bool ktre_match(const char *subject, const char *pat, int opt, int ***vec)
 {
 	struct ktre *re = ktre_compile(pat, opt);
@@ -3188,7 +4572,7 @@ _Bool ktre_match(const char *subject, const char *pat, int opt, int ***vec)
 	}
 
 	int **v = NULL;
-	bool ret = run(re, subject, vec ? vec : &v);
+	bool ret = run_subject(re, subject, vec ? vec : &v);
 	print_finish(re, subject, pat, ret, vec ? *vec : v, NULL);
 	ktre_free(re);
 	return ret;
@@ -3235,7 +4619,7 @@ char *ktre_filter(struct ktre *re, const char *subject, const char *replacement,
 	DBG("\nsubject: %s", subject);
 
 	int **vec = NULL;
-	if (!run(re, subject, &vec) || re->err) {
+	if (!run_subject(re, subject, &vec) || re->err) {
 		print_finish(re, subject, re->pat, false, vec, NULL);
 		return NULL;
 	}
@@ -3354,38 +4738,87 @@ skip_capture:
 	return a;
 }
 
-char **ktre_split(ktre *re, const char *subject, int *len)
+static bool
+add_span(struct ktre *re, int *n, int start, int len)
+{
+	if (!reserve(re, &re->spans, &re->span_alloc, 2 * *n + 2))
+		return false;
+
+	re->spans[2 * *n] = start;
+	re->spans[2 * *n + 1] = len;
+	(*n)++;
+
+	return true;
+}
+
+/*
+ * Splits `subject' around the matches of `re' like ktre_split, but
+ * rather than copying the pieces out it returns the offset and length
+ * of each one, two ints per piece. The spans belong to `re' and are
+ * only valid until it is used again or freed.
+ */
+int const *ktre_split_spans(ktre *re, const char *subject, int *len)
 {
 	DBG("\nsubject: %s", subject);
 
+	int n = strlen(subject), j = 0;
 	*len = 0;
-	int **vec = NULL;
-	if (!run(re, subject, &vec) || re->err) {
-		print_finish(re, subject, re->pat, false, vec, NULL);
-		return NULL;
-	}
 
-	char **r = NULL;
-	int j = 0;
+	if (re->delim && (re->opt & KTRE_GLOBAL)) {
+		/*
+		 * A literal delimiter can be looked for directly; the
+		 * matches are the same ones run() would have found.
+		 */
+		int d = strlen(re->delim);
+		const char *p = subject;
+		bool found = false;
+
+		while (*p) {
+			if (d == 1) p = memchr(p, *re->delim, n - (p - subject));
+			else        p = strstr(p, re->delim);
+			if (!p) break;
+
+			int at = p - subject;
+			found = true;
+			p += d;
+
+			if (at == 0) continue;
+			if (!add_span(re, len, j, at - j)) return NULL;
+			j = at + d;
+		}
 
-	for (int i = 0; i < re->num_matches; i++) {
-		if (vec[i][0] == 0 || vec[i][0] == (int)strlen(subject)) continue;
-		r = realloc(r, (*len + 1) * sizeof *r);
+		if (!found) return NULL;
+	} else {
+		int **vec = NULL;
+		if (!run_subject(re, subject, &vec) || re->err) {
+			print_finish(re, subject, re->pat, false, vec, NULL);
+			return NULL;
+		}
+
+		for (int i = 0; i < re->num_matches; i++) {
+			if (vec[i][0] == 0 || vec[i][0] == n) continue;
+			if (!add_span(re, len, j, vec[i][0] - j)) return NULL;
+			j = vec[i][0] + vec[i][1];
+		}
+	}
 
-		r[*len] = malloc(vec[i][0] - j + 1);
-		strncpy(r[*len], subject + j, vec[i][0] - j);
+	if (n >= j && !add_span(re, len, j, n - j))
+		return NULL;
 
-		r[*len][vec[i][0] - j] = 0;
-		j = vec[i][0] + vec[i][1];
+	return re->spans;
+}
 
-		(*len)++;
-	}
+char **ktre_split(ktre *re, const char *subject, int *len)
+{
+	int const *span = ktre_split_spans(re, subject, len);
+	if (!span) return NULL;
 
-	if ((int)strlen(subject) >= j) {
-		r = realloc(r, (*len + 1) * sizeof *r);
-		r[*len] = malloc(strlen(subject) - j + 1);
-		strcpy(r[*len], subject + j);
-		(*len)++;
+	char **r = malloc(*len * sizeof *r);
+
+	for (int i = 0; i < *len; i++) {
+		r[i] = malloc(span[2 * i + 1] + 1);
+		memcpy(r[i], subject + span[2 * i], span[2 * i + 1]);
+		r[i][span[2 * i + 1]] = 0;
 	}
 
 	return r;
@@ -3402,5 +4835,39 @@ int **ktre_getvec(const struct ktre *re)
 
 	return vec;
 }
+
+/*
+ * Like ktre_getvec, but hands out the match vectors of the last run
+ * without copying them. They belong to `re' and are only valid until
+ * it is run again or freed.
+ */
+int const *const *ktre_borrowvec(const struct ktre *re)
+{
+	return (int const *const *)re->vec;
+}
+
+/*
+ * For a pattern that's an alternation of literals, returns the index
+ * of the first alternative that appears anywhere in the first `len'
+ * bytes of `subject', or -1 if none do. This takes one pass over the
+ * subject however many alternatives there are. Any other pattern
+ * returns -1; check that re->ac is set.
+ */
+int ktre_which(ktre *re, const char *subject, int len)
+{
+	struct ktre_ac *ac = re->ac;
+	if (!ac) return -1;
+
+	int best = -1, s = 0;
+
+	for (int i = 0; i < len && best != 0; i++) {
+		s = ac->next[s * ac->num_class + ac->class[(unsigned char)subject[i]]];
+
+		if (ac->lowest[s] >= 0 && (best < 0 || ac->lowest[s] < best))
+			best = ac->lowest[s];
+	}
+
+	return best;
+}
 #endif /* ifdef KTRE_IMPLEMENTATION */
 #endif /* ifndef KTRE_H */
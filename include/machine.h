@@ -11,6 +11,21 @@
 
 /* TODO: refucktor frames */
 
+/*
+ * The string the last match ran against, which group reads index
+ * into. A match borrows the gc string it was given instead of copying
+ * it; if that string is modified in place while it's still the subject
+ * the VM takes a private copy first. Substitutions hold on to their
+ * subject across evaluations that may run matches of their own, so it
+ * is reference counted.
+ */
+struct subject {
+	int refs;
+	int64_t idx; /* the gc string s borrows, or -1 if s is owned */
+	char *s;
+	int len;     /* -1 until somebody needs it */
+};
+
 struct vm {
 	struct instruction *code;
 	size_t ip;
@@ -28,10 +43,12 @@ struct vm {
 	size_t impp;
 
 	struct value *stack;
+	bool *fresh; /* whether nothing else refers to each stack slot */
 	size_t sp;
 	size_t maxsp;
 
 	struct value **frame;
+	int *frame_size;
 	int *module;
 	size_t fp;
 	size_t maxfp;
@@ -42,7 +59,7 @@ struct vm {
 
 	struct ktre *re;
 	int match;
-	char *subject;
+	struct subject *subject;
 
 	bool debug;
 	FILE *f;
@@ -3,6 +3,7 @@
 
 #include "module.h"
 #include "value.h"
+#include "recache.h"
 
 struct oak {
 	struct module **modules;
@@ -10,6 +11,7 @@ struct oak {
 	uint16_t num;
 
 	bool debug;
+	bool optimize;
 
 	bool print_input;
 	bool print_tokens;
@@ -18,6 +20,7 @@ struct oak {
 	bool print_code;
 	bool print_gc;
 	bool print_vm;
+	bool print_inlining;
 	bool talkative;
 
 	bool print_everything;
@@ -27,6 +30,9 @@ struct oak {
 	struct value *stack;
 	size_t sp;
 
+	/* compiled regular expressions shared by every module */
+	struct recache *recache;
+
 	char *eval;
 };
 
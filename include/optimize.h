@@ -0,0 +1,16 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "compile.h"
+
+/*
+ * Cleans up the bytecode of a freshly compiled module: copies and
+ * constants are propagated within basic blocks, repeated lengths are
+ * reused, unreachable code and stores nobody reads are dropped, jumps
+ * to jumps are threaded, integer arithmetic gets typed opcodes, and
+ * reads of registers that are certainly initialized go unchecked.
+ * Enabled with -O.
+ */
+void optimize(struct compiler *c);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef RECACHE_H
+#define RECACHE_H
+
+#include <stdint.h>
+#include "ktre.h"
+
+/*
+ * Compiled regular expressions, keyed on their pattern and options and
+ * shared by every module. The cache holds on to the programs; callers
+ * get copies with runtime storage of their own (see ktre_copy), so two
+ * uses of the same pattern can be in the middle of a match at once.
+ * When the cache is full the entry that was used longest ago goes.
+ */
+
+#define RECACHE_SIZE 64
+
+struct recache {
+	struct recache_entry {
+		int opt;
+		uint64_t h;
+		ktre *re;
+		uint64_t used;
+	} e[RECACHE_SIZE];
+
+	int len;
+	uint64_t tick;
+};
+
+struct recache *new_recache(void);
+void free_recache(struct recache *c);
+ktre *recache_get(struct recache *c, const char *pat, int opt);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+#include <stddef.h>
+#include "code.h"
+
+/*
+ * While a function is being compiled its temporaries are numbered
+ * from TEMP_REG up, where they can't be mistaken for variables or
+ * globals. allocate_temps packs the temporaries of a stretch of code
+ * onto as few registers as their live ranges allow, and place_temps
+ * moves them down above the variables once the frame is finished.
+ */
+#define TEMP_REG (1 << 15)
+#define MAX_TEMP ((1 << 16) - 1)
+
+int allocate_temps(struct instruction *code, size_t start, size_t end);
+void place_temps(struct instruction *code, size_t start, size_t end, int base);
+
+#endif
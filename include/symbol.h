@@ -13,6 +13,8 @@ struct symbol {
 	struct token   *tok;
 	struct module  *module;
 
+	struct statement *def; /* the definition of a SYM_FN */
+
 	struct symbol  *parent;
 	struct symbol **children;
 	size_t          num_children;
@@ -8,6 +8,24 @@
 
 #define TABLE_SIZE 32
 
+/*
+ * Tables start out as a plain array of buckets, which is the fastest
+ * thing to mutate as long as nobody else can see the table. The first
+ * time a table is copied it is turned into a persistent hash array
+ * mapped trie (see table.c) so that the original and every copy of it
+ * can share structure; adding to a shared trie only copies the nodes
+ * along the path to the new key.
+ */
+
+/*
+ * 64 bits of hash consumed five bits at a time; the last of the 13
+ * levels gets the four bits that are left over.
+ */
+#define HAMT_BITS 5
+#define HAMT_DEPTH 13
+
+struct hamt;
+
 struct table {
 	struct bucket {
 		uint64_t *h;
@@ -15,6 +33,19 @@ struct table {
 		struct value *val;
 		size_t len;
 	} bucket[TABLE_SIZE];
+
+	/* non-NULL when the table has been made persistent */
+	struct hamt *root;
+	size_t len;
+};
+
+struct table_iter {
+	struct table *t;
+	size_t i, j;
+
+	struct hamt *node[HAMT_DEPTH + 1];
+	unsigned pos[HAMT_DEPTH + 1];
+	int sp;
 };
 
 struct table *new_table();
@@ -22,5 +53,9 @@ struct table *copy_table(struct table *t);
 void free_table(struct table *t);
 struct value table_lookup(struct table *t, char *key);
 struct value table_add(struct table *t, char *key, struct value v);
+size_t table_len(struct table *t);
+
+void table_iter(struct table_iter *it, struct table *t);
+bool table_next(struct table_iter *it, char **key, struct value *val);
 
 #endif
@@ -58,6 +58,7 @@ struct value {
 
 #define BOOL(X) ((struct value) { VAL_BOOL, { .boolean = (X) }, NULL})
 #define INT(X)  ((struct value) { VAL_INT,  { .integer = (X) }, NULL})
+#define FLOAT(X) ((struct value) { VAL_FLOAT, { .real = (X) }, NULL})
 #define ERR(...) ((struct value) { VAL_ERR, { .err = ksprintf(__VA_ARGS__) }, NULL })
 #define NIL     ((struct value) { VAL_NIL,  { .integer = 0   }, NULL})
 
@@ -82,6 +83,8 @@ struct value val_unop(struct value l, int op);
 struct value copy_value(struct gc *gc, struct value l);
 struct value rev_value(struct gc *gc, struct value l);
 struct value sort_value(struct gc *gc, struct value l);
+struct value rev_fresh_value(struct gc *gc, struct value l);
+struct value sort_fresh_value(struct gc *gc, struct value l);
 struct value max_value(struct gc *gc, struct value l);
 struct value min_value(struct gc *gc, struct value l);
 struct value uc_value(struct gc *gc, struct value l);
@@ -33,7 +33,9 @@ process_arguments(struct oak *k, int argc, char **argv)
 		if (!strcmp(argv[i], "-pc")) k->print_code = true;
 		if (!strcmp(argv[i], "-pg")) k->print_gc = true;
 		if (!strcmp(argv[i], "-pv")) k->print_vm = true;
+		if (!strcmp(argv[i], "-pin")) k->print_inlining = true;
 		if (!strcmp(argv[i], "-d"))  k->debug = true;
+		if (!strcmp(argv[i], "-O"))  k->optimize = true;
 		if (!strcmp(argv[i], "-p"))  k->print_everything = true;
 		if (!strcmp(argv[i], "-e")) {
 			if (k->eval) {
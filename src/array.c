@@ -4,41 +4,228 @@
 #include "util.h"
 #include "array.h"
 
+static size_t
+elem_size(enum array_kind kind)
+{
+	switch (kind) {
+	case ARRAY_INTS:  return sizeof (int64_t);
+	case ARRAY_REALS: return sizeof (double);
+	default:          return sizeof (struct value);
+	}
+}
+
+static void
+put_slot(struct array *a, size_t slot, struct value r);
+
+static void
+remove_view(struct array *p, struct array *a)
+{
+	for (size_t i = 0; i < p->num_views; i++) {
+		if (p->views[i] == a) {
+			p->views[i] = p->views[--p->num_views];
+			return;
+		}
+	}
+}
+
+/*
+ * Gives a lazy range or a view its own storage, turning it into an
+ * ordinary array.
+ */
+void
+array_materialize(struct array *a)
+{
+	if (a->kind != ARRAY_RANGE && a->kind != ARRAY_VIEW) return;
+
+	size_t len = a->len;
+	struct array *p = a->parent;
+
+	if (a->kind == ARRAY_RANGE) {
+		a->kind = ARRAY_INTS;
+		a->len = 0;
+		grow_array(a, len);
+
+		for (size_t i = 0; i < len; i++)
+			a->ints[i] = a->first + (int64_t)i * a->step;
+
+		a->len = len;
+		return;
+	}
+
+	remove_view(p, a);
+	a->parent = NULL;
+	a->kind = p->kind == ARRAY_RANGE ? ARRAY_INTS : p->kind;
+	a->len = 0;
+	grow_array(a, len);
+
+	for (size_t i = 0; i < len; i++)
+		put_slot(a, i, array_get(p, a->first + (int64_t)i * a->step));
+
+	a->len = len;
+}
+
+/* Called before changing elements that views of `a' might see. */
+static void
+detach_views(struct array *a)
+{
+	while (a->num_views)
+		array_materialize(a->views[a->num_views - 1]);
+}
+
 struct array *
-new_array()
+new_view(struct array *a, int64_t first, int64_t step, size_t len)
+{
+	struct array *r = new_array_of(ARRAY_VIEW);
+
+	if (a->kind == ARRAY_VIEW) {
+		first = a->first + first * a->step;
+		step *= a->step;
+		a = a->parent;
+	}
+
+	r->parent = a;
+	r->first = first;
+	r->step = step;
+	r->len = len;
+
+	a->views = oak_realloc(a->views, (a->num_views + 1) * sizeof *a->views);
+	a->views[a->num_views++] = r;
+
+	return r;
+}
+
+static bool
+array_fits(struct array *a, struct value r)
+{
+	return a->kind == ARRAY_VALUES
+		|| (a->kind == ARRAY_INTS && r.type == VAL_INT)
+		|| (a->kind == ARRAY_REALS && r.type == VAL_FLOAT);
+}
+
+/* Writes r into physical slot `slot'; r must fit the array's kind. */
+static void
+put_slot(struct array *a, size_t slot, struct value r)
+{
+	switch (a->kind) {
+	case ARRAY_INTS:   a->ints[slot] = r.integer; break;
+	case ARRAY_REALS:  a->reals[slot] = r.real;   break;
+	case ARRAY_VALUES: a->v[slot] = r;            break;
+	case ARRAY_RANGE:
+	case ARRAY_VIEW:   assert(false);
+	}
+}
+
+static void
+move_elem(struct array *a, size_t to, size_t from)
+{
+	size_t size = elem_size(a->kind);
+	memcpy((char *)a->v + ARRAY_SLOT(a, to) * size,
+	       (char *)a->v + ARRAY_SLOT(a, from) * size, size);
+}
+
+/*
+ * Makes sure r can be stored in the array. An empty array can simply
+ * switch to whatever storage suits r best.
+ */
+static void
+make_fit(struct array *a, struct value r)
+{
+	array_materialize(a);
+	if (array_fits(a, r)) return;
+
+	if (a->len) {
+		array_widen(a);
+		return;
+	}
+
+	free(a->v);
+	a->v = NULL;
+	a->alloc = 0;
+	a->start = 0;
+	a->kind = r.type == VAL_INT ? ARRAY_INTS
+		: r.type == VAL_FLOAT ? ARRAY_REALS : ARRAY_VALUES;
+}
+
+struct array *
+new_array_of(enum array_kind kind)
 {
 	struct array *a = oak_malloc(sizeof *a);
 	memset(a, 0, sizeof *a);
+	a->kind = kind;
 
-	a->alloc = 16;
-	a->v = oak_malloc(16 * sizeof *a->v);
+	return a;
+}
 
-	for (size_t i = 0; i < 16; i++)
-		a->v[i] = NIL;
+struct array *
+new_array()
+{
+	return new_array_of(ARRAY_VALUES);
+}
 
-	return a;
+struct array *
+copy_array(struct array *a)
+{
+	if (a->kind == ARRAY_VIEW)
+		return new_view(a, 0, 1, a->len);
+
+	struct array *r = new_array_of(a->kind);
+
+	if (a->kind == ARRAY_RANGE) {
+		r->first = a->first;
+		r->step = a->step;
+		r->len = a->len;
+		return r;
+	}
+
+	grow_array(r, a->len);
+
+	size_t size = elem_size(a->kind);
+	for (size_t i = 0; i < a->len; i++)
+		memcpy((char *)r->v + i * size, (char *)a->v + ARRAY_SLOT(a, i) * size, size);
+
+	r->len = a->len;
+	return r;
 }
 
 void
 free_array(struct array *a)
 {
+	free(a->views);
 	free(a->v);
 	free(a);
 }
 
+void
+array_widen(struct array *a)
+{
+	array_materialize(a);
+	if (a->kind == ARRAY_VALUES) return;
+	struct value *v = a->alloc ? oak_malloc(a->alloc * sizeof *v) : NULL;
+
+	for (size_t i = 0; i < a->len; i++)
+		v[ARRAY_SLOT(a, i)] = array_get(a, i);
+
+	free(a->v);
+	a->v = v;
+	a->kind = ARRAY_VALUES;
+}
+
 void
 array_push(struct array *a, struct value r)
 {
+	make_fit(a, r);
 	grow_array(a, a->len + 1);
-	a->v[a->len++] = r;
+	put_slot(a, ARRAY_SLOT(a, a->len), r);
+	a->len++;
 }
 
 struct value
 array_pop(struct array *a)
 {
 	if (a->len > 0) {
+		detach_views(a);
 		a->len--;
-		return a->v[a->len];
+		return array_get(a, a->len);
 	}
 
 	return NIL;
@@ -48,44 +235,100 @@ struct value
 array_shift(struct array *a)
 {
 	if (a->len > 0) {
-		struct value v = a->v[0];
-		memmove(a->v, a->v + 1, (--a->len) * sizeof *a->v);
+		detach_views(a);
+		struct value v = array_get(a, 0);
+
+		if (a->kind == ARRAY_RANGE || a->kind == ARRAY_VIEW)
+			a->first += a->step;
+		else
+			a->start = (a->start + 1) & (a->alloc - 1);
+
+		a->len--;
 		return v;
 	}
 
 	return NIL;
 }
 
+/*
+ * Makes room for at least `size' elements. The new buffer always
+ * starts with element zero, so this is also where a wrapped array gets
+ * straightened out again.
+ */
 void
 grow_array(struct array *a, size_t size)
 {
 	assert(size < SIZE_MAX / 2);
 	if (size <= a->alloc) return;
 
-	if (size > (a->alloc * 2)) {
-		a->v = oak_realloc(a->v, size * sizeof *a->v);
+	size_t alloc = a->alloc ? a->alloc * 2 : 16;
+	while (alloc < size) alloc *= 2;
 
-		for (size_t i = a->alloc; i < size; i++)
-			a->v[i] = NIL;
+	size_t esize = elem_size(a->kind);
+	char *v = oak_malloc(alloc * esize);
 
-		a->alloc = size;
-		return;
-	}
+	for (size_t i = 0; i < a->len; i++)
+		memcpy(v + i * esize, (char *)a->v + ARRAY_SLOT(a, i) * esize, esize);
 
-	a->v = oak_realloc(a->v, a->alloc * 2 * sizeof *a->v);
+	free(a->v);
+	a->v = (struct value *)v;
+	a->alloc = alloc;
+	a->start = 0;
+}
 
-	for (size_t i = a->alloc; i < a->alloc * 2; i++)
-		a->v[i] = NIL;
+/* Grows the array to `len' elements, filling the new ones with nil. */
+void
+array_extend(struct array *a, size_t len)
+{
+	if (len <= a->len) return;
+
+	array_widen(a);
+	grow_array(a, len);
 
-	a->alloc *= 2;
+	for (size_t i = a->len; i < len; i++)
+		a->v[ARRAY_SLOT(a, i)] = NIL;
+
+	a->len = len;
+}
+
+/* The slow path of array_set. */
+void
+array_store(struct array *a, size_t idx, struct value r)
+{
+	detach_views(a);
+
+	if (idx == a->len) {
+		array_push(a, r);
+		return;
+	}
+
+	if (idx > a->len) array_extend(a, idx + 1);
+	make_fit(a, r);
+	put_slot(a, ARRAY_SLOT(a, idx), r);
 }
 
 void
 array_insert(struct array *a, size_t idx, struct value r)
 {
+	if (idx >= a->len) {
+		array_set(a, idx, r);
+		return;
+	}
+
+	detach_views(a);
+	make_fit(a, r);
 	grow_array(a, a->len + 1);
-	if (idx >= a->alloc) grow_array(a, idx + 1);
-	memmove(a->v + idx + 1, a->v + idx, (a->len - idx) * sizeof *a->v);
-	a->v[idx] = r;
+
+	/* Shift whichever side of idx is shorter. */
+	if (idx < a->len / 2) {
+		a->start = (a->start - 1) & (a->alloc - 1);
+		for (size_t i = 0; i < idx; i++)
+			move_elem(a, i, i + 1);
+	} else {
+		for (size_t i = a->len; i > idx; i--)
+			move_elem(a, i, i - 1);
+	}
+
+	put_slot(a, ARRAY_SLOT(a, idx), r);
 	a->len++;
 }
@@ -12,22 +12,31 @@ struct instruction_data instruction_data[] = {
 	{ INSTR_JMP,      REG_A,     "JMP       " },
 	{ INSTR_ESCAPE,   REG_A,     "ESCAPE    " },
 	{ INSTR_PUSH,     REG_A,     "PUSH      " },
+	{ INSTR_PUSHF,    REG_A,     "PUSHF     " },
 	{ INSTR_POP,      REG_A,     "POP       " },
+	{ INSTR_ARG,      REG_AB,    "ARG       " },
 	{ INSTR_POPALL,   REG_A,     "POPALL    " },
 	{ INSTR_CALL,     REG_A,     "CALL      " },
+	{ INSTR_TCALL,    REG_A,     "TCALL     " },
 	{ INSTR_RET,      REG_NONE,  "RET       " },
 	{ INSTR_PUSHIMP,  REG_A,     "PUSHIMP   " },
 	{ INSTR_POPIMP,   REG_NONE,  "POPIMP    " },
 	{ INSTR_GETIMP,   REG_A,     "GETIMP    " },
 	{ INSTR_CHKSTCK,  REG_NONE,  "CHKSTCK   " },
+	{ INSTR_FRAME,    REG_A,     "FRAME     " },
 
 	{ INSTR_PUSHBACK, REG_AB,    "PUSHBACK  " },
 	{ INSTR_ASET,     REG_ABC,   "ASET      " },
 	{ INSTR_DEREF,    REG_ABC,   "DEREF     " },
 	{ INSTR_SUBSCR,   REG_ABC,   "SUBSCR    " },
+	{ INSTR_SUBSCRU,  REG_ABC,   "SUBSCRU   " },
 	{ INSTR_SLICE,    REG_ABCDE, "SLICE     " },
 
 	{ INSTR_MATCH,    REG_ABC,   "MATCH     " },
+	{ INSTR_NEXTM,    REG_ABCD,  "NEXTM     " },
+	{ INSTR_WHICH,    REG_ABC,   "WHICH     " },
+	{ INSTR_JTAB,     REG_ABC,   "JTAB      " },
+	{ INSTR_HTAB,     REG_ABCD,  "HTAB      " },
 	{ INSTR_RESETR,   REG_A,     "RESETR    " },
 	{ INSTR_SUBST,    REG_ABCD,  "SUBST     " },
 	{ INSTR_GROUP,    REG_AB,    "GROUP     " },
@@ -44,6 +53,8 @@ struct instruction_data instruction_data[] = {
 	{ INSTR_INS,      REG_ABC,   "INS       " },
 	{ INSTR_REV,      REG_AB,    "REV       " },
 	{ INSTR_SORT,     REG_AB,    "SORT      " },
+	{ INSTR_IREV,     REG_AB,    "IREV      " },
+	{ INSTR_ISORT,    REG_AB,    "ISORT     " },
 	{ INSTR_ABS,      REG_AB,    "ABS       " },
 	{ INSTR_COUNT,    REG_ABC,   "COUNT     " },
 
@@ -101,6 +112,46 @@ struct instruction_data instruction_data[] = {
 	{ INSTR_NEG,      REG_AB,    "NEG       " },
 	{ INSTR_FLIP,     REG_AB,    "FLIP      " },
 
+	{ INSTR_ADD_II,   REG_ABC,   "ADD_II    " },
+	{ INSTR_SUB_II,   REG_ABC,   "SUB_II    " },
+	{ INSTR_MUL_II,   REG_ABC,   "MUL_II    " },
+	{ INSTR_CMP_II,   REG_ABC,   "CMP_II    " },
+	{ INSTR_LESS_II,  REG_ABC,   "LESS_II   " },
+	{ INSTR_LEQ_II,   REG_ABC,   "LEQ_II    " },
+	{ INSTR_GEQ_II,   REG_ABC,   "GEQ_II    " },
+	{ INSTR_MORE_II,  REG_ABC,   "MORE_II   " },
+	{ INSTR_INC_I,    REG_A,     "INC_I     " },
+	{ INSTR_DEC_I,    REG_A,     "DEC_I     " },
+	{ INSTR_MOV_U,    REG_AB,    "MOV_U     " },
+	{ INSTR_COPY_U,   REG_AB,    "COPY_U    " },
+	{ INSTR_ARG_U,    REG_AB,    "ARG_U     " },
+	{ INSTR_PUSH_U,   REG_A,     "PUSH_U    " },
+	{ INSTR_PUSHF_U,  REG_A,     "PUSHF_U   " },
+	{ INSTR_COND_U,   REG_A,     "COND_U    " },
+	{ INSTR_NCOND_U,  REG_A,     "NCOND_U   " },
+	{ INSTR_ADD_U,    REG_ABC,   "ADD_U     " },
+	{ INSTR_SUB_U,    REG_ABC,   "SUB_U     " },
+	{ INSTR_MUL_U,    REG_ABC,   "MUL_U     " },
+	{ INSTR_POW_U,    REG_ABC,   "POW_U     " },
+	{ INSTR_DIV_U,    REG_ABC,   "DIV_U     " },
+	{ INSTR_MOD_U,    REG_ABC,   "MOD_U     " },
+	{ INSTR_CMP_U,    REG_ABC,   "CMP_U     " },
+	{ INSTR_LESS_U,   REG_ABC,   "LESS_U    " },
+	{ INSTR_LEQ_U,    REG_ABC,   "LEQ_U     " },
+	{ INSTR_GEQ_U,    REG_ABC,   "GEQ_U     " },
+	{ INSTR_MORE_U,   REG_ABC,   "MORE_U    " },
+	{ INSTR_BAND_U,   REG_ABC,   "BAND_U    " },
+	{ INSTR_XOR_U,    REG_ABC,   "XOR_U     " },
+	{ INSTR_BOR_U,    REG_ABC,   "BOR_U     " },
+	{ INSTR_SLEFT_U,  REG_ABC,   "SLEFT_U   " },
+	{ INSTR_SRIGHT_U, REG_ABC,   "SRIGHT_U  " },
+	{ INSTR_NEG_U,    REG_AB,    "NEG_U     " },
+	{ INSTR_FLIP_U,   REG_AB,    "FLIP_U    " },
+	{ INSTR_LEN_U,    REG_AB,    "LEN_U     " },
+	{ INSTR_INC_U,    REG_A,     "INC_U     " },
+	{ INSTR_DEC_U,    REG_A,     "DEC_U     " },
+	{ INSTR_SUBSCR_U, REG_ABC,   "SUBSCR_U  " },
+
 	{ INSTR_PRINT,    REG_A,     "PRINT     " },
 	{ INSTR_LINE,     REG_NONE,  "LINE      " },
 
@@ -151,3 +202,141 @@ print_code(FILE *f, struct instruction *code, size_t num_instr)
 		print_instruction(f, code[i]);
 	}
 }
+
+/* Which of the fields of `c' the vm reads and writes as registers. */
+void
+instruction_operands(struct instruction c, int *use, int *def)
+{
+	static const int fields[] = {
+		[REG_NONE]  = 0,
+		[REG_A]     = FIELD_A,
+		[REG_AB]    = FIELD_A | FIELD_B,
+		[REG_ABC]   = FIELD_A | FIELD_B | FIELD_C,
+		[REG_ABCD]  = FIELD_A | FIELD_B | FIELD_C | FIELD_D,
+		[REG_ABCDE] = FIELD_A | FIELD_B | FIELD_C | FIELD_D | FIELD_E
+	};
+
+	int f = fields[instruction_data[c.type].regtype];
+	*def = f & FIELD_A;
+	*use = f & ~FIELD_A;
+
+	switch (c.type) {
+	case INSTR_JMP:
+	case INSTR_ESCAPE:
+	case INSTR_MSET:
+	case INSTR_FRAME:
+		*def = *use = 0;
+		break;
+
+	case INSTR_COPYC:
+	case INSTR_MOVC:
+		*use = 0;
+		break;
+
+	case INSTR_INTERP:
+		*use = FIELD_B;
+		break;
+
+	case INSTR_SUBST:
+		*def = FIELD_A | FIELD_C;
+		*use = FIELD_A | FIELD_B | FIELD_C;
+		break;
+
+	case INSTR_NEXTM:
+		*def = FIELD_A | FIELD_B;
+		*use = FIELD_C | FIELD_D;
+		break;
+
+	case INSTR_PUSH:
+	case INSTR_PUSHF:
+	case INSTR_PUSH_U:
+	case INSTR_PUSHF_U:
+	case INSTR_CALL:
+	case INSTR_TCALL:
+	case INSTR_PUSHIMP:
+	case INSTR_PRINT:
+	case INSTR_RESETR:
+	case INSTR_KILL:
+	case INSTR_COND:
+	case INSTR_NCOND:
+	case INSTR_COND_U:
+	case INSTR_NCOND_U:
+	case INSTR_JTAB:
+	case INSTR_HTAB:
+	case INSTR_EEND:
+	case INSTR_END:
+		*def = 0;
+		*use = FIELD_A;
+		break;
+
+	case INSTR_PUSHBACK:
+	case INSTR_APUSH:
+	case INSTR_INS:
+		*def = 0;
+		*use |= FIELD_A;
+		break;
+
+	case INSTR_INC:
+	case INSTR_DEC:
+	case INSTR_INC_I:
+	case INSTR_DEC_I:
+	case INSTR_INC_U:
+	case INSTR_DEC_U:
+	case INSTR_ASET:
+		*use |= FIELD_A;
+		break;
+
+	default: break;
+	}
+}
+
+uint16_t *
+instruction_field(struct instruction *c, int f)
+{
+	switch (f) {
+	case FIELD_A: return &c->a;
+	case FIELD_B: return &c->b;
+	case FIELD_C: return &c->c;
+	case FIELD_D: return &c->d;
+	default: return &c->e;
+	}
+}
+
+/*
+ * Stores where control can go after `c' at `ip' in `succ', which has
+ * room for MAX_SUCC of them, and returns how many places there are.
+ */
+int
+instruction_successors(struct instruction c, size_t ip, size_t *succ)
+{
+	switch (c.type) {
+	case INSTR_JMP:
+		succ[0] = c.a;
+		return 1;
+
+	case INSTR_COND:
+	case INSTR_NCOND:
+	case INSTR_COND_U:
+	case INSTR_NCOND_U:
+		succ[0] = ip + 1;
+		succ[1] = ip + 2;
+		return 2;
+
+	/* These are followed by a jump for each of their `c' cases. */
+	case INSTR_JTAB:
+	case INSTR_HTAB:
+		for (int i = 0; i < c.c; i++)
+			succ[i] = ip + 1 + i;
+		return c.c;
+
+	case INSTR_RET:
+	case INSTR_ESCAPE:
+	case INSTR_EEND:
+	case INSTR_END:
+		return 0;
+
+	default:
+		succ[0] = ip + 1;
+		return 1;
+	}
+}
@@ -12,6 +12,8 @@
 #include "lexer.h"
 #include "parse.h"
 #include "operator.h"
+#include "regalloc.h"
+#include "optimize.h"
 
 static struct compiler *
 new_compiler()
@@ -30,6 +32,8 @@ free_compiler(struct compiler *c)
 {
 	free(c->stack_top);
 	free(c->stack_base);
+	free(c->segment);
+	free(c->temps);
 	free(c->var);
 	free(c->next);
 	free(c->last);
@@ -95,12 +99,47 @@ push_frame(struct compiler *c)
 {
 	c->stack_top = oak_realloc(c->stack_top, (c->sp + 2) * sizeof *c->stack_top);
 	c->stack_base = oak_realloc(c->stack_base, (c->sp + 2) * sizeof *c->stack_base);
+	c->segment = oak_realloc(c->segment, (c->sp + 2) * sizeof *c->segment);
+	c->temps = oak_realloc(c->temps, (c->sp + 2) * sizeof *c->temps);
 	c->var = oak_realloc(c->var, (c->sp + 2) * sizeof *c->var);
 
 	c->sp++;
 	c->var[c->sp] = 0;
-	c->stack_top[c->sp] = c->sym->num_variables;
-	c->stack_base[c->sp] = c->sym->num_variables;
+	c->stack_top[c->sp] = TEMP_REG;
+	c->stack_base[c->sp] = TEMP_REG;
+	c->segment[c->sp] = c->ip;
+	c->temps[c->sp] = 0;
+}
+
+/*
+ * None of the temporaries allocated in the frame since the last call
+ * are live anymore, so they can be packed onto as few registers as
+ * possible.
+ */
+static void
+end_segment(struct compiler *c)
+{
+	int n = allocate_temps(c->code, c->segment[c->sp], c->ip);
+	if (n > c->temps[c->sp]) c->temps[c->sp] = n;
+	c->segment[c->sp] = c->ip;
+}
+
+/*
+ * Puts the temporaries of the frame starting at `start' above its
+ * variables at `base' and returns the number of registers it needs.
+ */
+static int
+finish_frame(struct compiler *c, size_t start, int base)
+{
+	end_segment(c);
+	place_temps(c->code, start, c->ip, base);
+
+	if (base + c->temps[c->sp] > NUM_REG) {
+		error_push(c->r, c->stmt->tok->loc, ERR_FATAL,
+		           "insufficient registers to compile module or function");
+	}
+
+	return base + c->temps[c->sp];
 }
 
 static void
@@ -126,7 +165,7 @@ push_next(struct compiler *c, size_t a)
 static int
 alloc_reg(struct compiler *c)
 {
-	if (c->stack_top[c->sp] >= 1 << 15) {
+	if (c->stack_top[c->sp] >= MAX_TEMP) {
 		error_push(c->r, c->stmt->tok->loc, ERR_FATAL,
 		           "insufficient registers to compile module or function");
 		return -1;
@@ -135,6 +174,17 @@ alloc_reg(struct compiler *c)
 	return c->stack_top[c->sp]++;
 }
 
+/*
+ * Variables get the next slot of their frame, except those of a
+ * function being inlined, which only live as long as the expansion
+ * and are given temporaries.
+ */
+static int
+alloc_var(struct compiler *c)
+{
+	return c->inlining ? alloc_reg(c) : c->var[c->sp]++;
+}
+
 static int
 add_constant(struct compiler *c, struct token *tok)
 {
@@ -151,6 +201,134 @@ nil(struct compiler *c)
 	return reg;
 }
 
+/*
+ * Returns the literal a regex constant matches if it's nothing else,
+ * in which case whether it matches is just whether the literal
+ * appears in the subject.
+ */
+static const char *
+regex_literal(struct compiler *c, int k)
+{
+	struct ktre *re = c->gc->regex[c->ct->val[k].idx];
+	if (re->err || (re->opt & KTRE_CONTINUE)) return NULL;
+	return re->delim;
+}
+
+/*
+ * Compiles the literals `lit' into a single alternation, escaping
+ * anything ktre would take for something other than itself. Returns
+ * the constant or -1 if ktre won't run it on an automaton.
+ */
+static int
+literal_alternation(struct compiler *c, const char **lit, int n)
+{
+	char *pat = NULL;
+	size_t len = 0;
+
+	for (int i = 0; i < n; i++) {
+		pat = oak_realloc(pat, len + strlen(lit[i]) * 2 + 2);
+
+		for (const char *s = lit[i]; *s; s++) {
+			if (strchr("\\^$.|?*+()[]{}#", *s)) pat[len++] = '\\';
+			pat[len++] = *s;
+		}
+
+		if (i != n - 1) pat[len++] = '|';
+		pat[len] = 0;
+	}
+
+	struct value v;
+	v.type = VAL_REGEX;
+	v.idx = gc_alloc(c->gc, VAL_REGEX);
+	v.e = 0;
+	c->gc->regex[v.idx] = recache_get(c->m->k->recache, pat, KTRE_UNANCHORED);
+	free(pat);
+
+	struct ktre *re = c->gc->regex[v.idx];
+	if (re->err || !re->ac || re->ac->num_alt != n) return -1;
+
+	return constant_table_add(c->ct, v);
+}
+
+/*
+ * The arms at the front of a match that compare against integer or
+ * string constants can be picked between with a single lookup. If
+ * there are enough of them, emits a JTAB when the integers are dense
+ * and an HTAB otherwise, followed by one jump for each of its cases.
+ * Returns how many arms are covered and leaves the address of the
+ * first jump in `slot', the number of jumps in `num', and which arm
+ * each jump goes to (or -1 for none of them) in `target', which has
+ * room for twice as many jumps as there are arms.
+ */
+static size_t
+case_table(struct compiler *c, struct expression *e, struct symbol *sym,
+           size_t *slot, int *num, int *target)
+{
+	struct value key[e->num];
+	size_t n = 0;
+
+	while (n < e->num && n < MAX_SUCC - 1
+	       && e->match[n]->type != EXPR_REGEX
+	       && is_constant_expr(c, sym, e->match[n])) {
+		struct value v = compile_constant_expr(c, sym, e->match[n]);
+		if (v.type == VAL_ERR) free(v.err);
+		if (v.type != VAL_INT && v.type != VAL_STR) break;
+		if (n && v.type != key[0].type) break;
+		key[n++] = v;
+	}
+
+	/* A few comparisons are as quick as a lookup. */
+	if (n < 4) return 0;
+
+	int64_t lo = INT64_MAX, hi = INT64_MIN;
+	for (size_t i = 0; i < n && key[0].type == VAL_INT; i++) {
+		if (key[i].integer < lo) lo = key[i].integer;
+		if (key[i].integer > hi) hi = key[i].integer;
+	}
+
+	uint64_t span = (uint64_t)hi - (uint64_t)lo;
+	int subject = alloc_reg(c);
+	emit_a(c, INSTR_GETIMP, subject, &e->tok->loc);
+
+	if (key[0].type == VAL_INT && span < 2 * n && span < MAX_SUCC - 1) {
+		*num = span + 2;
+		for (int i = 0; i < *num; i++) target[i] = -1;
+
+		/* The first of two arms with the same key wins. */
+		for (size_t i = n; i-- > 0;)
+			target[key[i].integer - lo + 1] = i;
+
+		emit_abc(c, INSTR_JTAB, subject,
+		         constant_table_add(c->ct, INT(lo)), *num, &e->tok->loc);
+	} else {
+		struct value t;
+		t.type = VAL_TABLE;
+		t.idx = gc_alloc(c->gc, VAL_TABLE);
+		c->gc->table[t.idx] = new_table();
+
+		*num = n + 1;
+		target[0] = -1;
+
+		for (size_t i = n; i-- > 0;) {
+			char buf[32], *k = buf;
+			if (key[i].type == VAL_STR) k = c->gc->str[key[i].idx];
+			else snprintf(buf, sizeof buf, "%"PRId64, key[i].integer);
+
+			table_add(c->gc->table[t.idx], k, INT(i + 1));
+			target[i + 1] = i;
+		}
+
+		emit_abcd(c, INSTR_HTAB, subject, constant_table_add(c->ct, t),
+		          *num, key[0].type, &e->tok->loc);
+	}
+
+	*slot = c->ip;
+	for (int i = 0; i < *num; i++)
+		emit_a(c, INSTR_JMP, -1, &e->tok->loc);
+
+	return n;
+}
+
 static int
 count_imp(struct symbol *top, struct symbol *base)
 {
@@ -164,10 +342,188 @@ count_imp(struct symbol *top, struct symbol *base)
 	return imp;
 }
 
+/*
+ * Loops over an array measure it at the top of every iteration, so
+ * that the subscript after the check can skip its own. If nothing in
+ * the body since `start' can change the length of whatever `reg'
+ * holds, or put something else in it, the measuring only has to be
+ * done on the way in and the loop can jump back past it.
+ */
+static bool
+may_resize(struct compiler *c, size_t start, int reg)
+{
+	for (size_t i = start; i < c->ip; i++) {
+		int use, def;
+
+		switch (c->code[i].type) {
+		case INSTR_CALL: case INSTR_TCALL: case INSTR_EVAL:
+		case INSTR_INTERP: case INSTR_SUBST: case INSTR_PUSHBACK:
+		case INSTR_ASET: case INSTR_APUSH: case INSTR_APOP:
+		case INSTR_SHIFT: case INSTR_INS:
+			return true;
+		default: break;
+		}
+
+		instruction_operands(c->code[i], &use, &def);
+
+		for (int f = FIELD_A; f <= FIELD_E; f <<= 1)
+			if (def & f && *instruction_field(c->code + i, f) == reg)
+				return true;
+	}
+
+	return false;
+}
+
 static int compile_expression(struct compiler *c, struct expression *e, struct symbol *sym);
 static int compile_lvalue(struct compiler *c, struct expression *e, struct symbol *sym);
 static int compile_statement(struct compiler *c, struct statement *s);
 
+/*
+ * Whether evaluating `e' might change something another expression
+ * can see, or depend on being evaluated at a particular moment.
+ */
+static bool
+has_effects(struct expression *e)
+{
+	if (!e) return false;
+
+	switch (e->type) {
+	case EXPR_VALUE:
+		return e->val->type == TOK_STRING && e->val->is_interpolatable;
+
+	case EXPR_OPERATOR:
+		if (e->operator->type == OPTYPE_PREFIX
+		    || e->operator->type == OPTYPE_POSTFIX)
+			if (e->operator->name == OP_ADDADD || e->operator->name == OP_SUBSUB)
+				return true;
+
+		if (e->operator->type == OPTYPE_BINARY) {
+			switch (e->operator->name) {
+			case OP_EQ: case OP_ADDEQ: case OP_SUBEQ: case OP_MULEQ:
+			case OP_DIVEQ: case OP_DOTEQ: case OP_SQUIGGLEEQ:
+				return true;
+			default: break;
+			}
+		}
+
+		return has_effects(e->a) || has_effects(e->b) || has_effects(e->c);
+
+	case EXPR_BUILTIN:
+		switch (e->bi->name) {
+		case BUILTIN_SPLIT: case BUILTIN_PUSH: case BUILTIN_POP:
+		case BUILTIN_SHIFT: case BUILTIN_INSERT: case BUILTIN_SAY:
+		case BUILTIN_SAYLN:
+			return true;
+		default: break;
+		}
+		/* fallthrough */
+
+	case EXPR_LIST: case EXPR_TABLE: case EXPR_SUBSCRIPT: case EXPR_SLICE:
+		if (has_effects(e->a) || has_effects(e->b)
+		    || has_effects(e->c) || has_effects(e->d))
+			return true;
+
+		for (size_t i = 0; i < e->num; i++)
+			if (has_effects(e->args[i]))
+				return true;
+
+		return false;
+
+	default:
+		return true;
+	}
+}
+
+/*
+ * Maps and comprehensions over _ are stages of a pipeline, turning
+ * each element of their input into an element of their output. When
+ * the input of one stage is another stage, the outer one can take
+ * the elements of the innermost input through all of the stages in
+ * a single loop, with no arrays in between. That's only allowed
+ * where no stage has effects that could tell the difference.
+ */
+static struct expression *
+stage_input(struct expression *e)
+{
+	if (e && e->type == EXPR_BUILTIN && e->bi->name == BUILTIN_MAP && e->num == 2)
+		return e->args[1];
+	if (e && e->type == EXPR_LIST_COMPREHENSION && !e->b)
+		return e->s->expr;
+	return NULL;
+}
+
+static struct expression *
+stage_body(struct expression *e)
+{
+	return e->type == EXPR_BUILTIN ? e->args[0] : e->a;
+}
+
+/*
+ * Finds where the elements given to a stage with `body' should come
+ * from when it reads from `input'.
+ */
+static struct expression *
+pipeline_source(struct expression *body, struct expression *input)
+{
+	if (has_effects(body)) return input;
+
+	while (stage_input(input) && !has_effects(stage_body(input)))
+		input = stage_input(input);
+
+	return input;
+}
+
+/*
+ * Runs the element in `elem' of `source' through the stages between
+ * it and `e'.
+ */
+static int
+compile_stages(struct compiler *c, struct expression *e,
+               struct expression *source, int elem, struct symbol *sym)
+{
+	if (e == source) return elem;
+
+	int in = compile_stages(c, stage_input(e), source, elem, sym);
+	emit_a(c, INSTR_PUSHIMP, in, &e->tok->loc);
+	int out = compile_expression(c, stage_body(e), sym);
+	emit_(c, INSTR_POPIMP, &e->tok->loc);
+
+	return out;
+}
+
+/*
+ * Puts the element at `index' of `array', the output of `source',
+ * into `dest' by way of the stages up to `input'.
+ */
+static void
+subscript_stages(struct compiler *c, int dest, int array, int index,
+                 struct expression *input, struct expression *source,
+                 struct symbol *sym)
+{
+	if (input == source) {
+		emit_abc(c, INSTR_SUBSCRU, dest, array, index, &input->tok->loc);
+		return;
+	}
+
+	int elem = alloc_reg(c);
+	emit_abc(c, INSTR_SUBSCRU, elem, array, index, &input->tok->loc);
+	emit_ab(c, INSTR_MOV, dest,
+	        compile_stages(c, input, source, elem, sym), &input->tok->loc);
+}
+
+/* Whether `e' builds an array that nothing else holds on to. */
+static bool
+makes_array(struct expression *e)
+{
+	if (!e) return false;
+	if (stage_input(e) || e->type == EXPR_LIST
+	    || e->type == EXPR_LIST_COMPREHENSION)
+		return true;
+
+	return e->type == EXPR_BUILTIN
+		&& (e->bi->name == BUILTIN_SORT || e->bi->name == BUILTIN_REVERSE);
+}
+
 #define CHECKARGS(X)	  \
 	do { \
 		if (X) { \
@@ -322,12 +678,13 @@ compile_builtin(struct compiler *c, struct expression *e, struct symbol *sym)
 		v.integer = -1;
 
 		/* TODO: name these better. */
-		int expr = compile_expression(c, e->args[1], sym);
+		struct expression *source = pipeline_source(e->args[0], e->args[1]);
+		int expr = compile_expression(c, source, sym);
 		emit_ab(c, INSTR_COPYC, iter, constant_table_add(c->ct, v), &e->tok->loc);
 		size_t start = c->ip;
-		emit_a(c, INSTR_INC, iter, &e->tok->loc);
 		int len = alloc_reg(c);
 		emit_ab(c, INSTR_LEN, len, expr, &e->tok->loc);
+		emit_a(c, INSTR_INC, iter, &e->tok->loc);
 		int cond = alloc_reg(c);
 		emit_abc(c, INSTR_LESS, cond, iter, len, &e->tok->loc);
 		emit_a(c, INSTR_COND, cond, &e->tok->loc);
@@ -335,14 +692,17 @@ compile_builtin(struct compiler *c, struct expression *e, struct symbol *sym)
 		size_t a = c->ip;
 		emit_a(c, INSTR_JMP, -1, &e->tok->loc);
 		int temp = alloc_reg(c);
-		emit_abc(c, INSTR_SUBSCR, temp, expr, iter, &e->tok->loc);
+		emit_abc(c, INSTR_SUBSCRU, temp, expr, iter, &e->tok->loc);
+		size_t body = c->ip;
+		temp = compile_stages(c, e->args[1], source, temp, sym);
 		emit_a(c, INSTR_PUSHIMP, temp, &e->tok->loc);
 
 		int thing = compile_expression(c, e->args[0], sym);
+		bool resized = may_resize(c, body, expr);
 		emit_ab(c, INSTR_PUSHBACK, reg, thing, &e->tok->loc);
 
 		emit_(c, INSTR_POPIMP, &e->tok->loc);
-		emit_a(c, INSTR_JMP, start, &e->tok->loc);
+		emit_a(c, INSTR_JMP, resized ? start : start + 1, &e->tok->loc);
 		c->code[a].a = c->ip;
 	} break;
 
@@ -419,8 +779,26 @@ compile_builtin(struct compiler *c, struct expression *e, struct symbol *sym)
 
 	UNARY(POP, APOP);
 	UNARY(SHIFT, SHIFT);
-	UNARY(REVERSE, REV);
-	UNARY(SORT, SORT);
+	case BUILTIN_REVERSE: case BUILTIN_SORT: {
+		bool rev = e->bi->name == BUILTIN_REVERSE;
+		int arg = -1;
+
+		if (e->num == 0) {
+			arg = alloc_reg(c);
+			emit_a(c, INSTR_GETIMP, arg, &e->tok->loc);
+		} else {
+			CHECKARGS(e->num != 1);
+			arg = compile_expression(c, e->args[0], sym);
+		}
+
+		/* An array nobody else has can be worked on in place. */
+		int op = rev ? INSTR_REV : INSTR_SORT;
+		if (e->num == 1 && makes_array(e->args[0]))
+			op = rev ? INSTR_IREV : INSTR_ISORT;
+
+		emit_ab(c, op, reg = alloc_reg(c), arg, &e->tok->loc);
+	} break;
+
 	UNARY(UC, UC);
 	UNARY(LC, LC);
 	UNARY(UCFIRST, UCFIRST);
@@ -454,11 +832,87 @@ compile_builtin(struct compiler *c, struct expression *e, struct symbol *sym)
 	return reg;
 }
 
+/* Whether `e' certainly evaluates to a string. */
+static bool
+is_string(struct expression *e)
+{
+	if (!e) return false;
+	if (e->type == EXPR_VALUE) return e->val->type == TOK_STRING;
+
+	return e->type == EXPR_OPERATOR
+		&& e->operator->type == OPTYPE_BINARY
+		&& e->operator->name == OP_ADD
+		&& (is_string(e->a) || is_string(e->b));
+}
+
+/*
+ * Whether nothing but `reg', which `e' was just compiled into, can
+ * refer to the value of `e' or to anything inside of it. Those values
+ * can be handed on without the copy an assignment or a call would
+ * otherwise make. A call's result comes off the stack through pop(),
+ * which shares tables, so calls only count when `call' says that's
+ * fine, as it is for arguments that pop() would share anyway.
+ */
+static bool
+is_fresh(struct compiler *c, struct symbol *sym, struct expression *e, int reg, bool call)
+{
+	/* A missing operand is the implicit variable. */
+	if (!e) return false;
+	if (is_constant_expr(c, sym, e)) return true;
+
+	switch (e->type) {
+	case EXPR_VALUE:
+		if (e->val->type != TOK_IDENTIFIER) return true;
+		if (!strcmp(e->val->value, "nil")) return true;
+		if (!strcmp(e->val->value, "_")) return false;
+
+		struct symbol *var = resolve(sym, e->val->value);
+		return var && (var->type == SYM_ENUM || var->type == SYM_FN);
+
+	case EXPR_LIST:
+		for (size_t i = 0; i < e->num; i++)
+			if (!is_fresh(c, sym, e->args[i], -1, false))
+				return false;
+		return true;
+
+	case EXPR_TABLE:
+		for (size_t i = 0; i < e->num; i++)
+			if (!is_fresh(c, sym, e->args[i], -1, false))
+				return false;
+		return true;
+
+	case EXPR_FN_DEF:
+		return true;
+
+	case EXPR_FN_CALL:
+		/* An inlined call leaves whatever its body gave. */
+		return call && c->ip && c->code[c->ip - 1].type == INSTR_POP
+			&& c->code[c->ip - 1].a == reg;
+
+	case EXPR_OPERATOR:
+		if (e->operator->type != OPTYPE_BINARY) return false;
+
+		switch (e->operator->name) {
+		/* Adding arrays or tables shares their elements. */
+		case OP_ADD: return is_string(e);
+		case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+		case OP_POW: case OP_LEFT: case OP_RIGHT: case OP_BAND:
+		case OP_XOR: case OP_BOR: case OP_CMP: case OP_NOTEQ:
+		case OP_LESS: case OP_MORE: case OP_LEQ: case OP_GEQ:
+			return true;
+		default: return false;
+		}
+
+	default:
+		return false;
+	}
+}
+
 static int
-write_variable(struct compiler *c, struct expression *e, struct symbol *sym, int rhs)
+write_variable(struct compiler *c, struct expression *e, struct symbol *sym, int rhs, bool fresh)
 {
 	int reg = -1, r = alloc_reg(c);
-	emit_ab(c, INSTR_COPY, r, rhs, &e->tok->loc);
+	emit_ab(c, fresh ? INSTR_MOV : INSTR_COPY, r, rhs, &e->tok->loc);
 
 	if (e->type == EXPR_SUBSCRIPT) {
 		emit_abc(c, INSTR_ASET,
@@ -496,13 +950,17 @@ compile_operator(struct compiler *c, struct expression *e, struct symbol *sym)
 {
 	int reg = -1;
 
+	/*
+	 * The right operand is compiled, and so runs, before the left
+	 * one; programs can see the order through side effects, so
+	 * it's spelled out here instead of left to argument evaluation.
+	 */
 #define BIN(X,Y)	  \
-	case OP_##X: \
-		emit_abc(c, INSTR_##Y, reg = alloc_reg(c), \
-		         compile_expression(c, e->a, sym), \
-		         compile_expression(c, e->b, sym), \
-		         &e->tok->loc); \
-		break
+	case OP_##X: { \
+		int r = compile_expression(c, e->b, sym); \
+		int l = compile_expression(c, e->a, sym); \
+		emit_abc(c, INSTR_##Y, reg = alloc_reg(c), l, r, &e->tok->loc); \
+	} break
 
 	switch (e->operator->type) {
 	case OPTYPE_BINARY:
@@ -541,7 +999,8 @@ compile_operator(struct compiler *c, struct expression *e, struct symbol *sym)
 			break;
 
 		case OP_EQ:
-			write_variable(c, e->a, sym, reg = compile_expression(c, e->b, sym));
+			reg = compile_expression(c, e->b, sym);
+			write_variable(c, e->a, sym, reg, is_fresh(c, sym, e->b, reg, false));
 			break;
 
 		case OP_AND: {
@@ -621,7 +1080,7 @@ compile_operator(struct compiler *c, struct expression *e, struct symbol *sym)
 	case OP_##X: { \
 		reg = alloc_reg(c); \
 		emit_abc(c, INSTR_##Y, reg, compile_expression(c, e->a, sym), compile_expression(c, e->b, sym), &e->tok->loc); \
-		write_variable(c, e->a, sym, reg); \
+		write_variable(c, e->a, sym, reg, false); \
 	} break
 
 		OPEQ(ADDEQ, ADD);
@@ -632,7 +1091,7 @@ compile_operator(struct compiler *c, struct expression *e, struct symbol *sym)
 		case OP_DOTEQ: {
 			int t = alloc_reg(c);
 			emit_abc(c, INSTR_ADD, t, compile_expression(c, e->a, sym), reg = compile_expression(c, e->b, sym), &e->tok->loc);
-			write_variable(c, e->a, sym, t);
+			write_variable(c, e->a, sym, t, false);
 		} break;
 
 		case OP_COMMA:
@@ -714,7 +1173,7 @@ compile_operator(struct compiler *c, struct expression *e, struct symbol *sym)
 
 				emit_abcd(c, INSTR_SUBST, temp,
 				          re, str, sym->scope, &e->tok->loc);
-				write_variable(c, e->a, sym, temp);
+				write_variable(c, e->a, sym, temp, false);
 			} else {
 				int re = alloc_reg(c);
 				reg = alloc_reg(c);
@@ -733,7 +1192,7 @@ compile_operator(struct compiler *c, struct expression *e, struct symbol *sym)
 #define PRE(X,Y)	  \
 		case OP_##X: { \
 			emit_a(c, INSTR_##Y, reg = compile_expression(c, e->a, sym), &e->tok->loc); \
-			write_variable(c, e->a, sym, reg); \
+			write_variable(c, e->a, sym, reg, false); \
 		} break
 
 	case OPTYPE_PREFIX:
@@ -767,7 +1226,7 @@ compile_operator(struct compiler *c, struct expression *e, struct symbol *sym)
 			int t = alloc_reg(c); \
 			emit_ab(c, INSTR_COPY, t, reg, &e->tok->loc); \
 			emit_a(c, INSTR_##Y, t, &e->tok->loc); \
-			write_variable(c, e->a, sym, t); \
+			write_variable(c, e->a, sym, t, false); \
 		} break
 
 	case OPTYPE_POSTFIX:
@@ -883,11 +1342,296 @@ compile_lvalue(struct compiler *c, struct expression *e, struct symbol *sym)
 	assert(false);
 }
 
+/*
+ * Calls to small functions are expanded in place under -O when the
+ * function's body only looks at its arguments, its own variables,
+ * globals, and other functions, and runs straight through to at most
+ * one return at its end. The arguments are bound straight into
+ * registers, the function's variables get temporaries of the caller,
+ * and no frame is ever set up.
+ */
+#define MAX_INLINE_SIZE 64
+#define MAX_INLINE_DEPTH 4
+
+static const char *
+check_inline_expr(struct symbol *fn, struct symbol *sym, struct expression *e, int *size)
+{
+	const char *why = NULL;
+	if (!e) return NULL;
+	if (++*size > MAX_INLINE_SIZE) return "too large";
+
+	switch (e->type) {
+	case EXPR_VALUE: {
+		if (e->val->type == TOK_STRING && e->val->is_interpolatable)
+			return "interpolates a string";
+		if (e->val->type != TOK_IDENTIFIER
+		    || !strcmp(e->val->value, "_")
+		    || !strcmp(e->val->value, "nil"))
+			return NULL;
+
+		struct symbol *var = resolve(sym, e->val->value);
+
+		if (!var) return "uses an undeclared identifier";
+		if (var == fn) return "recursive";
+		if (var->type == SYM_FN || var->type == SYM_ENUM) return NULL;
+		for (size_t i = 0; i < fn->num_children; i++)
+			if (fn->children[i] == var) return NULL;
+		for (struct symbol *p = var->parent; p; p = p->parent)
+			if (p == fn) return NULL;
+		if (var->type == SYM_VAR && var->global && var->address != (size_t)-1)
+			return NULL;
+
+		return "uses a variable it doesn't own";
+	}
+
+	case EXPR_REGEX:
+		return e->val->substitution ? "substitutes" : NULL;
+
+	case EXPR_OPERATOR:
+		/* The right side of . is a key, not a variable. */
+		if (e->operator->type == OPTYPE_BINARY && e->operator->name == OP_PERIOD)
+			return check_inline_expr(fn, sym, e->a, size);
+		/* fallthrough */
+
+	case EXPR_FN_CALL: case EXPR_LIST: case EXPR_SUBSCRIPT:
+	case EXPR_BUILTIN: case EXPR_GROUP: case EXPR_TABLE:
+	case EXPR_SLICE:
+		if ((why = check_inline_expr(fn, sym, e->a, size))
+		    || (why = check_inline_expr(fn, sym, e->b, size))
+		    || (why = check_inline_expr(fn, sym, e->c, size))
+		    || (why = check_inline_expr(fn, sym, e->d, size)))
+			return why;
+
+		if (e->type != EXPR_OPERATOR)
+			for (size_t i = 0; i < e->num && !why; i++)
+				why = check_inline_expr(fn, sym, e->args[i], size);
+
+		return why;
+
+	case EXPR_FN_DEF: return "defines a function";
+	case EXPR_EVAL:   return "evaluates code";
+	default:          return "has a statement in it";
+	}
+}
+
+/*
+ * Statements are expanded as they would be compiled in the function.
+ * Anything that could leave the body other than by running off its
+ * end, or that depends on the function's own frame, is refused.
+ */
+static const char *
+check_inline_stmt(struct compiler *c, struct symbol *fn, struct statement *s,
+                  int loops, int *size)
+{
+	const char *why = NULL;
+	if (!s) return NULL;
+	if (++*size > MAX_INLINE_SIZE) return "too large";
+
+	struct symbol *sym = find_from_scope(c->m->sym, s->scope);
+	if (!sym) return "has no scope";
+	if ((why = check_inline_expr(fn, sym, s->condition, size))) return why;
+
+	switch (s->type) {
+	case STMT_NULL: return NULL;
+	case STMT_EXPR: return check_inline_expr(fn, sym, s->expr, size);
+
+	case STMT_BLOCK:
+		for (size_t i = 0; i < s->block.num && !why; i++)
+			why = check_inline_stmt(c, fn, s->block.stmts[i], loops, size);
+		return why;
+
+	case STMT_VAR_DECL:
+		for (size_t i = 0; s->var_decl.init && i < s->var_decl.num && !why; i++)
+			why = check_inline_expr(fn, sym, s->var_decl.init[i], size);
+		return why;
+
+	case STMT_PRINT: case STMT_PRINTLN:
+		for (size_t i = 0; i < s->print.num && !why; i++)
+			why = check_inline_expr(fn, sym, s->print.args[i], size);
+		return why;
+
+	case STMT_IF_STMT:
+		if ((why = check_inline_expr(fn, sym, s->if_stmt.cond, size))
+		    || (why = check_inline_stmt(c, fn, s->if_stmt.then, loops, size)))
+			return why;
+		return check_inline_stmt(c, fn, s->if_stmt.otherwise, loops, size);
+
+	case STMT_WHILE:
+		if ((why = check_inline_expr(fn, sym, s->while_loop.cond, size)))
+			return why;
+		return check_inline_stmt(c, fn, s->while_loop.body, loops + 1, size);
+
+	case STMT_FOR_LOOP:
+		if ((why = check_inline_stmt(c, fn, s->for_loop.a, loops, size))
+		    || (why = check_inline_expr(fn, sym, s->for_loop.b, size))
+		    || (why = check_inline_expr(fn, sym, s->for_loop.c, size)))
+			return why;
+		return check_inline_stmt(c, fn, s->for_loop.body, loops + 1, size);
+
+	case STMT_LAST: case STMT_NEXT:
+		return loops ? NULL : "leaves a loop it isn't in";
+
+	case STMT_RET:     return "returns early";
+	case STMT_DO:      return "has a do loop";
+	case STMT_FN_DEF:  return "defines a function";
+	case STMT_LABEL: case STMT_GOTO: return "uses goto";
+	default:           return "has a statement it can't expand";
+	}
+}
+
+/*
+ * Returns why the call `e' to `fn' can't be inlined, or NULL and the
+ * expression it returns (NULL for nil) and the scope that expression
+ * is in.
+ */
+static const char *
+check_inline(struct compiler *c, struct symbol *fn, struct expression *e,
+             struct expression **ret, struct symbol **scope)
+{
+	struct statement *s = fn->def;
+
+	if (c->inlining >= MAX_INLINE_DEPTH) return "inlined too deeply";
+	if (!s || fn->module != c->m) return "defined elsewhere";
+	if (s->fn_def.num != e->num) return "wrong number of arguments";
+
+	for (size_t i = 0; i < s->fn_def.num; i++)
+		if (s->fn_def.init[i]) return "has default arguments";
+
+	s = s->fn_def.body;
+	if (!s) return "has no body";
+
+	*scope = find_from_scope(c->m->sym, s->scope);
+	if (!*scope) return "has no scope";
+
+	struct statement **stmts = s->type == STMT_BLOCK ? s->block.stmts : &s;
+	size_t num = s->type == STMT_BLOCK ? s->block.num : 1;
+	*ret = NULL;
+
+	if (num && stmts[num - 1]->type == STMT_RET && !stmts[num - 1]->condition) {
+		*ret = stmts[num - 1]->ret.expr;
+		*scope = find_from_scope(c->m->sym, stmts[num - 1]->scope);
+		if (!*scope) return "has no scope";
+		num--;
+	}
+
+	/*
+	 * Loops in an eval leave through the addresses their symbols
+	 * recorded, which are those of the function's own copy.
+	 */
+	if (num && c->eval) return "has statements and is called from an eval";
+
+	const char *why = NULL;
+	int size = 0;
+
+	for (size_t i = 0; i < num && !why; i++)
+		why = check_inline_stmt(c, fn, stmts[i], 0, &size);
+
+	return why ? why : check_inline_expr(fn, *scope, *ret, &size);
+}
+
+static size_t
+count_symbols(struct symbol *s)
+{
+	size_t n = 1;
+	for (size_t i = 0; i < s->num_children; i++)
+		n += count_symbols(s->children[i]);
+	return n;
+}
+
+/*
+ * What compiling a function's body writes into its symbols: the
+ * addresses of its variables, and where its loops continue and end.
+ */
+struct placement {
+	size_t address;
+	int next, last;
+};
+
+/*
+ * Saves the placement of `s' and everything under it and clears the
+ * loop addresses for a new copy of the code, or puts it back.
+ */
+static struct placement *
+keep_placement(struct symbol *s, struct placement *save, bool restore)
+{
+	if (restore) {
+		s->address = save->address;
+		s->next = save->next;
+		s->last = save->last;
+	} else {
+		*save = (struct placement){ s->address, s->next, s->last };
+		s->next = s->last = -1;
+	}
+
+	save++;
+
+	for (size_t i = 0; i < s->num_children; i++)
+		save = keep_placement(s->children[i], save, restore);
+
+	return save;
+}
+
+static int
+inline_call(struct compiler *c, struct symbol *fn, struct expression *e,
+            struct symbol *sym, struct expression *ret, struct symbol *scope)
+{
+	struct statement *s = fn->def;
+	struct statement *body = s->fn_def.body;
+	int arg[e->num];
+	bool fresh[e->num];
+
+	for (int i = e->num - 1; i >= 0; i--) {
+		arg[i] = alloc_reg(c);
+		int val = compile_expression(c, e->args[i], sym);
+		fresh[i] = is_fresh(c, sym, e->args[i], val, true);
+		emit_ab(c, INSTR_MOV, arg[i], val, &e->tok->loc);
+	}
+
+	/*
+	 * Compiling the body places the function's variables and loops
+	 * in our code; the function gets its own back once we're done.
+	 */
+	struct placement *saved = oak_malloc(count_symbols(fn) * sizeof *saved);
+	keep_placement(fn, saved, false);
+
+	for (size_t i = 0; i < e->num; i++) {
+		struct symbol *param = resolve(scope, s->fn_def.args[i]->value);
+		param->address = alloc_reg(c);
+		emit_ab(c, fresh[i] ? INSTR_MOV : INSTR_ARG, param->address, arg[i], &e->tok->loc);
+	}
+
+	bool in_expr = c->in_expr;
+	c->in_expr = true;
+	c->inlining++;
+
+	/* The only return is the body's last statement, and `ret' is its value. */
+	if (body->type == STMT_BLOCK) {
+		for (size_t i = 0; i < body->block.num; i++)
+			if (body->block.stmts[i]->type != STMT_RET)
+				compile_statement(c, body->block.stmts[i]);
+	} else if (body->type != STMT_RET) {
+		compile_statement(c, body);
+	}
+
+	int val = ret ? compile_expression(c, ret, scope) : nil(c);
+	c->inlining--;
+	c->in_expr = in_expr;
+
+	keep_placement(fn, saved, true);
+	free(saved);
+
+	int reg = alloc_reg(c);
+	emit_ab(c, INSTR_ARG, reg, val, &e->tok->loc);
+	return reg;
+}
+
 static int
 compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 {
 	assert(sym);
 	int reg = -1;
+	bool tail = c->tail;
+	c->tail = false;
 
 	if (!e) {
 		reg = alloc_reg(c);
@@ -995,15 +1739,62 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 		emit_a(c, INSTR_PUSHIMP,
 		       compile_expression(c, e->a, sym), &e->tok->loc);
 
+		/*
+		 * When several arms are plain literals, one pass of an
+		 * automaton over the subject finds the first of them that
+		 * matches, and those arms only compare against that.
+		 */
+		int pattern[e->num], arm[e->num];
+		const char *lit[e->num];
+		int num_lit = 0, dispatch = -1, which = -1;
+
+		for (size_t i = 0; i < e->num; i++) {
+			arm[i] = -1;
+			if (e->match[i]->type != EXPR_REGEX) continue;
+
+			pattern[i] = add_constant(c, e->match[i]->val);
+
+			if ((lit[num_lit] = regex_literal(c, pattern[i])))
+				arm[i] = num_lit++;
+		}
+
+		if (num_lit > 1) dispatch = literal_alternation(c, lit, num_lit);
+
+		size_t slot = 0, miss = 0, body[e->num];
+		int target[2 * e->num + 1], num_slot = 0;
+		size_t num_case = case_table(c, e, sym, &slot, &num_slot, target);
+
 		for (size_t i = 0; i < e->num; i++) {
 			if (last >= 0)
 				c->code[last].a = c->ip;
+			if (i == num_case)
+				miss = c->ip;
 
 			int cond = -1;
-			if (e->match[i]->type == EXPR_REGEX) {
+			if (i < num_case) {
+				/* only reached through the table */
+			} else if (dispatch >= 0 && arm[i] >= 0) {
+				if (which < 0) {
+					int temp = alloc_reg(c);
+					int re = alloc_reg(c);
+					emit_ab(c, INSTR_COPYC, re, dispatch, &e->tok->loc);
+					emit_a(c, INSTR_GETIMP, temp, &e->tok->loc);
+					emit_abc(c, INSTR_WHICH, which = alloc_reg(c), temp, re, &e->tok->loc);
+				}
+
+				struct value v;
+				v.type = VAL_INT;
+				v.integer = arm[i];
+
+				int k = alloc_reg(c);
+				emit_ab(c, INSTR_COPYC, k, constant_table_add(c->ct, v), &e->tok->loc);
+				cond = alloc_reg(c);
+				emit_abc(c, INSTR_CMP, cond, which, k, &e->match[i]->tok->loc);
+				emit_a(c, INSTR_COND, cond, &e->tok->loc);
+			} else if (e->match[i]->type == EXPR_REGEX) {
 				int temp = alloc_reg(c);
 				int re = alloc_reg(c);
-				emit_ab(c, INSTR_COPYC, re, add_constant(c, e->match[i]->val), &e->tok->loc);
+				emit_ab(c, INSTR_COPYC, re, pattern[i], &e->tok->loc);
 				cond = alloc_reg(c);
 
 				emit_a(c, INSTR_GETIMP, temp, &e->tok->loc);
@@ -1022,8 +1813,21 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 				emit_a(c, INSTR_COND, cond, &e->tok->loc);
 			}
 
-			last = c->ip;
-			emit_a(c, INSTR_JMP, cond, &e->tok->loc);
+			if (i >= num_case) {
+				last = c->ip;
+				emit_a(c, INSTR_JMP, cond, &e->tok->loc);
+			}
+
+			body[i] = c->ip;
+
+			/* the arm still gets its groups */
+			if (dispatch >= 0 && arm[i] >= 0) {
+				int temp = alloc_reg(c);
+				int re = alloc_reg(c);
+				emit_ab(c, INSTR_COPYC, re, pattern[i], &e->tok->loc);
+				emit_a(c, INSTR_GETIMP, temp, &e->tok->loc);
+				emit_abc(c, INSTR_MATCH, alloc_reg(c), temp, re, &e->match[i]->tok->loc);
+			}
 
 			if (e->args[i]) {
 				emit_ab(c, INSTR_MOV, reg, compile_expression(c, e->args[i], sym), &e->tok->loc);
@@ -1042,7 +1846,7 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 					        compile_expression(c, it->expr, find_from_scope(sym, it->scope)),
 					        &e->tok->loc);
 				} else {
-					reg = nil(c);
+					emit_ab(c, INSTR_MOV, reg, nil(c), &e->tok->loc);
 				}
 			}
 
@@ -1056,20 +1860,49 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 		if (last >= 0)
 			c->code[last].a = c->ip;
 
+		if (num_case == e->num)
+			miss = c->ip;
+
+		for (int i = 0; i < num_slot; i++)
+			c->code[slot + i].a = target[i] >= 0 ? body[target[i]] : miss;
+
 		emit_(c, INSTR_POPIMP, &e->tok->loc);
 		break;
 	} break;
 
 	case EXPR_FN_CALL: {
+		struct symbol *fn = e->a->type == EXPR_VALUE && e->a->val->type == TOK_IDENTIFIER
+			? resolve(sym, e->a->val->value) : NULL;
+
+		if (c->m->k->optimize && fn && fn->type == SYM_FN) {
+			struct expression *ret = NULL;
+			struct symbol *scope = NULL;
+			const char *why = check_inline(c, fn, e, &ret, &scope);
+
+			if (c->m->k->print_inlining)
+				printf("%s:%zu:%zu: %s `%s'%s%s\n", e->tok->loc.file,
+				       line_number(e->tok->loc), column_number(e->tok->loc),
+				       why ? "not inlining" : "inlining", fn->name,
+				       why ? ": " : "", why ? why : "");
+
+			if (!why) {
+				reg = inline_call(c, fn, e, sym, ret, scope);
+				break;
+			}
+		}
+
 		int arg[e->num];
+		bool fresh[e->num];
 
 		for (int i = e->num - 1; i >= 0; i--) {
 			arg[i] = alloc_reg(c);
-			emit_ab(c, INSTR_MOV, arg[i], compile_expression(c, e->args[i], sym), &e->tok->loc);
+			int val = compile_expression(c, e->args[i], sym);
+			fresh[i] = is_fresh(c, sym, e->args[i], val, true);
+			emit_ab(c, INSTR_MOV, arg[i], val, &e->tok->loc);
 		}
 
 		for (int i = e->num - 1; i >= 0; i--)
-			emit_a(c, INSTR_PUSH, arg[i], &e->tok->loc);
+			emit_a(c, fresh[i] ? INSTR_PUSHF : INSTR_PUSH, arg[i], &e->tok->loc);
 
 		if (e->a->type == EXPR_OPERATOR
 		    && e->a->operator->type == OPTYPE_BINARY
@@ -1093,8 +1926,11 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 
 			int fn = alloc_reg(c);
 			emit_abc(c, INSTR_SUBSCR, fn, table, keyreg, &e->tok->loc);
-			emit_a(c, INSTR_CALL, fn, &e->tok->loc);
-		} else emit_a(c, INSTR_CALL, compile_expression(c, e->a, sym), &e->tok->loc);
+			emit_a(c, tail ? INSTR_TCALL : INSTR_CALL, fn, &e->tok->loc);
+		} else {
+			int fn = compile_expression(c, e->a, sym);
+			emit_a(c, tail ? INSTR_TCALL : INSTR_CALL, fn, &e->tok->loc);
+		}
 
 		emit_a(c, INSTR_POP, reg = alloc_reg(c), &e->tok->loc);
 	} break;
@@ -1140,10 +1976,10 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 
 		emit_abc(c, INSTR_SUBSCR, reg, arr, zero, &e->tok->loc);
 
-		/* Loop condition */
-		int A = c->ip;
+		/* Loop condition; the body can't change the array's length. */
 		int len = alloc_reg(c);
 		emit_ab(c, INSTR_LEN, len, arr, &e->tok->loc);
+		int A = c->ip;
 		int cond = alloc_reg(c);
 		emit_abc(c, INSTR_LESS, cond, idx, len, &e->tok->loc);
 		emit_a(c, INSTR_COND, cond, &e->tok->loc);
@@ -1163,7 +1999,7 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 			           "invalid operator in array mutator");
 
 		int temp = alloc_reg(c);
-		emit_abc(c, INSTR_SUBSCR, temp, arr, idx, &e->tok->loc);
+		emit_abc(c, INSTR_SUBSCRU, temp, arr, idx, &e->tok->loc);
 		emit_abc(c, instr, reg, reg, temp, &e->tok->loc);
 		emit_a(c, INSTR_INC, idx, &e->tok->loc);
 
@@ -1231,12 +2067,10 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 	case EXPR_LIST_COMPREHENSION: {
 		int array = -1;
 		int index = alloc_reg(c);
-
-		if (e->b) {
-			array = compile_expression(c, e->b, sym);
-		} else {
-			array = compile_expression(c, e->s->expr, sym);
-		}
+		struct symbol *outer = sym;
+		struct expression *input = e->b ? e->b : e->s->expr;
+		struct expression *source = pipeline_source(e->a, input);
+		array = compile_expression(c, source, sym);
 
 		reg = alloc_reg(c);
 
@@ -1256,9 +2090,9 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 		int cond = alloc_reg(c);
 		size_t start = c->ip;
 
-		emit_a(c, INSTR_INC, index, &e->tok->loc);
 		int len = alloc_reg(c);
 		emit_ab(c, INSTR_LEN, len, array, &e->tok->loc);
+		emit_a(c, INSTR_INC, index, &e->tok->loc);
 
 		emit_abc(c, INSTR_LESS, cond, index, len, &e->tok->loc);
 		emit_a(c, INSTR_COND, cond, &e->tok->loc);
@@ -1268,7 +2102,7 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 		if (e->s->type == STMT_EXPR && e->b) {
 			assert(e->s->expr->type == EXPR_VALUE);
 			struct symbol *var = resolve(sym, e->s->expr->val->value);
-			emit_abc(c, INSTR_SUBSCR, var->address, array, index, &e->tok->loc);
+			subscript_stages(c, var->address, array, index, input, source, outer);
 		} else if (e->s->type == STMT_VAR_DECL && e->b) {
 			struct statement *s = e->s;
 
@@ -1280,24 +2114,26 @@ compile_expression(struct compiler *c, struct expression *e, struct symbol *sym)
 
 			sym = find_from_scope(sym, s->scope);
 			struct symbol *var = resolve(sym, s->var_decl.names[0]->value);
-			var->address = c->var[c->sp]++;
-			emit_abc(c, INSTR_SUBSCR, var->address, array, index, &e->tok->loc);
+			var->address = alloc_var(c);
+			subscript_stages(c, var->address, array, index, input, source, outer);
 		} else if (e->b) {
 			assert(false);
 		}
 
 		if (!e->b) {
 			int imp = alloc_reg(c);
-			emit_abc(c, INSTR_SUBSCR, imp, array, index, &e->tok->loc);
+			emit_abc(c, INSTR_SUBSCRU, imp, array, index, &e->tok->loc);
+			imp = compile_stages(c, input, source, imp, outer);
 			emit_a(c, INSTR_PUSHIMP, imp, &e->tok->loc);
 		}
 
-		emit_ab(c, INSTR_PUSHBACK, reg,
-		        compile_expression(c, e->a, sym), &e->tok->loc);
+		int thing = compile_expression(c, e->a, sym);
+		bool resized = may_resize(c, a + 1, array);
+		emit_ab(c, INSTR_PUSHBACK, reg, thing, &e->tok->loc);
 
 		if (!e->b) emit_(c, INSTR_POPIMP, &e->tok->loc);
 
-		emit_a(c, INSTR_JMP, start, &e->tok->loc);
+		emit_a(c, INSTR_JMP, resized ? start : start + 1, &e->tok->loc);
 		c->code[a].a = c->ip;
 	} break;
 
@@ -1318,6 +2154,7 @@ static void
 set_stack_top(struct compiler *c)
 {
 	if (c->in_expr) return;
+	end_segment(c);
 	c->stack_top[c->sp] = c->stack_base[c->sp];
 }
 
@@ -1325,9 +2162,16 @@ static int
 compile_expr(struct compiler *c, struct expression *e, struct symbol *sym)
 {
 	set_stack_top(c);
+
+	/*
+	 * Statements can be nested inside expressions, in the arms of
+	 * a match; the registers of the outer expression have to stay
+	 * put until it's done.
+	 */
+	bool in_expr = c->in_expr;
 	c->in_expr = true;
 	int t = compile_expression(c, e, sym);
-	c->in_expr = false;
+	c->in_expr = in_expr;
 
 	return t;
 }
@@ -1375,24 +2219,19 @@ compile_for_loop(struct compiler *c, struct statement *s, struct symbol *sym,
 		int operand = c->var[c->sp]++;
 		int re = c->var[c->sp]++;
 
-		e->b->val->flags = smart_cat(e->b->val->flags, "c");
 		emit_ab(c, INSTR_MOV, operand, compile_expr(c, e->a, sym), &s->tok->loc);
 		set_stack_top(c);
 		emit_ab(c, INSTR_COPYC, re, add_constant(c, e->b->val), &e->tok->loc);
 		emit_a(c, INSTR_RESETR, re, &s->tok->loc);
 
 		start = c->ip;
-		emit_abc(c, INSTR_MATCH, expr, operand, re, &e->b->tok->loc);
+		int temp = alloc_reg(c);
+		emit_abcd(c, INSTR_NEXTM, expr, temp, operand, re, &e->b->tok->loc);
 
 		emit_a(c, INSTR_COND, expr, &s->tok->loc);
 		size_t a = c->ip;
 		emit_a(c, INSTR_JMP, -1, &s->tok->loc);
 
-		int zero = alloc_reg(c);
-		emit_ab(c, INSTR_COPYC, zero, constant_table_add(c->ct, INT(0)), &s->tok->loc);
-		int temp = alloc_reg(c);
-		emit_abc(c, INSTR_SUBSCR, temp, expr, zero, &s->tok->loc);
-
 		emit_ab(c, INSTR_MOV, reg, temp, &s->tok->loc);
 		compile_statement(c, s->for_loop.body);
 
@@ -1425,24 +2264,19 @@ compile_for_loop(struct compiler *c, struct statement *s, struct symbol *sym,
 		int operand = c->var[c->sp]++;
 		int re = c->var[c->sp]++;
 
-		e->val->flags = smart_cat(e->val->flags, "c");
 		set_stack_top(c);
 		emit_ab(c, INSTR_COPYC, re, add_constant(c, e->val), &e->tok->loc);
 		emit_a(c, INSTR_RESETR, re, &s->tok->loc);
 
 		emit_a(c, INSTR_GETIMP, operand, &e->tok->loc);
 		start = c->ip;
-		emit_abc(c, INSTR_MATCH, expr, operand, re, &e->tok->loc);
+		int temp = alloc_reg(c);
+		emit_abcd(c, INSTR_NEXTM, expr, temp, operand, re, &e->tok->loc);
 
 		emit_a(c, INSTR_COND, expr, &s->tok->loc);
 		size_t a = c->ip;
 		emit_a(c, INSTR_JMP, -1, &s->tok->loc);
 
-		int zero = alloc_reg(c);
-		emit_ab(c, INSTR_COPYC, zero, constant_table_add(c->ct, INT(0)), &s->tok->loc);
-		int temp = alloc_reg(c);
-		emit_abc(c, INSTR_SUBSCR, temp, expr, zero, &s->tok->loc);
-
 		emit_ab(c, INSTR_MOV, reg, temp, &s->tok->loc);
 		compile_statement(c, s->for_loop.body);
 
@@ -1496,20 +2330,21 @@ compile_for_loop(struct compiler *c, struct statement *s, struct symbol *sym,
 		emit_ab(c, INSTR_MOV, expr, compile_expr(c, s->for_loop.b, sym), &s->tok->loc);
 		emit_ab(c, INSTR_COPYC, iter, constant_table_add(c->ct, v), &s->tok->loc);
 		start = c->ip;
-		emit_a(c, INSTR_INC, iter, &s->tok->loc);
-		int len = alloc_reg(c);
+		int len = c->var[c->sp]++;
 		emit_ab(c, INSTR_LEN, len, expr, &s->tok->loc);
+		emit_a(c, INSTR_INC, iter, &s->tok->loc);
 		int cond = alloc_reg(c);
 		emit_abc(c, INSTR_LESS, cond, iter, len, &s->tok->loc);
 		emit_a(c, INSTR_COND, cond, &s->tok->loc);
 		size_t a = c->ip;
 		emit_a(c, INSTR_JMP, -1, &s->tok->loc);
-		emit_abc(c, INSTR_SUBSCR, reg, expr, iter, &s->tok->loc);
+		emit_abc(c, INSTR_SUBSCRU, reg, expr, iter, &s->tok->loc);
 
 		compile_statement(c, s->for_loop.body);
-		emit_a(c, INSTR_JMP, start, &s->tok->loc);
+		size_t loop = may_resize(c, a + 1, expr) ? start : start + 1;
+		emit_a(c, INSTR_JMP, loop, &s->tok->loc);
 
-		set_next(sym, start);
+		set_next(sym, loop);
 		c->code[a].a = c->ip;
 	} else if (s->for_loop.a && !s->for_loop.b && !s->for_loop.c
 	           && s->for_loop.a->type == STMT_EXPR
@@ -1523,24 +2358,19 @@ compile_for_loop(struct compiler *c, struct statement *s, struct symbol *sym,
 		int operand = c->var[c->sp]++;
 		int re = c->var[c->sp]++;
 
-		e->b->val->flags = smart_cat(e->b->val->flags, "c");
 		emit_ab(c, INSTR_MOV, operand, compile_expr(c, e->a, sym), &s->tok->loc);
 		set_stack_top(c);
 		emit_ab(c, INSTR_COPYC, re, add_constant(c, e->b->val), &e->tok->loc);
 		emit_a(c, INSTR_RESETR, re, &s->tok->loc);
 
 		start = c->ip;
-		emit_abc(c, INSTR_MATCH, expr, operand, re, &e->b->tok->loc);
+		int temp = alloc_reg(c);
+		emit_abcd(c, INSTR_NEXTM, expr, temp, operand, re, &e->b->tok->loc);
 
 		emit_a(c, INSTR_COND, expr, &s->tok->loc);
 		size_t a = c->ip;
 		emit_a(c, INSTR_JMP, -1, &s->tok->loc);
 
-		int zero = alloc_reg(c);
-		emit_ab(c, INSTR_COPYC, zero, constant_table_add(c->ct, INT(0)), &s->tok->loc);
-		int temp = alloc_reg(c);
-		emit_abc(c, INSTR_SUBSCR, temp, expr, zero, &s->tok->loc);
-
 		emit_a(c, INSTR_PUSHIMP, temp, &s->tok->loc);
 		compile_statement(c, s->for_loop.body);
 		emit_(c, INSTR_POPIMP, &s->tok->loc);
@@ -1557,26 +2387,20 @@ compile_for_loop(struct compiler *c, struct statement *s, struct symbol *sym,
 	           && s->for_loop.a->expr->type == EXPR_REGEX) {
 		int expr = c->var[c->sp]++;
 		int re = c->var[c->sp]++;
-		s->for_loop.a->expr->val->flags = smart_cat(s->for_loop.a->expr->val->flags, "c");
 
 		set_stack_top(c);
 		emit_ab(c, INSTR_COPYC, re, add_constant(c, s->for_loop.a->expr->val), &s->tok->loc);
 		emit_a(c, INSTR_RESETR, re, &s->tok->loc);
 
 		start = c->ip;
-		emit_abc(c, INSTR_MATCH, expr,
-		         compile_expression(c, NULL, sym),
-		         re, &s->tok->loc);
+		int operand = compile_expression(c, NULL, sym);
+		int temp = alloc_reg(c);
+		emit_abcd(c, INSTR_NEXTM, expr, temp, operand, re, &s->tok->loc);
 
 		emit_a(c, INSTR_COND, expr, &s->tok->loc);
 		size_t a = c->ip;
 		emit_a(c, INSTR_JMP, -1, &s->tok->loc);
 
-		int zero = alloc_reg(c);
-		emit_ab(c, INSTR_COPYC, zero, constant_table_add(c->ct, INT(0)), &s->tok->loc);
-		int temp = alloc_reg(c);
-		emit_abc(c, INSTR_SUBSCR, temp, expr, zero, &s->tok->loc);
-
 		emit_a(c, INSTR_PUSHIMP, temp, &s->tok->loc);
 		compile_statement(c, s->for_loop.body);
 		emit_(c, INSTR_POPIMP, &s->tok->loc);
@@ -1602,27 +2426,28 @@ compile_for_loop(struct compiler *c, struct statement *s, struct symbol *sym,
 		emit_ab(c, INSTR_COPYC, iter, constant_table_add(c->ct, INT(-1)), &s->tok->loc);
 
 		start = c->ip;
-		emit_a(c, INSTR_INC, iter, &s->tok->loc);
-		int len = alloc_reg(c);
+		int len = c->var[c->sp]++;
 		emit_ab(c, INSTR_LEN, len, expr, &s->tok->loc);
+		emit_a(c, INSTR_INC, iter, &s->tok->loc);
 		int cond = alloc_reg(c);
 		emit_abc(c, INSTR_LESS, cond, iter, len, &s->tok->loc);
 		emit_a(c, INSTR_COND, cond, &s->tok->loc);
 		size_t a = c->ip;
 		emit_a(c, INSTR_JMP, -1, &s->tok->loc);
 		int temp = alloc_reg(c);
-		emit_abc(c, INSTR_SUBSCR, temp, expr, iter, &s->tok->loc);
+		emit_abc(c, INSTR_SUBSCRU, temp, expr, iter, &s->tok->loc);
 
 		emit_a(c, INSTR_PUSHIMP, temp, &s->tok->loc);
 		compile_statement(c, s->for_loop.body);
 		emit_(c, INSTR_POPIMP, &s->tok->loc);
 
-		emit_a(c, INSTR_JMP, start, &s->tok->loc);
+		size_t loop = may_resize(c, a + 1, expr) ? start : start + 1;
+		emit_a(c, INSTR_JMP, loop, &s->tok->loc);
 		int e = c->ip;
-		emit_a(c, INSTR_JMP, start, &s->tok->loc);
+		emit_a(c, INSTR_JMP, loop, &s->tok->loc);
 		emit_(c, INSTR_POPIMP, &s->tok->loc);
 
-		set_next(sym, start);
+		set_next(sym, loop);
 		c->code[a].a = c->ip;
 		c->code[e].a = c->ip;
 	}
@@ -1683,15 +2508,14 @@ compile_statement(struct compiler *c, struct statement *s)
 	case STMT_VAR_DECL:
 		for (size_t i = 0; i < s->var_decl.num; i++) {
 			struct symbol *var_sym = resolve(sym, s->var_decl.names[i]->value);
-			var_sym->address = c->var[c->sp]++;
+			var_sym->address = alloc_var(c);
 			if (var_sym->global) var_sym->address += NUM_REG;
-			int reg = -1;
-
-			reg = s->var_decl.init
-				? compile_expr(c, s->var_decl.init[i], sym)
-				: nil(c);
+			struct expression *init = s->var_decl.init ? s->var_decl.init[i] : NULL;
+			int reg = init ? compile_expr(c, init, sym) : nil(c);
 
-			emit_ab(c, INSTR_COPY, var_sym->address, reg, &s->tok->loc);
+			emit_ab(c, !init || is_fresh(c, sym, init, reg, false)
+			        ? INSTR_MOV : INSTR_COPY,
+			        var_sym->address, reg, &s->tok->loc);
 		}
 		break;
 
@@ -1701,6 +2525,7 @@ compile_statement(struct compiler *c, struct statement *s)
 		push_frame(c);
 		sym->address = c->ip;
 		ret = c->ip;
+		emit_a(c, INSTR_FRAME, -1, &s->tok->loc);
 
 		for (size_t i = 0; i < s->fn_def.num; i++) {
 			struct symbol *arg_sym = resolve(sym, s->fn_def.args[i]->value);
@@ -1723,9 +2548,10 @@ compile_statement(struct compiler *c, struct statement *s)
 
 		emit_(c, INSTR_CHKSTCK, &s->tok->loc);
 		compile_statement(c, s->fn_def.body);
-		pop_frame(c);
 		emit_a(c, INSTR_PUSH, nil(c), &s->tok->loc);
 		emit_(c, INSTR_RET, &s->tok->loc);
+		c->code[ret].a = finish_frame(c, ret, c->var[c->sp]);
+		pop_frame(c);
 		c->code[a].a = c->ip;
 	} break;
 
@@ -1750,7 +2576,10 @@ compile_statement(struct compiler *c, struct statement *s)
 		for (int i = 0; i < count_imp(find_from_scope(sym, c->loop->scope), sym); i++)
 			emit_(c, INSTR_POPIMP, &s->tok->loc);
 
-		emit_a(c, INSTR_PUSH, compile_expr(c, s->ret.expr, sym), &s->tok->loc);
+		c->tail = s->ret.expr && s->ret.expr->type == EXPR_FN_CALL;
+		int val = compile_expr(c, s->ret.expr, sym);
+		emit_a(c, s->ret.expr && is_fresh(c, sym, s->ret.expr, val, true)
+		       ? INSTR_PUSHF : INSTR_PUSH, val, &s->tok->loc);
 		emit_(c, INSTR_RET, &s->tok->loc);
 		break;
 
@@ -1955,10 +2784,12 @@ compile(struct module *m, struct constant_table *ct, struct symbol *sym,
 	else c->ct = new_constant_table();
 
 	push_frame(c);
+	int base = 0;
+
 	if (stack_base >= 0) {
 		c->var[c->sp] = stack_base;
 		struct symbol *s = find_from_scope(sym, m->tree[0]->scope);
-		c->stack_base[c->sp] = stack_base + s->num_variables;
+		base = stack_base + s->num_variables;
 	}
 
 	for (size_t i = 0; i < c->num_nodes; i++) {
@@ -1976,6 +2807,14 @@ compile(struct module *m, struct constant_table *ct, struct symbol *sym,
 	}
 
 	emit_a(c, INSTR_END, nil(c), &c->stmt->tok->loc);
+	finish_frame(c, 0, c->var[c->sp] > base ? c->var[c->sp] : base);
+
+	/*
+	 * An eval'd module shares its frame with code that has already
+	 * been optimized, so it's left as it is.
+	 */
+	if (m->k->optimize && !c->eval && !c->r->fatal && !c->np && !c->lp)
+		optimize(c);
 
 	m->code = c->code;
 	m->num_instr = c->ip;
@@ -19,6 +19,7 @@ oak_new()
 	oak *k = oak_malloc(sizeof *k);
 	memset(k, 0, sizeof *k);
 	k->talkative = true;
+	k->recache = new_recache();
 	return k;
 }
 
@@ -29,6 +30,7 @@ oak_free(oak *k)
 		free_module(k->modules[i]);
 
 	if (k->stack) free(k->stack);
+	free_recache(k->recache);
 	free(k->modules);
 	free(k);
 }
@@ -0,0 +1,907 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "constant.h"
+#include "optimize.h"
+#include "operator.h"
+#include "symbol.h"
+#include "util.h"
+
+/*
+ * The optimizer works on the finished register code of a module. The
+ * code is split into the frames of the module and its functions, and
+ * each frame into basic blocks. Within a block it remembers what it
+ * knows about registers (that one is a copy of another, holds a known
+ * scalar constant, or holds the length of another) and uses that to
+ * rewrite operands, fold arithmetic and reuse lengths. Then it throws
+ * away code nothing can reach, stores that are never read and jumps
+ * that lead straight to other jumps, switches arithmetic on registers
+ * that always hold integers to typed instructions, lets reads of
+ * registers that are certainly initialized skip their checks, and
+ * closes up the holes.
+ */
+
+#define MAX_FACTS 256
+#define LIVE_WORDS (NUM_REG / 64)
+
+#define TEST(S,X) ((S)[(X) / 64] & (UINT64_C(1) << ((X) % 64)))
+#define SET(S,X) ((S)[(X) / 64] |= UINT64_C(1) << ((X) % 64))
+#define CLEAR(S,X) ((S)[(X) / 64] &= ~(UINT64_C(1) << ((X) % 64)))
+
+struct fact {
+	enum {
+		FACT_COPY,   /* reg holds the same value as src */
+		FACT_CONST,  /* reg holds constant number src */
+		FACT_LENGTH  /* reg holds the length of src */
+	} type;
+
+	int reg, src;
+};
+
+struct optimizer {
+	struct compiler *c;
+	struct instruction *code;
+	size_t n;
+
+	int *frame;
+	bool *root, *leader;
+
+	struct fact fact[MAX_FACTS];
+	int nfact;
+};
+
+static void *
+zalloc(size_t size)
+{
+	void *p = oak_malloc(size ? size : 1);
+	memset(p, 0, size ? size : 1);
+	return p;
+}
+
+/*
+ * Works out which frame each instruction belongs to. A function body
+ * starts with FRAME and is jumped over by the instruction before it.
+ */
+static void
+find_frames(struct optimizer *o)
+{
+	size_t *end = oak_malloc((o->n + 1) * sizeof *end);
+	int *stack = oak_malloc((o->n + 1) * sizeof *stack);
+	int sp = 0, nf = 1;
+
+	stack[0] = 0;
+	end[0] = o->n;
+	o->root[0] = true;
+
+	for (size_t i = 0; i < o->n; i++) {
+		while (sp && i >= end[sp]) sp--;
+
+		if (o->code[i].type == INSTR_FRAME) {
+			sp++;
+			stack[sp] = nf++;
+			end[sp] = i && o->code[i - 1].type == INSTR_JMP
+				? o->code[i - 1].a : o->n;
+			o->root[i] = true;
+		}
+
+		o->frame[i] = stack[sp];
+	}
+
+	free(end);
+	free(stack);
+}
+
+/* Code that an eval can escape to has to be kept and left alone. */
+static void
+find_escapes(struct optimizer *o, struct symbol *s)
+{
+	if (s->module == o->c->m) {
+		if (s->next >= 0 && (size_t)s->next < o->n) o->root[s->next] = true;
+		if (s->last >= 0 && (size_t)s->last < o->n) o->root[s->last] = true;
+	}
+
+	if (s->type == SYM_IMPORTED) return;
+
+	for (size_t i = 0; i < s->num_children; i++)
+		find_escapes(o, s->children[i]);
+}
+
+static void
+find_leaders(struct optimizer *o)
+{
+	size_t succ[MAX_SUCC];
+
+	for (size_t i = 0; i < o->n; i++) {
+		if (o->root[i]) o->leader[i] = true;
+
+		int num = instruction_successors(o->code[i], i, succ);
+		if (num == 1 && succ[0] == i + 1) continue;
+		o->leader[i + 1] = true;
+
+		for (int j = 0; j < num; j++)
+			if (succ[j] < o->n) o->leader[succ[j]] = true;
+	}
+}
+
+static bool
+is_scalar(struct value v)
+{
+	return v.type == VAL_INT || v.type == VAL_FLOAT
+		|| v.type == VAL_BOOL || v.type == VAL_NIL;
+}
+
+static struct fact *
+find_fact(struct optimizer *o, int type, int reg)
+{
+	for (int i = 0; i < o->nfact; i++)
+		if ((int)o->fact[i].type == type && o->fact[i].reg == reg)
+			return o->fact + i;
+
+	return NULL;
+}
+
+static struct fact *
+find_length(struct optimizer *o, int src)
+{
+	for (int i = 0; i < o->nfact; i++)
+		if (o->fact[i].type == FACT_LENGTH && o->fact[i].src == src)
+			return o->fact + i;
+
+	return NULL;
+}
+
+static void
+add_fact(struct optimizer *o, int type, int reg, int src)
+{
+	if (o->nfact == MAX_FACTS) return;
+	o->fact[o->nfact++] = (struct fact){ type, reg, src };
+}
+
+/* Forgets everything that depended on the old value of `r'. */
+static void
+kill_reg(struct optimizer *o, int r)
+{
+	for (int i = 0; i < o->nfact; i++) {
+		struct fact *f = o->fact + i;
+		if (f->reg == r || (f->type != FACT_CONST && f->src == r))
+			o->fact[i--] = o->fact[--o->nfact];
+	}
+}
+
+/* Forgets lengths, and optionally anything to do with a global. */
+static void
+kill_memory(struct optimizer *o, bool globals)
+{
+	for (int i = 0; i < o->nfact; i++) {
+		struct fact *f = o->fact + i;
+		if (f->type == FACT_LENGTH
+		    || (globals && (f->reg >= NUM_REG
+		                    || (f->type == FACT_COPY && f->src >= NUM_REG))))
+			o->fact[i--] = o->fact[--o->nfact];
+	}
+}
+
+/* Instructions that can't change the contents of any array or string. */
+static bool
+is_pure(enum instruction_type type)
+{
+	switch (type) {
+	case INSTR_NOP: case INSTR_MOV: case INSTR_COPY: case INSTR_COPYC:
+	case INSTR_MOVC: case INSTR_ARG: case INSTR_LEN: case INSTR_TYPE:
+	case INSTR_COND: case INSTR_NCOND: case INSTR_CMP: case INSTR_LESS:
+	case INSTR_LEQ: case INSTR_GEQ: case INSTR_MORE: case INSTR_ADD:
+	case INSTR_SUB: case INSTR_MUL: case INSTR_DIV: case INSTR_MOD:
+	case INSTR_NEG: case INSTR_JMP: case INSTR_PRINT: case INSTR_LINE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Instructions that read all of their operands before writing `a'. */
+static bool
+writes_last(enum instruction_type type)
+{
+	switch (type) {
+	case INSTR_MOV: case INSTR_COPY: case INSTR_COPYC: case INSTR_MOVC:
+	case INSTR_ARG: case INSTR_LEN: case INSTR_CMP: case INSTR_LESS:
+	case INSTR_LEQ: case INSTR_GEQ: case INSTR_MORE: case INSTR_ADD:
+	case INSTR_SUB: case INSTR_MUL: case INSTR_DIV: case INSTR_MOD:
+	case INSTR_NEG:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Instructions that can read or write any variable of the frame. */
+static bool
+is_barrier(enum instruction_type type)
+{
+	return type == INSTR_EVAL || type == INSTR_INTERP || type == INSTR_SUBST;
+}
+
+static bool
+defines(struct instruction *c, int def, int r)
+{
+	for (int f = FIELD_A; f <= FIELD_E; f <<= 1)
+		if (def & f && *instruction_field(c, f) == r)
+			return true;
+
+	return false;
+}
+
+/*
+ * Returns the index of a constant holding the result of `c' if both
+ * of its operands are known scalars, and -1 otherwise.
+ */
+static int
+fold(struct optimizer *o, struct instruction *c)
+{
+	int op;
+
+	switch (c->type) {
+	case INSTR_ADD:  op = OP_ADD;  break;
+	case INSTR_SUB:  op = OP_SUB;  break;
+	case INSTR_MUL:  op = OP_MUL;  break;
+	case INSTR_DIV:  op = OP_DIV;  break;
+	case INSTR_MOD:  op = OP_MOD;  break;
+	case INSTR_CMP:  op = OP_CMP;  break;
+	case INSTR_LESS: op = OP_LESS; break;
+	case INSTR_LEQ:  op = OP_LEQ;  break;
+	case INSTR_GEQ:  op = OP_GEQ;  break;
+	case INSTR_MORE: op = OP_MORE; break;
+	default: return -1;
+	}
+
+	struct fact *l = find_fact(o, FACT_CONST, c->b);
+	struct fact *r = find_fact(o, FACT_CONST, c->c);
+	if (!l || !r) return -1;
+
+	struct value a = o->c->ct->val[l->src], b = o->c->ct->val[r->src];
+
+	/* Leave the errors and traps to run time. */
+	if ((op == OP_DIV || op == OP_MOD) && b.type == VAL_INT
+	    && (b.integer == 0 || b.integer == -1))
+		return -1;
+
+	struct value v = val_binop(o->c->gc, a, b, op);
+
+	if (v.type == VAL_ERR) {
+		free(v.err);
+		return -1;
+	}
+
+	if (!is_scalar(v)) return -1;
+	return constant_table_add(o->c->ct, v);
+}
+
+/* Rewrites each basic block using what is known about its registers. */
+static void
+propagate(struct optimizer *o)
+{
+	for (size_t i = 0; i < o->n; i++) {
+		struct instruction *c = o->code + i;
+		int use, def;
+
+		if (o->leader[i]) o->nfact = 0;
+		instruction_operands(*c, &use, &def);
+
+		for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+			if (!(use & f) || def & f) continue;
+			if (f == FIELD_A && (c->type == INSTR_PUSHBACK
+			                     || c->type == INSTR_APUSH
+			                     || c->type == INSTR_INS))
+				continue;
+
+			uint16_t *r = instruction_field(c, f);
+			struct fact *k = find_fact(o, FACT_COPY, *r);
+			if (k && (writes_last(c->type) || !defines(c, def, k->src)))
+				*r = k->src;
+		}
+
+		int k = fold(o, c);
+		if (k >= 0) *c = (struct instruction){ .type = INSTR_COPYC, .loc = c->loc, .a = c->a, .b = k };
+
+		if (c->type == INSTR_COND || c->type == INSTR_NCOND) {
+			struct fact *f = find_fact(o, FACT_CONST, c->a);
+
+			if (f) {
+				bool skip = is_truthy(o->c->gc, o->c->ct->val[f->src])
+					== (c->type == INSTR_COND);
+				*c = (struct instruction){ .type = skip ? INSTR_JMP : INSTR_NOP,
+					.loc = c->loc, .a = skip ? i + 2 : 0 };
+			}
+		}
+
+		if (c->type == INSTR_LEN) {
+			struct fact *f = find_length(o, c->b);
+			if (f) *c = (struct instruction){ .type = INSTR_MOV, .loc = c->loc, .a = c->a, .b = f->reg };
+		}
+
+		if (c->type == INSTR_MOV && c->a == c->b)
+			c->type = INSTR_NOP;
+
+		/* Work out the new facts before the old ones are killed. */
+		struct fact *src = NULL;
+		int known = -1;
+
+		switch (c->type) {
+		case INSTR_MOV:
+		case INSTR_COPY:
+			src = find_fact(o, FACT_CONST, c->b);
+			if (src) known = src->src;
+			break;
+
+		case INSTR_COPYC:
+		case INSTR_MOVC:
+			if (is_scalar(o->c->ct->val[c->b])) known = c->b;
+			break;
+
+		default: break;
+		}
+
+		instruction_operands(*c, &use, &def);
+
+		for (int f = FIELD_A; f <= FIELD_E; f <<= 1)
+			if (def & f) kill_reg(o, *instruction_field(c, f));
+
+		if (is_barrier(c->type)) o->nfact = 0;
+		else if (c->type == INSTR_CALL || c->type == INSTR_TCALL)
+			kill_memory(o, true);
+		else if (!is_pure(c->type)) kill_memory(o, false);
+
+		if (known >= 0) add_fact(o, FACT_CONST, c->a, known);
+		if (c->type == INSTR_MOV) add_fact(o, FACT_COPY, c->a, c->b);
+		if (c->type == INSTR_LEN && c->a != c->b)
+			add_fact(o, FACT_LENGTH, c->a, c->b);
+	}
+}
+
+/* Turns everything that can't be reached in its frame into NOPs. */
+static void
+remove_unreachable(struct optimizer *o)
+{
+	bool *seen = zalloc(o->n * sizeof *seen);
+	size_t succ[MAX_SUCC], sp = 0, size = 1;
+
+	for (size_t i = 0; i < o->n; i++)
+		size += 1 + instruction_successors(o->code[i], i, succ);
+
+	size_t *stack = oak_malloc(size * sizeof *stack);
+
+	for (size_t i = 0; i < o->n; i++)
+		if (o->root[i]) stack[sp++] = i;
+
+	while (sp) {
+		size_t i = stack[--sp];
+		if (seen[i]) continue;
+		seen[i] = true;
+
+		int num = instruction_successors(o->code[i], i, succ);
+		for (int j = 0; j < num; j++)
+			if (succ[j] < o->n && o->frame[succ[j]] == o->frame[i]
+			    && !seen[succ[j]])
+				stack[sp++] = succ[j];
+	}
+
+	for (size_t i = 0; i < o->n; i++) {
+		/* The jump over a function body marks where it ends. */
+		if (i + 1 < o->n && o->code[i + 1].type == INSTR_FRAME) continue;
+		if (!seen[i]) o->code[i].type = INSTR_NOP;
+	}
+
+	free(seen);
+	free(stack);
+}
+
+/*
+ * Registers whose value might be read later. POP and NEXTM don't
+ * always write their result, so they don't end anything's life.
+ */
+static void
+transfer(struct optimizer *o, size_t i, uint64_t *live)
+{
+	struct instruction *c = o->code + i;
+	int use, def;
+
+	if (is_barrier(c->type)) {
+		memset(live, 0xff, LIVE_WORDS * sizeof *live);
+		return;
+	}
+
+	instruction_operands(*c, &use, &def);
+	if (c->type == INSTR_POP) def = 0;
+	if (c->type == INSTR_NEXTM) def &= ~FIELD_B;
+
+	for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+		int r = *instruction_field(c, f);
+		if (def & f && r < NUM_REG) CLEAR(live, r);
+	}
+
+	for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+		int r = *instruction_field(c, f);
+		if (use & f && r < NUM_REG) SET(live, r);
+	}
+}
+
+/* Whether `c' reads or writes `r'. */
+static bool
+touches(struct instruction *c, int r)
+{
+	int use, def;
+	if (is_barrier(c->type)) return true;
+	instruction_operands(*c, &use, &def);
+	return defines(c, use | def, r);
+}
+
+/* Whether `r' might be read after `i' runs, given the live-in sets. */
+static bool
+live_after(struct optimizer *o, uint64_t *in, size_t i, int r)
+{
+	size_t succ[MAX_SUCC];
+	int num = instruction_successors(o->code[i], i, succ);
+
+	for (int j = 0; j < num; j++)
+		if (succ[j] < o->n && o->frame[succ[j]] == o->frame[i]
+		    && TEST(in + succ[j] * LIVE_WORDS, r))
+			return true;
+
+	return false;
+}
+
+#define IN_SET(S,R) ((R) < NUM_REG && TEST((S), (R)))
+
+/*
+ * Finds, for each instruction, the locals `transfer' says something
+ * about along every path that reaches it within its frame. Anything
+ * goes until shown otherwise, except where a frame is entered. Loops
+ * can only be escaped into by an eval, so their heads and exits count
+ * as entries only in frames that have one.
+ */
+static uint64_t *
+solve_forward(struct optimizer *o, void (*transfer)(struct optimizer *, size_t, uint64_t *))
+{
+	uint64_t *in = oak_malloc(o->n * LIVE_WORDS * sizeof *in);
+	uint64_t out[LIVE_WORDS];
+	size_t succ[MAX_SUCC];
+
+	bool *eval = zalloc((o->n + 1) * sizeof *eval);
+	for (size_t i = 0; i < o->n; i++)
+		if (o->code[i].type == INSTR_EVAL) eval[o->frame[i]] = true;
+
+	memset(in, 0xff, o->n * LIVE_WORDS * sizeof *in);
+	for (size_t i = 0; i < o->n; i++)
+		if (o->root[i] && (!i || o->code[i].type == INSTR_FRAME || eval[o->frame[i]]))
+			memset(in + i * LIVE_WORDS, 0, LIVE_WORDS * sizeof *in);
+
+	for (bool changed = true; changed;) {
+		changed = false;
+
+		for (size_t i = 0; i < o->n; i++) {
+			memcpy(out, in + i * LIVE_WORDS, sizeof out);
+			transfer(o, i, out);
+			int num = instruction_successors(o->code[i], i, succ);
+
+			for (int j = 0; j < num; j++) {
+				if (succ[j] >= o->n || o->frame[succ[j]] != o->frame[i]) continue;
+				uint64_t *s = in + succ[j] * LIVE_WORDS;
+
+				for (int k = 0; k < LIVE_WORDS; k++) {
+					if ((s[k] & out[k]) == s[k]) continue;
+					s[k] &= out[k];
+					changed = true;
+				}
+			}
+		}
+	}
+
+	free(eval);
+	return in;
+}
+
+/*
+ * Whether `c' reads every register it uses through the checks for
+ * uninitialized objects (or only runs on registers already known to
+ * hold integers) and always writes `a' if it writes anything. Once
+ * one of these has run, its operands are known to be set.
+ */
+static bool
+checks_operands(enum instruction_type type)
+{
+	switch (type) {
+	case INSTR_MOV: case INSTR_COPY: case INSTR_COPYC: case INSTR_MOVC:
+	case INSTR_ARG: case INSTR_PUSH: case INSTR_PUSHF: case INSTR_COND:
+	case INSTR_NCOND: case INSTR_NEG: case INSTR_FLIP: case INSTR_LEN:
+	case INSTR_ADD: case INSTR_SUB: case INSTR_MUL: case INSTR_POW:
+	case INSTR_DIV: case INSTR_MOD: case INSTR_CMP: case INSTR_LESS:
+	case INSTR_LEQ: case INSTR_GEQ: case INSTR_MORE: case INSTR_BAND:
+	case INSTR_XOR: case INSTR_BOR: case INSTR_SLEFT: case INSTR_SRIGHT:
+	case INSTR_INC: case INSTR_DEC: case INSTR_ADD_II: case INSTR_SUB_II:
+	case INSTR_MUL_II: case INSTR_CMP_II: case INSTR_LESS_II:
+	case INSTR_LEQ_II: case INSTR_GEQ_II: case INSTR_MORE_II:
+	case INSTR_INC_I: case INSTR_DEC_I:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/* The locals that are certainly initialized once `i' has run. */
+static void
+init_transfer(struct optimizer *o, size_t i, uint64_t *init)
+{
+	struct instruction *c = o->code + i;
+	int use, def;
+
+	if (!checks_operands(c->type)) return;
+	instruction_operands(*c, &use, &def);
+
+	for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+		int r = *instruction_field(c, f);
+		if ((use | def) & f && r < NUM_REG) SET(init, r);
+	}
+}
+
+/*
+ * Removes stores to registers that are never read again, and has an
+ * instruction whose result is only moved somewhere else write it
+ * there directly. A move out of a register that might not be set is
+ * kept even when its result is dead: it's where reading the register
+ * reports the error, and propagate() may have left only a later
+ * instruction reading it.
+ */
+static void
+remove_dead_stores(struct optimizer *o)
+{
+	uint64_t *in = oak_malloc(o->n * LIVE_WORDS * sizeof *in);
+	uint64_t *init = solve_forward(o, init_transfer);
+	uint64_t out[LIVE_WORDS];
+	size_t succ[MAX_SUCC];
+
+	for (bool removed = true; removed;) {
+		removed = false;
+		memset(in, 0, o->n * LIVE_WORDS * sizeof *in);
+
+		for (bool changed = true; changed;) {
+			changed = false;
+
+			for (size_t i = o->n; i-- > 0;) {
+				memset(out, 0, sizeof out);
+				int num = instruction_successors(o->code[i], i, succ);
+
+				for (int j = 0; j < num; j++) {
+					if (succ[j] >= o->n || o->frame[succ[j]] != o->frame[i]) continue;
+					for (int k = 0; k < LIVE_WORDS; k++)
+						out[k] |= in[succ[j] * LIVE_WORDS + k];
+				}
+
+				transfer(o, i, out);
+
+				if (memcmp(out, in + i * LIVE_WORDS, sizeof out)) {
+					memcpy(in + i * LIVE_WORDS, out, sizeof out);
+					changed = true;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < o->n; i++) {
+			struct instruction *c = o->code + i;
+
+			if (c->type != INSTR_MOV && c->type != INSTR_COPY
+			    && c->type != INSTR_COPYC && c->type != INSTR_MOVC
+			    && c->type != INSTR_ARG)
+				continue;
+
+			if ((c->type == INSTR_MOV || c->type == INSTR_COPY || c->type == INSTR_ARG)
+			    && !IN_SET(init + i * LIVE_WORDS, c->b))
+				continue;
+
+			if (c->a < NUM_REG && !live_after(o, in, i, c->a)) {
+				c->type = INSTR_NOP;
+				removed = true;
+			}
+		}
+
+		if (removed) continue;
+
+		for (size_t i = 0; i < o->n; i++) {
+			struct instruction *c = o->code + i;
+			if (!writes_last(c->type) || c->a >= NUM_REG) continue;
+
+			/* Find where the result is first looked at. */
+			size_t j = i + 1;
+			while (j < o->n && !o->leader[j] && !touches(o->code + j, c->a)) j++;
+			if (j == o->n || o->leader[j]) continue;
+
+			/*
+			 * An ARG only copies what it's given, so it can be
+			 * skipped when nothing else has seen the value yet.
+			 */
+			struct instruction *m = o->code + j;
+			bool fresh = c->type != INSTR_MOV && c->type != INSTR_MOVC;
+			if (m->type != INSTR_MOV && (m->type != INSTR_ARG || !fresh)) continue;
+			if (m->b != c->a) continue;
+
+			if (m->a == c->a) {
+				m->type = INSTR_NOP;
+				removed = true;
+				continue;
+			}
+
+			if (live_after(o, in, j, c->a)) continue;
+
+			size_t k = i + 1;
+			while (k < j && !touches(o->code + k, m->a)
+			       && o->code[k].type != INSTR_CALL
+			       && o->code[k].type != INSTR_TCALL) k++;
+			if (k < j) continue;
+
+			c->a = m->a;
+			m->type = INSTR_NOP;
+			removed = true;
+		}
+	}
+
+	free(in);
+	free(init);
+}
+
+/* The first instruction at or after `t' in the frame that does anything. */
+static size_t
+skip_nops(struct optimizer *o, size_t t, int frame)
+{
+	while (t < o->n && o->code[t].type == INSTR_NOP && o->frame[t] == frame)
+		t++;
+	return t;
+}
+
+/*
+ * Points jumps at the end of any chain of jumps they start, and drops
+ * the ones that only go to the next instruction.
+ */
+static void
+thread_jumps(struct optimizer *o)
+{
+	for (size_t i = 0; i < o->n; i++) {
+		struct instruction *c = o->code + i;
+		if (c->type != INSTR_JMP) continue;
+		if (i + 1 < o->n && o->code[i + 1].type == INSTR_FRAME) continue;
+
+		size_t t = skip_nops(o, c->a, o->frame[i]);
+
+		for (int hops = 0; hops < 16; hops++) {
+			if (t >= o->n || o->code[t].type != INSTR_JMP || t == i) break;
+			if (t + 1 < o->n && o->code[t + 1].type == INSTR_FRAME) break;
+			t = skip_nops(o, o->code[t].a, o->frame[i]);
+		}
+
+		if (t > o->n) continue;
+		c->a = t;
+
+		if (t == skip_nops(o, i + 1, o->frame[i]))
+			c->type = INSTR_NOP;
+	}
+}
+
+/* Whether `c' leaves an integer in `a' when it runs at all. */
+static bool
+makes_int(struct optimizer *o, struct instruction *c, uint64_t *ints)
+{
+	switch (c->type) {
+	case INSTR_COPYC: case INSTR_MOVC:
+		return o->c->ct->val[c->b].type == VAL_INT;
+
+	case INSTR_MOV: case INSTR_COPY: case INSTR_ARG: case INSTR_NEG:
+		return IN_SET(ints, c->b);
+
+	case INSTR_INC: case INSTR_DEC: case INSTR_INC_I: case INSTR_DEC_I:
+		return IN_SET(ints, c->a);
+
+	case INSTR_ADD: case INSTR_SUB: case INSTR_MUL: case INSTR_MOD:
+		return IN_SET(ints, c->b) && IN_SET(ints, c->c);
+
+	case INSTR_LEN: case INSTR_BAND: case INSTR_XOR: case INSTR_BOR:
+	case INSTR_SLEFT: case INSTR_SRIGHT:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static void
+int_transfer(struct optimizer *o, size_t i, uint64_t *ints)
+{
+	struct instruction *c = o->code + i;
+	int use, def;
+
+	if (is_barrier(c->type)) {
+		memset(ints, 0, LIVE_WORDS * sizeof *ints);
+		return;
+	}
+
+	bool num = makes_int(o, c, ints);
+	instruction_operands(*c, &use, &def);
+
+	for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+		int r = *instruction_field(c, f);
+		if (def & f && r < NUM_REG) CLEAR(ints, r);
+	}
+
+	if (num && c->a < NUM_REG) SET(ints, c->a);
+}
+
+/*
+ * Works out which locals certainly hold integers at each instruction
+ * and switches the arithmetic, comparisons and increments on them to
+ * typed instructions that don't look at their operands' types.
+ */
+static void
+specialize(struct optimizer *o)
+{
+	uint64_t *in = solve_forward(o, int_transfer);
+
+	for (size_t i = 0; i < o->n; i++) {
+		struct instruction *c = o->code + i;
+		uint64_t *ints = in + i * LIVE_WORDS;
+
+		if (c->type == INSTR_INC || c->type == INSTR_DEC) {
+			if (IN_SET(ints, c->a))
+				c->type = c->type == INSTR_INC ? INSTR_INC_I : INSTR_DEC_I;
+			continue;
+		}
+
+		if (c->a >= NUM_REG || !IN_SET(ints, c->b) || !IN_SET(ints, c->c))
+			continue;
+
+		switch (c->type) {
+		case INSTR_ADD:  c->type = INSTR_ADD_II;  break;
+		case INSTR_SUB:  c->type = INSTR_SUB_II;  break;
+		case INSTR_MUL:  c->type = INSTR_MUL_II;  break;
+		case INSTR_CMP:  c->type = INSTR_CMP_II;  break;
+		case INSTR_LESS: c->type = INSTR_LESS_II; break;
+		case INSTR_LEQ:  c->type = INSTR_LEQ_II;  break;
+		case INSTR_GEQ:  c->type = INSTR_GEQ_II;  break;
+		case INSTR_MORE: c->type = INSTR_MORE_II; break;
+		default: break;
+		}
+	}
+
+	free(in);
+}
+
+/* The instructions that have forms that read without checking. */
+static const unsigned char unchecked[] = {
+	[INSTR_MOV] = INSTR_MOV_U,       [INSTR_COPY] = INSTR_COPY_U,
+	[INSTR_ARG] = INSTR_ARG_U,       [INSTR_PUSH] = INSTR_PUSH_U,
+	[INSTR_PUSHF] = INSTR_PUSHF_U,   [INSTR_COND] = INSTR_COND_U,
+	[INSTR_NCOND] = INSTR_NCOND_U,
+	[INSTR_ADD] = INSTR_ADD_U,       [INSTR_SUB] = INSTR_SUB_U,
+	[INSTR_MUL] = INSTR_MUL_U,       [INSTR_POW] = INSTR_POW_U,
+	[INSTR_DIV] = INSTR_DIV_U,       [INSTR_MOD] = INSTR_MOD_U,
+	[INSTR_CMP] = INSTR_CMP_U,       [INSTR_LESS] = INSTR_LESS_U,
+	[INSTR_LEQ] = INSTR_LEQ_U,       [INSTR_GEQ] = INSTR_GEQ_U,
+	[INSTR_MORE] = INSTR_MORE_U,     [INSTR_BAND] = INSTR_BAND_U,
+	[INSTR_XOR] = INSTR_XOR_U,       [INSTR_BOR] = INSTR_BOR_U,
+	[INSTR_SLEFT] = INSTR_SLEFT_U,   [INSTR_SRIGHT] = INSTR_SRIGHT_U,
+	[INSTR_NEG] = INSTR_NEG_U,       [INSTR_FLIP] = INSTR_FLIP_U,
+	[INSTR_LEN] = INSTR_LEN_U,       [INSTR_INC] = INSTR_INC_U,
+	[INSTR_DEC] = INSTR_DEC_U,       [INSTR_SUBSCR] = INSTR_SUBSCR_U
+};
+
+/*
+ * Works out which locals are certainly initialized at each
+ * instruction and switches the instructions whose operands all are
+ * to forms that don't check them.
+ */
+static void
+uncheck(struct optimizer *o)
+{
+	uint64_t *in = solve_forward(o, init_transfer);
+
+	for (size_t i = 0; i < o->n; i++) {
+		struct instruction *c = o->code + i;
+		uint64_t *init = in + i * LIVE_WORDS;
+		int use, def;
+
+		if (c->type >= sizeof unchecked || !unchecked[c->type]) continue;
+		instruction_operands(*c, &use, &def);
+
+		bool set = true;
+		for (int f = FIELD_A; f <= FIELD_E; f <<= 1)
+			if (use & f && !IN_SET(init, *instruction_field(c, f)))
+				set = false;
+
+		if (set) c->type = unchecked[c->type];
+	}
+
+	free(in);
+}
+
+static void
+remap_symbols(struct optimizer *o, struct symbol *s, size_t *pos)
+{
+	if (s->module == o->c->m) {
+		if ((s->type == SYM_FN || s->type == SYM_LABEL) && s->address <= o->n)
+			s->address = pos[s->address];
+		if (s->next >= 0 && (size_t)s->next <= o->n) s->next = pos[s->next];
+		if (s->last >= 0 && (size_t)s->last <= o->n) s->last = pos[s->last];
+	}
+
+	if (s->type == SYM_IMPORTED) return;
+
+	for (size_t i = 0; i < s->num_children; i++)
+		remap_symbols(o, s->children[i], pos);
+}
+
+/*
+ * Closes up the NOPs and moves everything that refers to an address
+ * in the code. A NOP that a COND might skip, or that sits among the
+ * jumps of a JTAB or HTAB, has to stay.
+ */
+static void
+compact(struct optimizer *o)
+{
+	size_t *pos = oak_malloc((o->n + 1) * sizeof *pos), k = 0, keep = 0;
+	size_t succ[MAX_SUCC];
+
+	for (size_t i = 0; i < o->n; i++) {
+		pos[i] = k;
+		int num = instruction_successors(o->code[i], i, succ);
+
+		if (o->code[i].type != INSTR_NOP || i < keep)
+			o->code[k++] = o->code[i];
+		if (num > 1) keep = succ[num - 1];
+	}
+
+	pos[o->n] = k;
+
+	for (size_t i = 0; i < k; i++)
+		if (o->code[i].type == INSTR_JMP && o->code[i].a <= o->n)
+			o->code[i].a = pos[o->code[i].a];
+
+	struct constant_table *ct = o->c->ct;
+
+	for (size_t i = 0; i < ct->num; i++)
+		if (ct->val[i].type == VAL_FN && ct->val[i].module == o->c->m->id
+		    && (size_t)ct->val[i].integer <= o->n)
+			ct->val[i].integer = pos[ct->val[i].integer];
+
+	remap_symbols(o, o->c->m->sym, pos);
+
+	o->c->ip = o->n = k;
+	free(pos);
+}
+
+void
+optimize(struct compiler *c)
+{
+	struct optimizer o;
+	memset(&o, 0, sizeof o);
+
+	o.c = c;
+	o.code = c->code;
+	o.n = c->ip;
+	o.frame = zalloc(o.n * sizeof *o.frame);
+	o.root = zalloc((o.n + 1) * sizeof *o.root);
+	o.leader = zalloc((o.n + 1) * sizeof *o.leader);
+
+	find_frames(&o);
+	find_escapes(&o, c->m->sym);
+	find_leaders(&o);
+
+	propagate(&o);
+	remove_unreachable(&o);
+	remove_dead_stores(&o);
+	thread_jumps(&o);
+	specialize(&o);
+	uncheck(&o);
+	compact(&o);
+
+	free(o.frame);
+	free(o.root);
+	free(o.leader);
+}
@@ -0,0 +1,64 @@
+#include <string.h>
+
+#include "recache.h"
+#include "util.h"
+
+struct recache *
+new_recache(void)
+{
+	struct recache *c = oak_malloc(sizeof *c);
+	memset(c, 0, sizeof *c);
+	return c;
+}
+
+void
+free_recache(struct recache *c)
+{
+	if (!c) return;
+
+	for (int i = 0; i < c->len; i++)
+		ktre_free(c->e[i].re);
+
+	free(c);
+}
+
+/*
+ * Returns a regex for `pat' compiled with `opt', which the caller
+ * frees with ktre_free. A pattern that fails to compile isn't cached;
+ * the caller gets it as it is so that it can report the error.
+ */
+ktre *
+recache_get(struct recache *c, const char *pat, int opt)
+{
+	uint64_t h = hash(pat, strlen(pat));
+
+	for (int i = 0; i < c->len; i++) {
+		struct recache_entry *e = c->e + i;
+
+		if (e->h == h && e->opt == opt && !strcmp(e->re->pat, pat)) {
+			e->used = ++c->tick;
+			return ktre_copy(e->re);
+		}
+	}
+
+	ktre *re = ktre_compile(pat, opt);
+	if (!re || re->err) return re;
+
+	struct recache_entry *e = c->e;
+
+	if (c->len == RECACHE_SIZE) {
+		for (int i = 1; i < RECACHE_SIZE; i++)
+			if (c->e[i].used < e->used) e = c->e + i;
+
+		ktre_free(e->re);
+	} else {
+		e = c->e + c->len++;
+	}
+
+	e->opt = opt;
+	e->h = h;
+	e->re = re;
+	e->used = ++c->tick;
+
+	return ktre_copy(re);
+}
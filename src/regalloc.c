@@ -0,0 +1,223 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+#include "regalloc.h"
+#include "util.h"
+
+/*
+ * Temporaries are given registers by linear scan: liveness is worked
+ * out over the basic blocks of the code, each temporary gets the
+ * smallest interval of instructions covering everywhere it's live,
+ * and the intervals are handed the lowest register that's free for
+ * all of their length.
+ */
+
+static bool
+is_temp(int r)
+{
+	return r >= TEMP_REG && r < MAX_TEMP;
+}
+
+static void *
+zalloc(size_t size)
+{
+	void *p = oak_malloc(size ? size : 1);
+	memset(p, 0, size ? size : 1);
+	return p;
+}
+
+#define TEST(S,X) ((S)[(X) / 64] & (UINT64_C(1) << ((X) % 64)))
+#define SET(S,X) ((S)[(X) / 64] |= UINT64_C(1) << ((X) % 64))
+
+struct interval {
+	int lo, hi;
+};
+
+static void
+extend(struct interval *v, int i)
+{
+	if (i < v->lo) v->lo = i;
+	if (i > v->hi) v->hi = i;
+}
+
+/*
+ * Renames the temporaries used in [start, end) to TEMP_REG and up,
+ * sharing registers between temporaries that are never live at once,
+ * and returns how many registers they take. Control that leaves the
+ * range is taken to leave nothing live behind.
+ */
+int
+allocate_temps(struct instruction *code, size_t start, size_t end)
+{
+	int n = 0;
+
+	for (size_t i = start; i < end; i++) {
+		int use, def;
+		instruction_operands(code[i], &use, &def);
+
+		for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+			int r = *instruction_field(code + i, f);
+			if ((use | def) & f && is_temp(r) && r - TEMP_REG + 1 > n)
+				n = r - TEMP_REG + 1;
+		}
+	}
+
+	if (!n) return 0;
+
+	size_t len = end - start, succ[MAX_SUCC];
+	int *block = zalloc(len * sizeof *block);
+	bool *leader = zalloc((len + 1) * sizeof *leader);
+	leader[0] = true;
+
+	for (size_t i = 0; i < len; i++) {
+		int num = instruction_successors(code[start + i], start + i, succ);
+		if (!num) leader[i + 1] = true;
+
+		for (int j = 0; j < num; j++) {
+			if (succ[j] != start + i + 1) leader[i + 1] = true;
+			if (succ[j] >= start && succ[j] < end) leader[succ[j] - start] = true;
+		}
+	}
+
+	int nb = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (leader[i]) nb++;
+		block[i] = nb - 1;
+	}
+
+	size_t *first = zalloc((nb + 1) * sizeof *first);
+	for (size_t i = len; i-- > 0;) first[block[i]] = i;
+	first[nb] = len;
+
+	size_t w = (n + 63) / 64;
+	uint64_t *use = zalloc(nb * w * sizeof *use);
+	uint64_t *def = zalloc(nb * w * sizeof *def);
+	uint64_t *in  = zalloc(nb * w * sizeof *in);
+	uint64_t *out = zalloc(nb * w * sizeof *out);
+
+	for (size_t i = 0; i < len; i++) {
+		uint64_t *u = use + block[i] * w, *d = def + block[i] * w;
+		int uf, df;
+		instruction_operands(code[start + i], &uf, &df);
+
+		for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+			int r = *instruction_field(code + start + i, f);
+			if (uf & f && is_temp(r) && !TEST(d, r - TEMP_REG))
+				SET(u, r - TEMP_REG);
+		}
+
+		for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+			int r = *instruction_field(code + start + i, f);
+			if (df & f && is_temp(r)) SET(d, r - TEMP_REG);
+		}
+	}
+
+	for (bool changed = true; changed;) {
+		changed = false;
+
+		for (int b = nb - 1; b >= 0; b--) {
+			size_t last = start + first[b + 1] - 1;
+			int num = instruction_successors(code[last], last, succ);
+			uint64_t *o = out + b * w;
+
+			for (int j = 0; j < num; j++) {
+				if (succ[j] < start || succ[j] >= end) continue;
+				uint64_t *s = in + block[succ[j] - start] * w;
+				for (size_t k = 0; k < w; k++) o[k] |= s[k];
+			}
+
+			for (size_t k = 0; k < w; k++) {
+				uint64_t x = use[b * w + k] | (o[k] & ~def[b * w + k]);
+				if (x != in[b * w + k]) changed = true;
+				in[b * w + k] = x;
+			}
+		}
+	}
+
+	struct interval *live = oak_malloc(n * sizeof *live);
+	for (int i = 0; i < n; i++) live[i] = (struct interval){ INT_MAX, -1 };
+
+	for (int b = 0; b < nb; b++) {
+		for (int r = 0; r < n; r++) {
+			if (TEST(in + b * w, r)) extend(live + r, first[b]);
+			if (TEST(out + b * w, r)) extend(live + r, first[b + 1] - 1);
+		}
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		int uf, df;
+		instruction_operands(code[start + i], &uf, &df);
+
+		for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+			int r = *instruction_field(code + start + i, f);
+			if ((uf | df) & f && is_temp(r)) extend(live + r - TEMP_REG, i);
+		}
+	}
+
+	/* Sort the intervals by where they start. */
+	int *count = zalloc((len + 1) * sizeof *count);
+	int *order = oak_malloc(n * sizeof *order), num = 0;
+
+	for (int r = 0; r < n; r++)
+		if (live[r].hi >= 0) count[live[r].lo + 1]++, num++;
+	for (size_t i = 0; i < len; i++)
+		count[i + 1] += count[i];
+	for (int r = 0; r < n; r++)
+		if (live[r].hi >= 0) order[count[live[r].lo]++] = r;
+
+	int *reg = oak_malloc(n * sizeof *reg);
+	int *busy = oak_malloc(n * sizeof *busy), regs = 0;
+
+	for (int i = 0; i < num; i++) {
+		struct interval v = live[order[i]];
+		int k = 0;
+		while (k < regs && busy[k] >= v.lo) k++;
+		if (k == regs) regs++;
+		busy[k] = v.hi;
+		reg[order[i]] = k;
+	}
+
+	for (size_t i = start; i < end; i++) {
+		int uf, df;
+		instruction_operands(code[i], &uf, &df);
+
+		for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+			uint16_t *r = instruction_field(code + i, f);
+			if ((uf | df) & f && is_temp(*r))
+				*r = TEMP_REG + reg[*r - TEMP_REG];
+		}
+	}
+
+	free(block);
+	free(leader);
+	free(first);
+	free(use);
+	free(def);
+	free(in);
+	free(out);
+	free(live);
+	free(count);
+	free(order);
+	free(reg);
+	free(busy);
+
+	return regs;
+}
+
+/* Moves the temporaries in [start, end) to `base' and up. */
+void
+place_temps(struct instruction *code, size_t start, size_t end, int base)
+{
+	for (size_t i = start; i < end; i++) {
+		int use, def;
+		instruction_operands(code[i], &use, &def);
+
+		for (int f = FIELD_A; f <= FIELD_E; f <<= 1) {
+			uint16_t *r = instruction_field(code + i, f);
+			if ((use | def) & f && is_temp(*r))
+				*r = base + *r - TEMP_REG;
+		}
+	}
+}
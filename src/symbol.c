@@ -483,6 +483,7 @@ symbolize(struct symbolizer *si, struct statement *stmt)
 
 		sym->name = strclone(stmt->fn_def.name);
 		sym->type = SYM_FN;
+		sym->def = stmt;
 
 		/*
 		 * We have to set the id early to support recursive
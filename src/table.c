@@ -3,6 +3,217 @@
 #include "value.h"
 #include "util.h"
 
+/*
+ * A node in the trie holds up to 32 entries, indexed by five bits of
+ * the key's hash. Only the occupied entries are stored; `map' records
+ * which hash fragments are present and the popcount of the bits below
+ * a fragment gives its position in `e'. Nodes below HAMT_DEPTH levels
+ * have run out of hash bits and just hold a list of colliding leaves.
+ *
+ * Nodes and leaves are reference counted. Anything with a count of one
+ * is reachable from exactly one table and is updated in place, so a
+ * table that has been copied once and then grows on its own only pays
+ * for path copying until it owns its nodes again.
+ */
+
+struct hamt_leaf {
+	int refs;
+	uint64_t h;
+	char *key;
+	struct value val;
+};
+
+struct hamt {
+	int refs;
+	uint32_t map;
+	unsigned len;
+
+	struct hamt_entry {
+		struct hamt *child;
+		struct hamt_leaf *leaf;
+	} *e;
+};
+
+static struct hamt *
+new_hamt(void)
+{
+	struct hamt *n = oak_malloc(sizeof *n);
+	memset(n, 0, sizeof *n);
+	n->refs = 1;
+	return n;
+}
+
+static struct hamt_leaf *
+new_leaf(uint64_t h, const char *key, struct value v)
+{
+	struct hamt_leaf *l = oak_malloc(sizeof *l);
+	l->refs = 1;
+	l->h = h;
+	l->key = strclone(key);
+	l->val = v;
+	return l;
+}
+
+static void
+release_leaf(struct hamt_leaf *l)
+{
+	if (--l->refs) return;
+	free(l->key);
+	free(l);
+}
+
+static void
+release_hamt(struct hamt *n)
+{
+	if (--n->refs) return;
+
+	for (unsigned i = 0; i < n->len; i++) {
+		if (n->e[i].child) release_hamt(n->e[i].child);
+		else release_leaf(n->e[i].leaf);
+	}
+
+	free(n->e);
+	free(n);
+}
+
+/*
+ * Takes over the caller's reference to `n' and returns a node that the
+ * caller owns exclusively.
+ */
+static struct hamt *
+own_hamt(struct hamt *n)
+{
+	if (n->refs == 1) return n;
+
+	struct hamt *r = new_hamt();
+	r->map = n->map;
+	r->len = n->len;
+	r->e = oak_malloc(n->len * sizeof *r->e);
+	memcpy(r->e, n->e, n->len * sizeof *r->e);
+
+	for (unsigned i = 0; i < r->len; i++) {
+		if (r->e[i].child) r->e[i].child->refs++;
+		else r->e[i].leaf->refs++;
+	}
+
+	n->refs--;
+	return r;
+}
+
+static void
+insert_entry(struct hamt *n, unsigned pos, struct hamt_entry e)
+{
+	n->e = oak_realloc(n->e, (n->len + 1) * sizeof *n->e);
+	memmove(n->e + pos + 1, n->e + pos, (n->len - pos) * sizeof *n->e);
+	n->e[pos] = e;
+	n->len++;
+}
+
+static struct hamt *
+hamt_insert(struct hamt *n, uint64_t h, const char *key,
+            struct value v, int depth, bool *added)
+{
+	n = own_hamt(n);
+
+	if (depth == HAMT_DEPTH) {
+		for (unsigned i = 0; i < n->len; i++) {
+			if (!strcmp(n->e[i].leaf->key, key)) {
+				release_leaf(n->e[i].leaf);
+				n->e[i].leaf = new_leaf(h, key, v);
+				return n;
+			}
+		}
+
+		insert_entry(n, n->len, (struct hamt_entry){ NULL, new_leaf(h, key, v) });
+		*added = true;
+		return n;
+	}
+
+	uint32_t bit = 1u << ((h >> (depth * HAMT_BITS)) & 31);
+	unsigned pos = __builtin_popcount(n->map & (bit - 1));
+
+	if (!(n->map & bit)) {
+		insert_entry(n, pos, (struct hamt_entry){ NULL, new_leaf(h, key, v) });
+		n->map |= bit;
+		*added = true;
+		return n;
+	}
+
+	struct hamt_entry *e = n->e + pos;
+
+	if (e->child) {
+		e->child = hamt_insert(e->child, h, key, v, depth + 1, added);
+		return n;
+	}
+
+	if (e->leaf->h == h && !strcmp(e->leaf->key, key)) {
+		release_leaf(e->leaf);
+		e->leaf = new_leaf(h, key, v);
+		return n;
+	}
+
+	/* Push the existing leaf down a level and try again there. */
+	struct hamt *child = new_hamt();
+	struct hamt_leaf *old = e->leaf;
+
+	if (depth + 1 < HAMT_DEPTH)
+		child->map = 1u << ((old->h >> ((depth + 1) * HAMT_BITS)) & 31);
+
+	insert_entry(child, 0, (struct hamt_entry){ NULL, old });
+	e->leaf = NULL;
+	e->child = hamt_insert(child, h, key, v, depth + 1, added);
+
+	return n;
+}
+
+static struct hamt_leaf *
+hamt_lookup(struct hamt *n, uint64_t h, const char *key)
+{
+	for (int depth = 0; depth < HAMT_DEPTH; depth++) {
+		uint32_t bit = 1u << ((h >> (depth * HAMT_BITS)) & 31);
+		if (!(n->map & bit)) return NULL;
+
+		struct hamt_entry *e = n->e + __builtin_popcount(n->map & (bit - 1));
+
+		if (!e->child) {
+			if (e->leaf->h == h && !strcmp(e->leaf->key, key))
+				return e->leaf;
+			return NULL;
+		}
+
+		n = e->child;
+	}
+
+	for (unsigned i = 0; i < n->len; i++)
+		if (!strcmp(n->e[i].leaf->key, key))
+			return n->e[i].leaf;
+
+	return NULL;
+}
+
+/* Moves the contents of the buckets into a trie. */
+static void
+persist_table(struct table *t)
+{
+	if (t->root) return;
+	t->root = new_hamt();
+
+	for (size_t i = 0; i < TABLE_SIZE; i++) {
+		struct bucket *b = t->bucket + i;
+
+		for (size_t j = 0; j < b->len; j++) {
+			bool added = false;
+			t->root = hamt_insert(t->root, b->h[j], b->key[j], b->val[j], 0, &added);
+			free(b->key[j]);
+		}
+
+		free(b->h);
+		free(b->key);
+		free(b->val);
+		memset(b, 0, sizeof *b);
+	}
+}
+
 struct table *
 new_table()
 {
@@ -16,9 +227,10 @@ copy_table(struct table *t)
 {
 	struct table *r = new_table();
 
-	for (size_t i = 0; i < TABLE_SIZE; i++)
-		for (size_t j = 0; j < t->bucket[i].len; j++)
-			table_add(r, t->bucket[i].key[j], table_lookup(t, t->bucket[i].key[j]));
+	persist_table(t);
+	r->root = t->root;
+	r->root->refs++;
+	r->len = t->len;
 
 	return r;
 }
@@ -26,6 +238,8 @@ copy_table(struct table *t)
 void
 free_table(struct table *t)
 {
+	if (t->root) release_hamt(t->root);
+
 	for (size_t i = 0; i < TABLE_SIZE; i++) {
 		for (size_t j = 0; j < t->bucket[i].len; j++)
 			free(t->bucket[i].key[j]);
@@ -43,11 +257,18 @@ table_add(struct table *t, char *key, struct value v)
 {
 	uint64_t h = hash(key, strlen(key));
 
+	if (t->root) {
+		bool added = false;
+		t->root = hamt_insert(t->root, h, key, v, 0, &added);
+		if (added) t->len++;
+		return v;
+	}
+
 	int idx = h % TABLE_SIZE;
 	struct bucket *b = t->bucket + idx;
 
 	for (size_t i = 0; i < b->len; i++) {
-		if (b->h[i] == h) {
+		if (b->h[i] == h && !strcmp(key, b->key[i])) {
 			b->val[i] = v;
 			return v;
 		}
@@ -60,6 +281,7 @@ table_add(struct table *t, char *key, struct value v)
 	b->h  [b->len] = h;
 	b->key[b->len] = strclone(key);
 	b->val[b->len] = v;
+	t->len++;
 
 	return b->val[b->len++];
 }
@@ -68,6 +290,12 @@ struct value
 table_lookup(struct table *t, char *key)
 {
 	uint64_t h = hash(key, strlen(key));
+
+	if (t->root) {
+		struct hamt_leaf *l = hamt_lookup(t->root, h, key);
+		return l ? l->val : NIL;
+	}
+
 	int idx = h % TABLE_SIZE;
 
 	struct bucket *b = t->bucket + idx;
@@ -78,3 +306,68 @@ table_lookup(struct table *t, char *key)
 
 	return NIL;
 }
+
+size_t
+table_len(struct table *t)
+{
+	return t->len;
+}
+
+void
+table_iter(struct table_iter *it, struct table *t)
+{
+	memset(it, 0, sizeof *it);
+	it->t = t;
+
+	if (t->root) {
+		it->node[0] = t->root;
+		it->pos[0] = 0;
+		it->sp = 1;
+	}
+}
+
+bool
+table_next(struct table_iter *it, char **key, struct value *val)
+{
+	if (!it->t->root) {
+		while (it->i < TABLE_SIZE) {
+			struct bucket *b = it->t->bucket + it->i;
+
+			if (it->j < b->len) {
+				if (key) *key = b->key[it->j];
+				if (val) *val = b->val[it->j];
+				it->j++;
+				return true;
+			}
+
+			it->i++;
+			it->j = 0;
+		}
+
+		return false;
+	}
+
+	while (it->sp) {
+		struct hamt *n = it->node[it->sp - 1];
+
+		if (it->pos[it->sp - 1] >= n->len) {
+			it->sp--;
+			continue;
+		}
+
+		struct hamt_entry *e = n->e + it->pos[it->sp - 1]++;
+
+		if (e->child) {
+			it->node[it->sp] = e->child;
+			it->pos[it->sp] = 0;
+			it->sp++;
+			continue;
+		}
+
+		if (key) *key = e->leaf->key;
+		if (val) *val = e->leaf->val;
+		return true;
+	}
+
+	return false;
+}
@@ -3,6 +3,7 @@
 #include <inttypes.h>
 #include <math.h>
 #include <float.h>
+#include <limits.h>
 
 #include "util.h"
 #include "value.h"
@@ -66,7 +67,7 @@ show_value(struct gc *gc, struct value val)
 
 	case VAL_ARRAY:
 		for (unsigned int i = 0; i < gc->array[val.idx]->len; i++) {
-			char *asdf = show_value(gc, gc->array[val.idx]->v[i]);
+			char *asdf = show_value(gc, array_get(gc->array[val.idx], i));
 			char *temp = new_cat(str, asdf);
 			free(str);
 			str = temp;
@@ -78,16 +79,18 @@ show_value(struct gc *gc, struct value val)
 		snprintf(str, cap, "REGEX(%p)", (void *)gc->regex[val.idx]);
 		break;
 
-	case VAL_TABLE:
+	case VAL_TABLE: {
 		/* TODO: This is really bad and buggy and overflowey. */
-		for (int i = 0; i < TABLE_SIZE; i++) {
-			for (size_t j = 0; j < gc->table[val.idx]->bucket[i].len; j++) {
-				char *temp = show_value(gc, gc->table[val.idx]->bucket[i].val[j]);
-				strcat(str, temp);
-				free(temp);
-			}
+		struct table_iter it;
+		struct value elem;
+
+		table_iter(&it, gc->table[val.idx]);
+		while (table_next(&it, NULL, &elem)) {
+			char *temp = show_value(gc, elem);
+			strcat(str, temp);
+			free(temp);
 		}
-		break;
+	} break;
 
 	default:
 		DOUT("unimplemented printer for value of type %d", val.type);
@@ -173,10 +176,10 @@ val_binop(struct gc *gc, struct value l, struct value r, int op)
 			gc->array[v.idx] = new_array();
 
 			for (size_t i = 0; i < gc->array[l.idx]->len; i++)
-				array_push(gc->array[v.idx], gc->array[l.idx]->v[i]);
+				array_push(gc->array[v.idx], array_get(gc->array[l.idx], i));
 
 			for (size_t i = 0; i < gc->array[r.idx]->len; i++)
-				array_push(gc->array[v.idx], gc->array[r.idx]->v[i]);
+				array_push(gc->array[v.idx], array_get(gc->array[r.idx], i));
 		} else if (l.type == VAL_NIL) {
 			v = copy_value(gc, r);
 		} else if (r.type == VAL_NIL) {
@@ -188,11 +191,13 @@ val_binop(struct gc *gc, struct value l, struct value r, int op)
 			v.idx = gc_alloc(gc, VAL_TABLE);
 			gc->table[v.idx] = copy_table(gc->table[l.idx]);
 
-			for (int i = 0; i < TABLE_SIZE; i++) {
-				struct bucket b = gc->table[r.idx]->bucket[i];
-				for (size_t j = 0; j < b.len; j++)
-					table_add(gc->table[v.idx], b.key[j], b.val[j]);
-			}
+			struct table_iter it;
+			char *key;
+			struct value elem;
+
+			table_iter(&it, gc->table[r.idx]);
+			while (table_next(&it, &key, &elem))
+				table_add(gc->table[v.idx], key, elem);
 		} else BINARY_MATH_OPERATION(v, +) else goto err;
 		break;
 
@@ -224,7 +229,7 @@ val_binop(struct gc *gc, struct value l, struct value r, int op)
 
 			for (int64_t i = 0; i < r.integer; i++)
 				for (size_t j = 0; j < gc->array[l.idx]->len; j++)
-					array_push(gc->array[v.idx], copy_value(gc, gc->array[l.idx]->v[j]));
+					array_push(gc->array[v.idx], copy_value(gc, array_get(gc->array[l.idx], j)));
 		} else if (l.type == VAL_INT && r.type == VAL_ARRAY) {
 			v.type = VAL_ARRAY;
 			v.idx = gc_alloc(gc, VAL_ARRAY);
@@ -232,7 +237,7 @@ val_binop(struct gc *gc, struct value l, struct value r, int op)
 
 			for (int64_t i = 0; i < l.integer; i++)
 				for (size_t j = 0; j < gc->array[r.idx]->len; j++)
-					array_push(gc->array[v.idx], copy_value(gc, gc->array[r.idx]->v[j]));
+					array_push(gc->array[v.idx], copy_value(gc, array_get(gc->array[r.idx], j)));
 		} else BINARY_MATH_OPERATION(v, *) else goto err;
 		break;
 
@@ -310,7 +315,7 @@ val_binop(struct gc *gc, struct value l, struct value r, int op)
 				return v;
 
 			for (size_t i = 0; i < gc->array[l.idx]->len; i++)
-				if (!is_truthy(gc, val_binop(gc, gc->array[l.idx]->v[i], gc->array[r.idx]->v[i], OP_CMP)))
+				if (!is_truthy(gc, val_binop(gc, array_get(gc->array[l.idx], i), array_get(gc->array[r.idx], i), OP_CMP)))
 					return v;
 
 			v.boolean = true;
@@ -356,12 +361,7 @@ is_truthy(struct gc *gc, struct value l)
 	case VAL_NIL:   return false;
 	case VAL_ERR:   return false; break;
 	case VAL_FN:    return true;
-	case VAL_TABLE: {
-		int len = 0;
-		for (int i = 0; i < TABLE_SIZE; i++)
-			len += gc->table[l.idx]->bucket[i].len;
-		return !!len;
-	} break;
+	case VAL_TABLE: return !!table_len(gc->table[l.idx]);
 
 	case VAL_UNDEF:
 		assert(false);
@@ -423,14 +423,20 @@ value_len(struct gc *gc, struct value l)
 struct value
 copy_value(struct gc *gc, struct value l)
 {
-	if (l.type == VAL_ARRAY) {
+	if (l.type == VAL_ARRAY && array_packed(gc->array[l.idx])) {
+		struct value v;
+		v.type = VAL_ARRAY;
+		v.idx = gc_alloc(gc, VAL_ARRAY);
+		gc->array[v.idx] = copy_array(gc->array[l.idx]);
+		l = v;
+	} else if (l.type == VAL_ARRAY) {
 		struct value v;
 		v.type = VAL_ARRAY;
 		v.idx = gc_alloc(gc, VAL_ARRAY);
 		gc->array[v.idx] = new_array();
 
 		for (size_t i = 0; i < gc->array[l.idx]->len; i++)
-			array_push(gc->array[v.idx], copy_value(gc, gc->array[l.idx]->v[i]));
+			array_push(gc->array[v.idx], copy_value(gc, array_get(gc->array[l.idx], i)));
 
 		l = v;
 	} else if (l.type == VAL_STR) {
@@ -476,27 +482,114 @@ qsort_partition(struct gc *gc, struct value l, int begin, int end)
 	if (begin < 0 || end < 0) return;
 	if (begin >= end) return;
 
+	struct array *a = gc->array[l.idx];
 	int pivot = begin;
 	int i = begin + 1;
 	int j = begin + 1;
 
 	for (i = begin + 1; i <= end; i++) {
-		if (is_truthy(gc, val_binop(gc, gc->array[l.idx]->v[i], gc->array[l.idx]->v[pivot], OP_LESS))) {
-			struct value t = gc->array[l.idx]->v[i];
-			gc->array[l.idx]->v[i] = gc->array[l.idx]->v[j];
-			gc->array[l.idx]->v[j] = t;
+		if (is_truthy(gc, val_binop(gc, array_get(a, i), array_get(a, pivot), OP_LESS))) {
+			struct value t = array_get(a, i);
+			array_set(a, i, array_get(a, j));
+			array_set(a, j, t);
 			j++;
 		}
 	}
 
-	struct value t = gc->array[l.idx]->v[j - 1];
-	gc->array[l.idx]->v[j - 1] = gc->array[l.idx]->v[pivot];
-	gc->array[l.idx]->v[pivot] = t;
+	struct value t = array_get(a, j - 1);
+	array_set(a, j - 1, array_get(a, pivot));
+	array_set(a, pivot, t);
 
 	qsort_partition(gc, l, begin, j - 2);
 	qsort_partition(gc, l, j, end);
 }
 
+static int
+compare_ints(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+compare_reals(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void
+sort_array(struct gc *gc, struct value l)
+{
+	struct array *a = gc->array[l.idx];
+	if (a->kind == ARRAY_VIEW) array_materialize(a);
+
+	/* copy_value leaves packed arrays unwrapped */
+	if (a->kind == ARRAY_RANGE) {
+		if (a->step < 0 && a->len) {
+			a->first += (int64_t)(a->len - 1) * a->step;
+			a->step = -a->step;
+		}
+	} else if (a->kind == ARRAY_INTS)
+		qsort(a->ints, a->len, sizeof (int64_t), compare_ints);
+	else if (a->kind == ARRAY_REALS)
+		qsort(a->reals, a->len, sizeof (double), compare_reals);
+	else
+		qsort_partition(gc, l, 0, (int)a->len - 1);
+}
+
+/* Copies the elements of `a' the way copying the whole array would. */
+static void
+copy_elements(struct gc *gc, struct array *a)
+{
+	if (a->kind != ARRAY_VALUES) return;
+
+	for (size_t i = 0; i < a->len; i++)
+		a->v[ARRAY_SLOT(a, i)] = copy_value(gc, a->v[ARRAY_SLOT(a, i)]);
+}
+
+/*
+ * sort_value and rev_value for values nothing else can see: arrays
+ * are rearranged where they are instead of being built again.
+ */
+struct value
+sort_fresh_value(struct gc *gc, struct value l)
+{
+	if (l.type != VAL_ARRAY) return sort_value(gc, l);
+
+	copy_elements(gc, gc->array[l.idx]);
+	sort_array(gc, l);
+	return l;
+}
+
+struct value
+rev_fresh_value(struct gc *gc, struct value l)
+{
+	if (l.type != VAL_ARRAY) return rev_value(gc, l);
+
+	struct array *a = gc->array[l.idx];
+	if (a->kind == ARRAY_VIEW) array_materialize(a);
+
+	if (a->kind == ARRAY_RANGE) {
+		if (a->len) {
+			a->first += (int64_t)(a->len - 1) * a->step;
+			a->step = -a->step;
+		}
+
+		return l;
+	}
+
+	copy_elements(gc, a);
+
+	for (size_t i = 0, j = a->len; i + 1 < j; i++, j--) {
+		struct value t = array_get(a, i);
+		array_set(a, i, array_get(a, j - 1));
+		array_set(a, j - 1, t);
+	}
+
+	return l;
+}
+
 struct value
 sort_value(struct gc *gc, struct value l)
 {
@@ -512,7 +605,7 @@ sort_value(struct gc *gc, struct value l)
 
 	case VAL_ARRAY:
 		ret = copy_value(gc, l);
-		qsort_partition(gc, ret, 0, (int)gc->array[l.idx]->len - 1);
+		sort_array(gc, ret);
 		break;
 
 	case VAL_NIL:
@@ -534,24 +627,45 @@ max_value(struct gc *gc, struct value l)
 		v.idx = gc_alloc(gc, VAL_ARRAY);
 		gc->array[v.idx] = new_array();
 
-		for (int i = 0; i < TABLE_SIZE; i++) {
-			struct bucket b = gc->table[l.idx]->bucket[i];
-			for (size_t j = 0; j < b.len; j++) {
-				array_push(gc->array[v.idx], b.val[j]);
-			}
-		}
+		struct table_iter it;
+		struct value elem;
+
+		table_iter(&it, gc->table[l.idx]);
+		while (table_next(&it, NULL, &elem))
+			array_push(gc->array[v.idx], elem);
 	} else {
 		if (l.type != VAL_ARRAY)
 			return ERR("max expects an array or table");
 		v = l;
 	}
 
-	if (gc->array[v.idx]->len == 0) return NIL;
-	struct value m = gc->array[v.idx]->v[0];
+	struct array *a = gc->array[v.idx];
+	if (a->len == 0) return NIL;
+
+	if (a->kind == ARRAY_RANGE)
+		return (a->step > 0) ? array_get(a, a->len - 1) : array_get(a, 0);
+
+	if (a->kind == ARRAY_INTS) {
+		int64_t m = a->ints[ARRAY_SLOT(a, 0)];
+		for (unsigned i = 1; i < a->len; i++)
+			if (a->ints[ARRAY_SLOT(a, i)] > m)
+				m = a->ints[ARRAY_SLOT(a, i)];
+		return INT(m);
+	}
+
+	if (a->kind == ARRAY_REALS) {
+		double m = a->reals[ARRAY_SLOT(a, 0)];
+		for (unsigned i = 1; i < a->len; i++)
+			if (a->reals[ARRAY_SLOT(a, i)] > m)
+				m = a->reals[ARRAY_SLOT(a, i)];
+		return FLOAT(m);
+	}
+
+	struct value m = array_get(a, 0);
 
-	for (unsigned i = 0; i < gc->array[v.idx]->len; i++)
-		if (is_truthy(gc, val_binop(gc, gc->array[v.idx]->v[i], m, OP_MORE)))
-			m = gc->array[v.idx]->v[i];
+	for (unsigned i = 0; i < a->len; i++)
+		if (is_truthy(gc, val_binop(gc, array_get(a, i), m, OP_MORE)))
+			m = array_get(a, i);
 
 	return m;
 }
@@ -566,24 +680,45 @@ min_value(struct gc *gc, struct value l)
 		v.idx = gc_alloc(gc, VAL_ARRAY);
 		gc->array[v.idx] = new_array();
 
-		for (int i = 0; i < TABLE_SIZE; i++) {
-			struct bucket b = gc->table[l.idx]->bucket[i];
-			for (size_t j = 0; j < b.len; j++) {
-				array_push(gc->array[v.idx], b.val[j]);
-			}
-		}
+		struct table_iter it;
+		struct value elem;
+
+		table_iter(&it, gc->table[l.idx]);
+		while (table_next(&it, NULL, &elem))
+			array_push(gc->array[v.idx], elem);
 	} else {
 		if (l.type != VAL_ARRAY)
 			return ERR("max expects an array or table");
 		v = l;
 	}
 
-	if (gc->array[v.idx]->len == 0) return NIL;
-	struct value m = gc->array[v.idx]->v[0];
+	struct array *a = gc->array[v.idx];
+	if (a->len == 0) return NIL;
 
-	for (unsigned i = 0; i < gc->array[v.idx]->len; i++)
-		if (is_truthy(gc, val_binop(gc, gc->array[v.idx]->v[i], m, OP_LESS)))
-			m = gc->array[v.idx]->v[i];
+	if (a->kind == ARRAY_RANGE)
+		return (a->step < 0) ? array_get(a, a->len - 1) : array_get(a, 0);
+
+	if (a->kind == ARRAY_INTS) {
+		int64_t m = a->ints[ARRAY_SLOT(a, 0)];
+		for (unsigned i = 1; i < a->len; i++)
+			if (a->ints[ARRAY_SLOT(a, i)] < m)
+				m = a->ints[ARRAY_SLOT(a, i)];
+		return INT(m);
+	}
+
+	if (a->kind == ARRAY_REALS) {
+		double m = a->reals[ARRAY_SLOT(a, 0)];
+		for (unsigned i = 1; i < a->len; i++)
+			if (a->reals[ARRAY_SLOT(a, i)] < m)
+				m = a->reals[ARRAY_SLOT(a, i)];
+		return FLOAT(m);
+	}
+
+	struct value m = array_get(a, 0);
+
+	for (unsigned i = 0; i < a->len; i++)
+		if (is_truthy(gc, val_binop(gc, array_get(a, i), m, OP_LESS)))
+			m = array_get(a, i);
 
 	return m;
 }
@@ -615,7 +750,7 @@ rev_value(struct gc *gc, struct value l)
 		size_t len = gc->array[l.idx]->len;
 
 		for (size_t i = 1; i <= len; i++) {
-			struct value r = gc->array[l.idx]->v[len - i];
+			struct value r = array_get(gc->array[l.idx], len - i);
 			array_push(gc->array[ans.idx], copy_value(gc, r));
 		}
 	} break;
@@ -772,38 +907,72 @@ slice_value(struct gc *gc, struct value l, int start, int stop, int step)
 		v.type = VAL_STR;
 		v.idx = gc_alloc(gc, VAL_STR);
 		char *a = gc->str[v.idx] = oak_malloc(labs((stop - start) / step) + 3);
+		const char *str = gc->str[l.idx];
+		int64_t len = strlen(str);
 
 		if (stop < 0)
-			stop = (stop % strlen(gc->str[l.idx])) + 1;
+			stop = (stop % len) + 1;
 
-		if (stop < start && step < 0)
+		if (start < stop && step == 1 && start >= 0 && stop < len) {
+			memcpy(a, str + start, stop - start + 1);
+			a += stop - start + 1;
+		} else if (stop < start && step < 0)
 			for (int64_t i = start; i >= stop; i += step)
-				*a++ = gc->str[l.idx][labs(i) % strlen(gc->str[l.idx])];
+				*a++ = str[labs(i) % len];
 		else if (start < stop && step < 0)
 			for (int64_t i = stop; i >= start; i += step)
-				*a++ = gc->str[l.idx][labs(i) % strlen(gc->str[l.idx])];
+				*a++ = str[labs(i) % len];
 		else if (start < stop && step > 0)
 			for (int64_t i = start; i <= stop; i += step)
-				*a++ = gc->str[l.idx][labs(i) % strlen(gc->str[l.idx])];
+				*a++ = str[labs(i) % len];
 
 		*a = 0;
 		return v;
 	}
 
+	struct array *a = gc->array[l.idx];
+
 	struct value v;
 	v.type = VAL_ARRAY;
 	v.idx = gc_alloc(gc, VAL_ARRAY);
-	gc->array[v.idx] = new_array();
 
-	if (stop <= start && step < 0)
-		for (int64_t i = start; i >= stop; i += step)
-			array_push(gc->array[v.idx], gc->array[l.idx]->v[labs(i % gc->array[l.idx]->len)]);
-	else if (start <= stop && step < 0)
-		for (int64_t i = stop; i >= start; i += step)
-			array_push(gc->array[v.idx], gc->array[l.idx]->v[labs(i % gc->array[l.idx]->len)]);
-	else if (start <= stop && step > 0)
-		for (int64_t i = start; i <= stop; i += step)
-			array_push(gc->array[v.idx], gc->array[l.idx]->v[labs(i % gc->array[l.idx]->len)]);
+	int64_t from = 0, to = 0;
+	bool empty = !a->len;
+
+	if (stop <= start && step < 0) from = start, to = stop;
+	else if (start <= stop && step < 0) from = stop, to = start;
+	else if (start <= stop && step > 0) from = start, to = stop;
+	else empty = true;
+
+	if (empty) {
+		gc->array[v.idx] = new_array();
+		return v;
+	}
+
+	size_t len = (to - from) / step + 1;
+	int64_t lo = step < 0 ? to : from, hi = step < 0 ? from : to;
+
+	/*
+	 * Slices that don't wrap around the end of the array don't copy
+	 * anything: slicing a range gives another range, and anything else
+	 * becomes a view of the original.
+	 */
+	if (lo >= 0 && hi < a->len) {
+		if (a->kind == ARRAY_RANGE) {
+			struct array *r = gc->array[v.idx] = new_array_of(ARRAY_RANGE);
+			r->first = a->first + from * a->step;
+			r->step = a->step * step;
+			r->len = len;
+		} else {
+			gc->array[v.idx] = new_view(a, from, step, len);
+		}
+
+		return v;
+	}
+
+	gc->array[v.idx] = new_array();
+	for (int64_t i = from; step < 0 ? i >= to : i <= to; i += step)
+		array_push(gc->array[v.idx], array_get(a, labs(i % a->len)));
 
 	return v;
 }
@@ -814,10 +983,29 @@ value_range(struct gc *gc, bool real, double start, double stop, double step)
 	struct value v;
 	v.type = VAL_ARRAY;
 	v.idx = gc_alloc(gc, VAL_ARRAY);
-	gc->array[v.idx] = new_array();
+	gc->array[v.idx] = new_array_of(real ? ARRAY_REALS : ARRAY_INTS);
+	struct array *a = gc->array[v.idx];
 
 	if (fcmp(start, stop)) {
-		array_push(gc->array[v.idx], INT(start));
+		array_push(a, INT(start));
+		return v;
+	}
+
+	/*
+	 * Integer ranges with integer steps stay lazy; the accumulation
+	 * in the loops below is exact for them, so start + i * step gives
+	 * the same elements.
+	 */
+	if (!real && start == floor(start) && step == floor(step)
+	    && fabs(start) < 1e15 && fabs(stop) < 1e15 && step != 0
+	    && (start < stop) == (step > 0)) {
+		double len = floor((stop - start) / step) + 1;
+		if (len > UINT_MAX) return ERR("range is too large");
+
+		a->kind = ARRAY_RANGE;
+		a->first = start;
+		a->step = step;
+		a->len = len;
 		return v;
 	}
 
@@ -827,12 +1015,11 @@ value_range(struct gc *gc, bool real, double start, double stop, double step)
 			           start, stop, step);
 		}
 
-		grow_array(gc->array[v.idx], (stop - start) / step + 1);
+		grow_array(a, (stop - start) / step + 1);
 		for (double i = start; i <= stop; i += step) {
-			if (real)
-				array_push(gc->array[v.idx], (struct value){ VAL_FLOAT, { .real = i }, 0 });
-			else
-				array_push(gc->array[v.idx], (struct value){ VAL_INT, { .integer = (int64_t)i }, 0 });
+			if (a->len == a->alloc) grow_array(a, a->len + 1);
+			if (real) a->reals[a->len++] = i;
+			else a->ints[a->len++] = (int64_t)i;
 		}
 	} else {
 		if (step >= 0) {
@@ -840,12 +1027,11 @@ value_range(struct gc *gc, bool real, double start, double stop, double step)
 			           start, stop, step);
 		}
 
-		grow_array(gc->array[v.idx], (start - stop) / -step + 1);
+		grow_array(a, (start - stop) / -step + 1);
 		for (double i = start; i >= stop; i += step) {
-			if (real)
-				array_push(gc->array[v.idx], (struct value){ VAL_FLOAT, { .real = i }, 0 });
-			else
-				array_push(gc->array[v.idx], (struct value){ VAL_INT, { .integer = i }, 0 });
+			if (a->len == a->alloc) grow_array(a, a->len + 1);
+			if (real) a->reals[a->len++] = i;
+			else a->ints[a->len++] = (int64_t)i;
 		}
 	}
 
@@ -876,7 +1062,7 @@ value_translate(struct gc *l, struct gc *r, struct value v)
 		case VAL_ARRAY:
 			l->array[ret.idx] = new_array();
 			for (size_t i = 0; i < r->array[v.idx]->len; i++)
-				array_push(l->array[ret.idx], value_translate(l, r, r->array[v.idx]->v[i]));
+				array_push(l->array[ret.idx], value_translate(l, r, array_get(r->array[v.idx], i)));
 			break;
 
 		case VAL_REGEX:
@@ -921,7 +1107,7 @@ print_value(FILE *f, struct gc *gc, struct value val)
 
 	case VAL_ARRAY:
 		for (size_t i = 0; i < gc->array[val.idx]->len; i++)
-			print_value(f, gc, gc->array[val.idx]->v[i]);
+			print_value(f, gc, array_get(gc->array[val.idx], i));
 		break;
 
 	case VAL_FN:
@@ -932,13 +1118,14 @@ print_value(FILE *f, struct gc *gc, struct value val)
 		fprintf(f, "REGEX(%p)", (void *)gc->regex[val.idx]);
 		break;
 
-	case VAL_TABLE:
-		for (int i = 0; i < TABLE_SIZE; i++) {
-			for (size_t j = 0; j < gc->table[val.idx]->bucket[i].len; j++) {
-				print_value(f, gc, gc->table[val.idx]->bucket[i].val[j]);
-			}
-		}
-		break;
+	case VAL_TABLE: {
+		struct table_iter it;
+		struct value elem;
+
+		table_iter(&it, gc->table[val.idx]);
+		while (table_next(&it, NULL, &elem))
+			print_value(f, gc, elem);
+	} break;
 
 	default:
 		DOUT("unimplemented printer for value of type %d", val.type);
@@ -992,7 +1179,7 @@ make_value_from_token(struct compiler *c, struct token *tok)
 		v.type = VAL_REGEX;
 		v.idx = gc_alloc(c->gc, VAL_REGEX);
 		v.e = e;
-		c->gc->regex[v.idx] = ktre_compile(tok->regex, opt | KTRE_UNANCHORED);
+		c->gc->regex[v.idx] = recache_get(c->m->k->recache, tok->regex, opt | KTRE_UNANCHORED);
 
 		if (c->gc->regex[v.idx]->err) {
 			error_push(c->r, tok->loc, ERR_FATAL,
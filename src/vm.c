@@ -9,12 +9,17 @@ push_frame(struct vm *vm)
 {
 	vm->fp++;
 
+	/*
+	 * Only the registers the last frame at this depth said it
+	 * would use can have anything in them; the frame size stays
+	 * at NUM_REG until the new code says otherwise with FRAME.
+	 */
 	if (vm->fp <= vm->maxfp) {
 		vm->module[vm->fp] = vm->m->id;
 
-		/* TODO: make this more efficient. */
-		for (int i = 0; i < NUM_REG; i++)
+		for (int i = 0; i < vm->frame_size[vm->fp]; i++)
 			vm->frame[vm->fp][i].type = VAL_UNDEF;
+		vm->frame_size[vm->fp] = NUM_REG;
 		return;
 	}
 
@@ -24,12 +29,51 @@ push_frame(struct vm *vm)
 	for (int i = 0; i < NUM_REG; i++)
 		vm->frame[vm->fp][i].type = VAL_UNDEF;
 
+	vm->frame_size = oak_realloc(vm->frame_size, (vm->fp + 1) * sizeof *vm->frame_size);
+	vm->frame_size[vm->fp] = NUM_REG;
+
 	vm->module = oak_realloc(vm->module, (vm->fp + 1) * sizeof *vm->module);
 	vm->module[vm->fp] = vm->m->id;
 
 	vm->maxfp = vm->fp > vm->maxfp ? vm->fp : vm->maxfp;
 }
 
+static struct subject *
+new_subject(char *s, int64_t idx)
+{
+	struct subject *sub = oak_malloc(sizeof *sub);
+	sub->refs = 1;
+	sub->idx = idx;
+	sub->s = s;
+	sub->len = -1;
+	return sub;
+}
+
+static void
+release_subject(struct subject *sub)
+{
+	if (!sub || --sub->refs) return;
+	if (sub->idx < 0) free(sub->s);
+	free(sub);
+}
+
+static void
+set_subject(struct vm *vm, struct subject *sub)
+{
+	if (sub) sub->refs++;
+	release_subject(vm->subject);
+	vm->subject = sub;
+}
+
+/* Called before the gc string `idx' is modified in place. */
+static void
+detach_subject(struct vm *vm, int64_t idx)
+{
+	if (!vm->subject || vm->subject->idx != idx) return;
+	vm->subject->s = strclone(vm->subject->s);
+	vm->subject->idx = -1;
+}
+
 struct vm *
 new_vm(struct module *m, struct oak *k, bool debug)
 {
@@ -60,10 +104,12 @@ free_vm(struct vm *vm)
 	error_clear(vm->r);
 
 	free(vm->frame);
+	free(vm->frame_size);
 	free(vm->stack);
+	free(vm->fresh);
 	free(vm->callstack);
 	free(vm->imp);
-	free(vm->subject);
+	release_subject(vm->subject);
 	free(vm->module);
 
 	free(vm);
@@ -88,11 +134,14 @@ push(struct vm *vm, struct value v)
 
 	if (vm->sp <= vm->maxsp) {
 		vm->stack[vm->sp] = v;
+		vm->fresh[vm->sp] = false;
 		return;
 	}
 
 	vm->stack = oak_realloc(vm->stack, (vm->sp + 1) * sizeof *vm->stack);
+	vm->fresh = oak_realloc(vm->fresh, (vm->sp + 1) * sizeof *vm->fresh);
 	vm->stack[vm->sp] = v;
+	vm->fresh[vm->sp] = false;
 	vm->maxsp = vm->sp > vm->maxsp ? vm->sp : vm->maxsp;
 }
 
@@ -172,6 +221,37 @@ call(struct vm *vm, struct value v)
 	vm->ip = v.integer - 1;
 }
 
+/*
+ * Calls `v' in place of the function that's running. The frame and
+ * the callstack slot are handed over to the callee, which returns
+ * straight to our caller. A call that can't be made that way is an
+ * ordinary one, and the code after the TCALL passes its result on.
+ */
+static void
+tailcall(struct vm *vm, struct value v)
+{
+	if (v.type != VAL_FN || v.module != vm->m->id) {
+		call(vm, v);
+		return;
+	}
+
+	if (vm->debug)
+		printf("<tail call : %s@%s : %p : %zu argument%s>\n",
+		        v.name ? v.name : "*function*",
+		        vm->m->name,
+		        (void *)&vm->code[vm->ip], vm->sp,
+		        vm->sp == 1 ? "" : "s");
+
+	for (int i = 0; i < vm->frame_size[vm->fp]; i++)
+		vm->frame[vm->fp][i].type = VAL_UNDEF;
+	vm->frame_size[vm->fp] = NUM_REG;
+
+	vm->args[vm->csp] = vm->sp;
+	vm->calls[vm->csp] = v;
+
+	vm->ip = v.integer - 1;
+}
+
 static void
 ret(struct vm *vm)
 {
@@ -238,16 +318,91 @@ getreg(struct vm *vm, int n)
 #define BIN(X) SETREG(c.a, val_binop(vm->gc, getreg(vm, c.b), getreg(vm, c.c), (X)))
 #define UN(X) SETREG(c.a, val_unop(getreg(vm, c.a), (X)))
 
+/*
+ * The typed instructions are only emitted for local registers the
+ * optimizer has proven hold integers, so they skip every check.
+ */
+#define LOCAL(X) (vm->frame[vm->fp][X])
+#define IBIN(X) (LOCAL(c.a) = INT(LOCAL(c.b).integer X LOCAL(c.c).integer))
+#define ICMP(X) (LOCAL(c.a) = BOOL(LOCAL(c.b).integer X LOCAL(c.c).integer))
+
+/*
+ * The unchecked instructions read locals the optimizer has proven
+ * are initialized. A copy of a live value can never be an error, so
+ * the moves store it directly; the operators still check what they
+ * compute.
+ */
+#define PUTREG(X,Y) ((X) >= NUM_REG ? (vm->m->global[(X) - NUM_REG] = (Y)) : (LOCAL(X) = (Y)))
+#define BIN_U(X) SETREG(c.a, val_binop(vm->gc, LOCAL(c.b), LOCAL(c.c), (X)))
+
+/*
+ * Values are copied off the stack unless they're tables, or nothing
+ * else can see them because they were pushed with PUSHF.
+ */
 static void
 pop(struct vm *vm, int reg)
 {
 	if (vm->sp) {
+		bool fresh = vm->fresh[vm->sp];
 		struct value v = vm->stack[vm->sp--];
-		if (v.type != VAL_TABLE) v = copy_value(vm->gc, v);
+		if (v.type != VAL_TABLE && !fresh) v = copy_value(vm->gc, v);
 		SETREG(reg, v);
 	}
 }
 
+/* Looks up `i' in the array, table or string `v' for SUBSCR. */
+static void
+subscript(struct vm *vm, struct instruction c, struct value v, struct value i)
+{
+	if (v.type == VAL_ARRAY) {
+		if (i.type != VAL_INT) {
+			error_push(vm->r, *c.loc, ERR_FATAL,
+			           "array requires integer subscript (got %s)",
+			           value_data[i.type].body);
+			return;
+		}
+
+		if (i.integer >= vm->gc->array[v.idx]->len
+		    || i.integer < 0) {
+			SETREG(c.a, NIL);
+			return;
+		}
+
+		SETREG(c.a, array_get(vm->gc->array[v.idx], i.integer));
+	} else if (v.type == VAL_TABLE) {
+		if (i.type != VAL_STR) {
+			error_push(vm->r, *c.loc, ERR_FATAL,
+			           "table requires string subscript (got %s)",
+			           value_data[i.type].body);
+			return;
+		}
+
+		SETREG(c.a,
+		       table_lookup(vm->gc->table[v.idx],
+		                    vm->gc->str[i.idx]));
+	} else if (v.type == VAL_STR) {
+		if (i.type != VAL_INT) {
+			error_push(vm->r, *c.loc, ERR_FATAL,
+			           "string requires integer subscript (got %s)",
+			           value_data[i.type].body);
+			return;
+		}
+
+		if ((size_t)i.integer <= strlen(vm->gc->str[v.idx])) {
+			struct value r;
+			r.type = VAL_STR;
+			r.idx = gc_alloc(vm->gc, VAL_STR);
+			vm->gc->str[r.idx] = strclone(" ");
+			vm->gc->str[r.idx][0] = vm->gc->str[v.idx][i.integer];
+			SETREG(c.a, r);
+		} else {
+			SETREG(c.a, NIL);
+		}
+	} else {
+		SETREG(c.a, NIL);
+	}
+}
+
 static int
 find_undef(struct vm *vm)
 {
@@ -354,6 +509,7 @@ execute_instr(struct vm *vm, struct instruction c)
 	case INSTR_PUSH: push(vm, getreg(vm, c.a));    break;
 	case INSTR_POP:  pop(vm, c.a);                 break;
 	case INSTR_CALL: call(vm, getreg(vm, c.a));    break;
+	case INSTR_TCALL: tailcall(vm, getreg(vm, c.a)); break;
 	case INSTR_RET:  ret(vm);                      break;
 	case INSTR_ADD:  BIN(OP_ADD);                  break;
 	case INSTR_SUB:  BIN(OP_SUB);                  break;
@@ -373,6 +529,62 @@ execute_instr(struct vm *vm, struct instruction c)
 	case INSTR_SRIGHT: BIN(OP_RIGHT);              break;
 	case INSTR_INC: UN(OP_ADDADD);                 break;
 	case INSTR_DEC: UN(OP_SUBSUB);                 break;
+	case INSTR_ADD_II:  IBIN(+);                   break;
+	case INSTR_SUB_II:  IBIN(-);                   break;
+	case INSTR_MUL_II:  IBIN(*);                   break;
+	case INSTR_CMP_II:  ICMP(==);                  break;
+	case INSTR_LESS_II: ICMP(<);                   break;
+	case INSTR_LEQ_II:  ICMP(<=);                  break;
+	case INSTR_GEQ_II:  ICMP(>=);                  break;
+	case INSTR_MORE_II: ICMP(>);                   break;
+	case INSTR_INC_I:   LOCAL(c.a).integer++;      break;
+	case INSTR_DEC_I:   LOCAL(c.a).integer--;      break;
+	case INSTR_MOV_U:   PUTREG(c.a, LOCAL(c.b));   break;
+	case INSTR_PUSH_U:  push(vm, LOCAL(c.a));      break;
+	case INSTR_PUSHF_U:
+		push(vm, LOCAL(c.a));
+		vm->fresh[vm->sp] = true;
+		break;
+
+	case INSTR_COPY_U:
+		PUTREG(c.a, copy_value(vm->gc, LOCAL(c.b)));
+		break;
+
+	case INSTR_ARG_U: {
+		struct value v = LOCAL(c.b);
+		PUTREG(c.a, v.type == VAL_TABLE ? v : copy_value(vm->gc, v));
+	} break;
+
+	case INSTR_COND_U:
+		if (is_truthy(vm->gc, LOCAL(c.a))) vm->ip++;
+		break;
+
+	case INSTR_NCOND_U:
+		if (!is_truthy(vm->gc, LOCAL(c.a))) vm->ip++;
+		break;
+
+	case INSTR_ADD_U:    BIN_U(OP_ADD);            break;
+	case INSTR_SUB_U:    BIN_U(OP_SUB);            break;
+	case INSTR_MUL_U:    BIN_U(OP_MUL);            break;
+	case INSTR_POW_U:    BIN_U(OP_POW);            break;
+	case INSTR_DIV_U:    BIN_U(OP_DIV);            break;
+	case INSTR_MOD_U:    BIN_U(OP_MOD);            break;
+	case INSTR_CMP_U:    BIN_U(OP_CMP);            break;
+	case INSTR_LESS_U:   BIN_U(OP_LESS);           break;
+	case INSTR_LEQ_U:    BIN_U(OP_LEQ);            break;
+	case INSTR_GEQ_U:    BIN_U(OP_GEQ);            break;
+	case INSTR_MORE_U:   BIN_U(OP_MORE);           break;
+	case INSTR_BAND_U:   BIN_U(OP_BAND);           break;
+	case INSTR_XOR_U:    BIN_U(OP_XOR);            break;
+	case INSTR_BOR_U:    BIN_U(OP_BOR);            break;
+	case INSTR_SLEFT_U:  BIN_U(OP_LEFT);           break;
+	case INSTR_SRIGHT_U: BIN_U(OP_RIGHT);          break;
+	case INSTR_NEG_U: SETREG(c.a, val_unop(LOCAL(c.b), OP_SUB)); break;
+	case INSTR_INC_U: SETREG(c.a, val_unop(LOCAL(c.a), OP_ADDADD)); break;
+	case INSTR_DEC_U: SETREG(c.a, val_unop(LOCAL(c.a), OP_SUBSUB)); break;
+	case INSTR_FLIP_U: SETREG(c.a, flip_value(vm->gc, LOCAL(c.b))); break;
+	case INSTR_LEN_U: SETREG(c.a, value_len(vm->gc, LOCAL(c.b))); break;
+
 	case INSTR_MSET: vm->match = c.a;              break;
 	case INSTR_MINC:
 		if (vm->match == 65535) vm->match = 0;
@@ -387,6 +599,10 @@ execute_instr(struct vm *vm, struct instruction c)
 		if (!vm->debug && vm->k->talkative) fputc('\n', vm->f);
 		break;
 
+	case INSTR_FRAME:
+		vm->frame_size[vm->fp] = c.a;
+		break;
+
 	case INSTR_CHKSTCK:
 		/* if (vm->sp) */
 		/* 	error_push(vm->r, *c.loc, ERR_FATAL, "invalid number of arguments passed to function (received %d too many)", vm->sp); */
@@ -404,6 +620,18 @@ execute_instr(struct vm *vm, struct instruction c)
 		SETREG(c.a, copy_value(vm->gc, CONST(c.b)));
 		break;
 
+	case INSTR_PUSHF:
+		push(vm, getreg(vm, c.a));
+		vm->fresh[vm->sp] = true;
+		break;
+
+	case INSTR_ARG: {
+		/* Passes a value the way pop() hands it to a function. */
+		struct value v = getreg(vm, c.b);
+		if (v.type != VAL_TABLE) v = copy_value(vm->gc, v);
+		SETREG(c.a, v);
+	} break;
+
 	case INSTR_MOVC:
 		SETREG(c.a, CONST(c.b));
 		break;
@@ -451,57 +679,26 @@ execute_instr(struct vm *vm, struct instruction c)
 		SETREG(c.a, v);
 	} break;
 
-	case INSTR_SUBSCR:
+	case INSTR_SUBSCRU:
+		/* The index has already been checked against the length. */
 		if (getreg(vm, c.b).type == VAL_ARRAY) {
-			if (getreg(vm, c.c).type != VAL_INT) {
-				error_push(vm->r, *c.loc, ERR_FATAL,
-				           "array requires integer subscript (got %s)",
-				           value_data[getreg(vm, c.c).type].body);
-				return;
-			}
-
-			if (getreg(vm, c.c).integer >= vm->gc->array[getreg(vm, c.b).idx]->len
-			    || getreg(vm, c.c).integer < 0) {
-				struct value v;
-				v.type = VAL_NIL;
-				SETREG(c.a, v);
-				break;
-			}
+			SETREG(c.a, array_get(vm->gc->array[getreg(vm, c.b).idx],
+			                      getreg(vm, c.c).integer));
+			break;
+		}
 
-			SETREG(c.a, vm->gc->array[getreg(vm, c.b).idx]->v
-			       [getreg(vm, c.c).integer]);
-		} else if (getreg(vm, c.b).type == VAL_TABLE) {
-			if (getreg(vm, c.c).type != VAL_STR) {
-				error_push(vm->r, *c.loc, ERR_FATAL,
-				           "table requires string subscript (got %s)",
-				           value_data[getreg(vm, c.c).type].body);
-				return;
-			}
+		/* fallthrough */
+	case INSTR_SUBSCR: {
+		struct value v = getreg(vm, c.b);
 
-			SETREG(c.a,
-			       table_lookup(vm->gc->table[getreg(vm, c.b).idx],
-			                    vm->gc->str[getreg(vm, c.c).idx]));
-		} else if (getreg(vm, c.b).type == VAL_STR) {
-			if (getreg(vm, c.c).type != VAL_INT) {
-				error_push(vm->r, *c.loc, ERR_FATAL,
-				           "string requires integer subscript (got %s)",
-				           value_data[getreg(vm, c.c).type].body);
-				return;
-			}
-
-			if ((size_t)getreg(vm, c.c).integer <= strlen(vm->gc->str[getreg(vm, c.b).idx])) {
-				struct value v;
-				v.type = VAL_STR;
-				v.idx = gc_alloc(vm->gc, VAL_STR);
-				vm->gc->str[v.idx] = strclone(" ");
-				vm->gc->str[v.idx][0] = vm->gc->str[getreg(vm, c.b).idx][getreg(vm, c.c).integer];
-				SETREG(c.a, v);
-			} else {
-				SETREG(c.a, NIL);
-			}
-		} else {
+		if (v.type == VAL_ARRAY || v.type == VAL_TABLE || v.type == VAL_STR)
+			subscript(vm, c, v, getreg(vm, c.c));
+		else
 			SETREG(c.a, NIL);
-		}
+	} break;
+
+	case INSTR_SUBSCR_U:
+		subscript(vm, c, LOCAL(c.b), LOCAL(c.c));
 		break;
 
 #define CHECKREG(X,...)	  \
@@ -561,6 +758,8 @@ execute_instr(struct vm *vm, struct instruction c)
 			char *a = show_value(vm->gc, getreg(vm, c.c));
 			char *b = strclone(vm->gc->str[v.idx]);
 
+			detach_subject(vm, v.idx);
+
 			vm->gc->str[v.idx] = oak_realloc(vm->gc->str[v.idx],
 			                                 strlen(b)
 			                                 + strlen(a) + 1);
@@ -596,12 +795,10 @@ execute_instr(struct vm *vm, struct instruction c)
 
 		if (getreg(vm, c.a).type == VAL_ARRAY
 		    && getreg(vm, c.b).type == VAL_INT) {
-			int idx = getreg(vm, c.b).integer;
-			struct array *a = vm->gc->array[getreg(vm, c.a).idx];
-
-			grow_array(a, idx + 1);
-			if ((int)a->len <= idx) a->len = idx + 1;
-			a->v[idx] = getreg(vm, c.c);
+			CHECKREG(getreg(vm, c.b).integer < 0,
+			         "subscript on array requires positive index");
+			array_set(vm->gc->array[getreg(vm, c.a).idx],
+			          getreg(vm, c.b).integer, getreg(vm, c.c));
 		}
 
 		/* TODO: is this all right? */
@@ -673,30 +870,21 @@ execute_instr(struct vm *vm, struct instruction c)
 			return;
 		}
 
-		/*
-		 * This is necessary because we might want to add a
-		 * new element just by setting it.
-		 */
-
-		grow_array(vm->gc->array[getreg(vm, c.b).idx], getreg(vm, c.c).integer + 1);
-
 		if (getreg(vm, c.c).integer < vm->gc->array[getreg(vm, c.b).idx]->len &&
-		    (vm->gc->array[getreg(vm, c.b).idx]->v[getreg(vm, c.c).integer].type == VAL_ARRAY
-		    || vm->gc->array[getreg(vm, c.b).idx]->v[getreg(vm, c.c).integer].type == VAL_TABLE)) {
-			SETREG(c.a, vm->gc->array[getreg(vm, c.b).idx]->v
-			       [getreg(vm, c.c).integer]);
+		    (array_get(vm->gc->array[getreg(vm, c.b).idx], getreg(vm, c.c).integer).type == VAL_ARRAY
+		    || array_get(vm->gc->array[getreg(vm, c.b).idx], getreg(vm, c.c).integer).type == VAL_TABLE)) {
+			SETREG(c.a, array_get(vm->gc->array[getreg(vm, c.b).idx], getreg(vm, c.c).integer));
 		} else {
 			struct value v;
 			v.type = VAL_ARRAY;
 			v.idx = gc_alloc(vm->gc, VAL_ARRAY);
 			vm->gc->array[v.idx] = new_array();
 
-			if (getreg(vm, c.c).integer >= vm->gc->array[getreg(vm, c.b).idx]->len) {
-				grow_array(vm->gc->array[getreg(vm, c.b).idx], getreg(vm, c.c).integer + 1);
-				vm->gc->array[getreg(vm, c.b).idx]->len = getreg(vm, c.c).integer + 1;
-			}
-
-			vm->gc->array[getreg(vm, c.b).idx]->v[getreg(vm, c.c).integer] = v;
+			/*
+			 * This is necessary because we might want to add a
+			 * new element just by setting it.
+			 */
+			array_set(vm->gc->array[getreg(vm, c.b).idx], getreg(vm, c.c).integer, v);
 
 			SETREG(c.a, v);
 		}
@@ -754,9 +942,111 @@ execute_instr(struct vm *vm, struct instruction c)
 
 	case INSTR_RESETR:
 		assert(getreg(vm, c.a).type == VAL_REGEX);
-		vm->gc->regex[getreg(vm, c.a).idx]->cont = 0;
+		ktre_rewind(vm->gc->regex[getreg(vm, c.a).idx]);
 		break;
 
+	case INSTR_NEXTM: {
+		CHECKREG(getreg(vm, c.d).type != VAL_REGEX,
+		         "attempt to apply match to non regular expression value (got %s)",
+		         value_data[getreg(vm, c.d).type].body);
+		CHECKREG(getreg(vm, c.c).type != VAL_STR,
+		         "attempt to apply regular expression to non-string value (got %s)",
+		         value_data[getreg(vm, c.c).type].body);
+
+		struct ktre *re = vm->gc->regex[getreg(vm, c.d).idx];
+		int64_t idx = getreg(vm, c.c).idx;
+
+		/*
+		 * The subject of the last iteration is still good as
+		 * long as it's the same string and nobody has changed it,
+		 * which saves measuring it again every time around.
+		 */
+		if (!vm->subject || vm->subject->idx != idx) {
+			release_subject(vm->subject);
+			vm->subject = new_subject(vm->gc->str[idx], idx);
+		}
+
+		if (vm->subject->len < 0)
+			vm->subject->len = strlen(vm->subject->s);
+
+		int **vec = NULL;
+		bool ret = ktre_next(re, vm->subject->s, vm->subject->len, &vec);
+
+		vm->re = re;
+		vm->match = re->num_matches - 1;
+
+		if (!ret && re->err) {
+			struct location loc = *c.loc;
+			loc.len = 1;
+			loc.index += re->loc;
+
+			error_push(vm->r, loc, ERR_FATAL,
+			           "regex failed at runtime with error code %d: %s",
+			           re->err,
+			           re->err_str ? re->err_str : "no error message");
+			return;
+		}
+
+		SETREG(c.a, BOOL(ret));
+		if (!ret) return;
+
+		struct value v;
+		v.type = VAL_STR;
+		v.idx = gc_alloc(vm->gc, VAL_STR);
+		vm->gc->str[v.idx] = oak_malloc(vec[0][1] + 1);
+		memcpy(vm->gc->str[v.idx], vm->subject->s + vec[0][0], vec[0][1]);
+		vm->gc->str[v.idx][vec[0][1]] = 0;
+		SETREG(c.b, v);
+	} break;
+
+	case INSTR_WHICH: {
+		CHECKREG(getreg(vm, c.b).type != VAL_STR,
+		         "attempt to apply regular expression to non-string value (got %s)",
+		         value_data[getreg(vm, c.b).type].body);
+
+		struct ktre *re = vm->gc->regex[getreg(vm, c.c).idx];
+		int64_t idx = getreg(vm, c.b).idx;
+
+		if (!vm->subject || vm->subject->idx != idx) {
+			release_subject(vm->subject);
+			vm->subject = new_subject(vm->gc->str[idx], idx);
+		}
+
+		if (vm->subject->len < 0)
+			vm->subject->len = strlen(vm->subject->s);
+
+		SETREG(c.a, INT(ktre_which(re, vm->subject->s, vm->subject->len)));
+
+		/*
+		 * The arms that are skipped over would have left a failed
+		 * match behind them.
+		 */
+		vm->re = re;
+		vm->match = -1;
+	} break;
+
+	/*
+	 * Case k of these goes to the k-th jump after them, and the
+	 * first one is for a subject that isn't any of the keys.
+	 */
+	case INSTR_JTAB: {
+		struct value v = getreg(vm, c.a);
+		uint64_t k = (uint64_t)v.integer - (uint64_t)CONST(c.b).integer;
+		if (v.type == VAL_INT && k < (uint64_t)c.c - 1) vm->ip += k + 1;
+	} break;
+
+	case INSTR_HTAB: {
+		struct value v = getreg(vm, c.a);
+		char buf[32], *key = buf;
+		if (v.type != c.d) break;
+
+		if (v.type == VAL_STR) key = vm->gc->str[v.idx];
+		else snprintf(buf, sizeof buf, "%"PRId64, v.integer);
+
+		struct value k = table_lookup(vm->gc->table[CONST(c.b).idx], key);
+		if (k.type == VAL_INT) vm->ip += k.integer;
+	} break;
+
 	case INSTR_MATCH: {
 		CHECKREG(getreg(vm, c.c).type != VAL_REGEX,
 		         "attempt to apply match to non regular expression value (got %s)",
@@ -765,15 +1055,13 @@ execute_instr(struct vm *vm, struct instruction c)
 		         "attempt to apply regular expression to non-string value (got %s)",
 		         value_data[getreg(vm, c.b).type].body);
 
-		free(vm->subject);
-		vm->subject = NULL;
-
 		int **vec = NULL;
 		struct ktre *re = vm->gc->regex[getreg(vm, c.c).idx];
 		char *subject = vm->gc->str[getreg(vm, c.b).idx];
 		bool ret = ktre_exec(re, subject, &vec);
 
-		vm->subject = strclone(subject);
+		release_subject(vm->subject);
+		vm->subject = new_subject(subject, getreg(vm, c.b).idx);
 		vm->re = re;
 
 		SETR(c.a, type, VAL_ARRAY);
@@ -810,11 +1098,9 @@ execute_instr(struct vm *vm, struct instruction c)
 		assert(getreg(vm, c.b).type == VAL_REGEX);
 		assert(getreg(vm, c.c).type == VAL_STR);
 
-		free(vm->subject);
-		vm->subject = NULL;
-
 		struct ktre *re = vm->gc->regex[getreg(vm, c.b).idx];
-		char *subject = strclone(vm->gc->str[getreg(vm, c.a).idx]);
+		struct subject *sub = new_subject(strclone(vm->gc->str[getreg(vm, c.a).idx]), -1);
+		char *subject = sub->s;
 		char *subst = vm->gc->str[getreg(vm, c.c).idx];
 
 		struct value v;
@@ -827,6 +1113,7 @@ execute_instr(struct vm *vm, struct instruction c)
 
 			if (re->err) {
 				error_push(vm->r, *c.loc, ERR_FATAL, "regex failed at runtime with %d: %s", re->err, re->err_str ? re->err_str : "no message");
+				release_subject(sub);
 				return;
 			} else if (ret) {
 				vm->gc->str[v.idx] = ret;
@@ -838,6 +1125,7 @@ execute_instr(struct vm *vm, struct instruction c)
 			ktre_exec(re, subject, &vec);
 
 			if (!re->num_matches) {
+				release_subject(sub);
 				v.type = VAL_NIL;
 				SETREG(c.a, v);
 				return;
@@ -852,25 +1140,21 @@ execute_instr(struct vm *vm, struct instruction c)
 				vm->match = i;
 
 				for (int j = 0; j < getreg(vm, c.b).e; j++) {
-					free(vm->subject);
 					vm->re = re;
-					vm->subject = strclone(subject);
+					set_subject(vm, sub);
 
 					SETREG(c.c, eval(vm, s, c.d,
 					                 *c.loc, find_undef(vm)));
 
 					if (vm->r->pending) {
-						free(vm->subject);
-						vm->subject = NULL;
-						free(subject);
+						release_subject(sub);
 						free(a);
 						free(s);
 						return;
 					}
 
 					vm->re = re;
-					free(vm->subject);
-					vm->subject = strclone(subject);
+					set_subject(vm, sub);
 
 					free(s);
 					s = show_value(vm->gc, getreg(vm, c.c));
@@ -895,8 +1179,9 @@ execute_instr(struct vm *vm, struct instruction c)
 			vm->gc->str[v.idx] = a;
 		}
 
-		free(subject);
 		vm->re = re;
+		set_subject(vm, sub);
+		release_subject(sub);
 		SETREG(c.a, v);
 	} break;
 
@@ -914,14 +1199,17 @@ execute_instr(struct vm *vm, struct instruction c)
 		}
 
 		int m = vm->match;
-		int **vec = ktre_getvec(vm->re);
+		int g = getreg(vm, c.b).integer;
 
-		/* TODO: check that it's not beyond the end of the thing */
-		if (m < 0) {
-			for (int i = 0; i < vm->re->num_matches; i++)
-				free(vec[i]);
+		if (m < 0 || m >= vm->re->num_matches) {
+			SETR(c.a, type, VAL_NIL);
+			return;
+		}
 
-			free(vec);
+		const int *vec = ktre_borrowvec(vm->re)[m];
+
+		/* the group didn't take part in the match */
+		if (vec[g * 2] < 0 || vec[g * 2 + 1] < 0) {
 			SETR(c.a, type, VAL_NIL);
 			return;
 		}
@@ -930,14 +1218,10 @@ execute_instr(struct vm *vm, struct instruction c)
 		v.type = VAL_STR;
 		v.idx = gc_alloc(vm->gc, VAL_STR);
 
-		vm->gc->str[v.idx] = oak_malloc(vec[m][getreg(vm, c.b).integer * 2 + 1] + 1);
-		strncpy(vm->gc->str[v.idx], vm->subject + vec[m][getreg(vm, c.b).integer * 2], vec[m][getreg(vm, c.b).integer * 2 + 1]);
-		vm->gc->str[v.idx][vec[m][getreg(vm, c.b).integer * 2 + 1]] = 0;
-
-		for (int i = 0; i < vm->re->num_matches; i++)
-			free(vec[i]);
+		vm->gc->str[v.idx] = oak_malloc(vec[g * 2 + 1] + 1);
+		memcpy(vm->gc->str[v.idx], vm->subject->s + vec[g * 2], vec[g * 2 + 1]);
+		vm->gc->str[v.idx][vec[g * 2 + 1]] = 0;
 
-		free(vec);
 		SETREG(c.a, v);
 	} break;
 
@@ -953,24 +1237,21 @@ execute_instr(struct vm *vm, struct instruction c)
 		int len = 0;
 		ktre *re = vm->gc->regex[getreg(vm, c.c).idx];
 		char *subject = vm->gc->str[getreg(vm, c.b).idx];
-		char **split = ktre_split(re, subject, &len);
+		int const *span = ktre_split_spans(re, subject, &len);
 
 		SETR(c.a, type, VAL_ARRAY);
 		SETR(c.a, idx, gc_alloc(vm->gc, VAL_ARRAY));
 		vm->gc->array[getreg(vm, c.a).idx] = new_array();
 
-		for (int i = 0; i < len; i++) {
+		for (int i = 0; span && i < len; i++) {
 			struct value v;
 			v.type = VAL_STR;
 			v.idx = gc_alloc(vm->gc, VAL_STR);
-			vm->gc->str[v.idx] = oak_malloc(strlen(split[i]) + 1);
-			strcpy(vm->gc->str[v.idx], split[i]);
+			vm->gc->str[v.idx] = oak_malloc(span[2 * i + 1] + 1);
+			memcpy(vm->gc->str[v.idx], subject + span[2 * i], span[2 * i + 1]);
+			vm->gc->str[v.idx][span[2 * i + 1]] = 0;
 			array_push(vm->gc->array[getreg(vm, c.a).idx], v);
-
-			free(split[i]);
 		}
-
-		free(split);
 	} break;
 
 	case INSTR_JOIN: {
@@ -1006,7 +1287,7 @@ execute_instr(struct vm *vm, struct instruction c)
 		size_t arrlen = vm->gc->array[getreg(vm, c.c).idx]->len;
 
 		for (size_t i = 0; i < arrlen - 1; i++) {
-			char *b = show_value(vm->gc, vm->gc->array[getreg(vm, c.c).idx]->v[i]);
+			char *b = show_value(vm->gc, array_get(vm->gc->array[getreg(vm, c.c).idx], i));
 			a = oak_realloc(a, strlen(a) + strlen(b)
 			                + strlen(vm->gc->str[getreg(vm, c.b).idx]) + 1);
 			strcat(a, b);
@@ -1014,7 +1295,7 @@ execute_instr(struct vm *vm, struct instruction c)
 			free(b);
 		}
 
-		char *b = show_value(vm->gc, vm->gc->array[getreg(vm, c.c).idx]->v[arrlen - 1]);
+		char *b = show_value(vm->gc, array_get(vm->gc->array[getreg(vm, c.c).idx], arrlen - 1));
 		a = oak_realloc(a, strlen(a) + strlen(b) + 1);
 		strcat(a, b);
 		free(b);
@@ -1057,6 +1338,15 @@ execute_instr(struct vm *vm, struct instruction c)
 		SETREG(c.a, sort_value(vm->gc, getreg(vm, c.b)));
 		break;
 
+	/* The operands of these were made just for them. */
+	case INSTR_IREV:
+		SETREG(c.a, rev_fresh_value(vm->gc, getreg(vm, c.b)));
+		break;
+
+	case INSTR_ISORT:
+		SETREG(c.a, sort_fresh_value(vm->gc, getreg(vm, c.b)));
+		break;
+
 	case INSTR_COUNT: {
 		if (getreg(vm, c.b).type != VAL_ARRAY) {
 			error_push(vm->r, *c.loc, ERR_FATAL,
@@ -1069,12 +1359,21 @@ execute_instr(struct vm *vm, struct instruction c)
 		v.type = VAL_INT;
 		v.integer = 0;
 
-		for (size_t i = 0; i < vm->gc->array[getreg(vm, c.b).idx]->len; i++) {
-			if (is_truthy(vm->gc,
-			              val_binop(vm->gc,
-			                         vm->gc->array[getreg(vm, c.b).idx]->v[i],
-			                        getreg(vm, c.c), OP_CMP)))
-				v.integer++;
+		struct array *a = vm->gc->array[getreg(vm, c.b).idx];
+		struct value x = getreg(vm, c.c);
+
+		if (a->kind == ARRAY_INTS) {
+			if (x.type == VAL_INT)
+				for (size_t i = 0; i < a->len; i++)
+					v.integer += a->ints[ARRAY_SLOT(a, i)] == x.integer;
+		} else if (a->kind == ARRAY_REALS) {
+			if (x.type == VAL_FLOAT)
+				for (size_t i = 0; i < a->len; i++)
+					v.integer += fcmp(a->reals[ARRAY_SLOT(a, i)], x.real);
+		} else {
+			for (size_t i = 0; i < a->len; i++)
+				if (is_truthy(vm->gc, val_binop(vm->gc, array_get(a, i), x, OP_CMP)))
+					v.integer++;
 		}
 
 		SETREG(c.a, v);
@@ -1178,12 +1477,12 @@ execute_instr(struct vm *vm, struct instruction c)
 		v.idx = gc_alloc(vm->gc, VAL_ARRAY);
 		vm->gc->array[v.idx] = new_array();
 
-		for (int i = 0; i < TABLE_SIZE; i++) {
-			struct bucket b = vm->gc->table[getreg(vm, c.b).idx]->bucket[i];
-			for (size_t j = 0; j < b.len; j++) {
-				array_push(vm->gc->array[v.idx], b.val[j]);
-			}
-		}
+		struct table_iter it;
+		struct value elem;
+
+		table_iter(&it, vm->gc->table[getreg(vm, c.b).idx]);
+		while (table_next(&it, NULL, &elem))
+			array_push(vm->gc->array[v.idx], elem);
 
 		SETREG(c.a, v);
 	} break;
@@ -1198,15 +1497,16 @@ execute_instr(struct vm *vm, struct instruction c)
 		v.idx = gc_alloc(vm->gc, VAL_ARRAY);
 		vm->gc->array[v.idx] = new_array();
 
-		for (int i = 0; i < TABLE_SIZE; i++) {
-			struct bucket b = vm->gc->table[getreg(vm, c.b).idx]->bucket[i];
-			for (size_t j = 0; j < b.len; j++) {
-				struct value str;
-				str.type = VAL_STR;
-				str.idx = gc_alloc(vm->gc, VAL_STR);
-				vm->gc->str[str.idx] = strclone(b.key[j]);
-				array_push(vm->gc->array[v.idx], str);
-			}
+		struct table_iter it;
+		char *key;
+
+		table_iter(&it, vm->gc->table[getreg(vm, c.b).idx]);
+		while (table_next(&it, &key, NULL)) {
+			struct value str;
+			str.type = VAL_STR;
+			str.idx = gc_alloc(vm->gc, VAL_STR);
+			vm->gc->str[str.idx] = strclone(key);
+			array_push(vm->gc->array[v.idx], str);
 		}
 
 		SETREG(c.a, v);
@@ -1254,7 +1554,8 @@ execute_instr(struct vm *vm, struct instruction c)
 				a = vm->gc->array[t.idx];
 			else {
 				a = new_array();
-				vm->gc->array[gc_alloc(vm->gc, VAL_ARRAY)] = a;
+				int64_t idx = gc_alloc(vm->gc, VAL_ARRAY);
+				vm->gc->array[idx] = a;
 				array_push(a, t);
 			}
 		} else {
@@ -1277,8 +1578,8 @@ execute_instr(struct vm *vm, struct instruction c)
 		*vm->gc->str[v.idx] = 0;
 
 		for (size_t i = 0; i < a->len; i++)
-			if (a->v[i].type == VAL_INT)
-				append_char(vm->gc->str[v.idx], a->v[i].integer);
+			if (array_get(a, i).type == VAL_INT)
+				append_char(vm->gc->str[v.idx], array_get(a, i).integer);
 
 		SETREG(c.a, v);
 	} break;
@@ -1322,10 +1623,10 @@ execute_instr(struct vm *vm, struct instruction c)
 				array_push(a, INT(str[i]));
 		} else {
 			for (size_t i = 0; i < vm->gc->array[s.idx]->len; i++) {
-				if (vm->gc->array[s.idx]->v[i].type != VAL_STR)
+				if (array_get(vm->gc->array[s.idx], i).type != VAL_STR)
 					continue;
 
-				char *str = vm->gc->str[vm->gc->array[s.idx]->v[i].idx];
+				char *str = vm->gc->str[array_get(vm->gc->array[s.idx], i).idx];
 				for (size_t j = 0; j < strlen(str); j++)
 					array_push(a, INT(str[j]));
 			}
@@ -1445,7 +1746,7 @@ execute_instr(struct vm *vm, struct instruction c)
 		if (getreg(vm, c.b).type == VAL_ARRAY) {
 			struct array *a = vm->gc->array[getreg(vm, c.b).idx];
 			if (a->len == 0) SETREG(c.a, NIL);
-			else SETREG(c.a, a->v[a->len - 1]);
+			else SETREG(c.a, array_get(a, a->len - 1));
 		} else if (getreg(vm, c.b).type == VAL_STR) {
 			char *s = vm->gc->str[getreg(vm, c.b).idx];
 			if (strlen(s) == 0)